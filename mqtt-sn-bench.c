@@ -0,0 +1,731 @@
+/*
+  MQTT-SN multi-session load generator
+  Copyright (C) Nicholas Humfrey
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+
+#include "mqtt-sn.h"
+
+#define BENCH_STATE_CONNECTING     (0)
+#define BENCH_STATE_REGISTERING    (1)
+#define BENCH_STATE_PUBLISHING     (2)
+#define BENCH_STATE_DISCONNECTING  (3)
+#define BENCH_STATE_DONE           (4)
+
+#define BENCH_MAX_QOS_MIX          (16)
+
+const char *client_id_prefix = NULL;
+const char *topic_prefix = "bench";
+const char *mqtt_sn_host = "127.0.0.1";
+const char *mqtt_sn_port = MQTT_SN_DEFAULT_PORT;
+uint32_t client_count = 10;
+uint32_t message_count = 10;
+double message_rate = 1;
+uint16_t payload_size = 16;
+uint16_t topic_count = 1;
+uint8_t hot_topic_percent = 0;
+uint16_t keep_alive = MQTT_SN_DEFAULT_KEEP_ALIVE;
+uint16_t max_inflight = 1;
+uint32_t timeout = 0;
+int8_t qos_mix[BENCH_MAX_QOS_MIX] = { 0 };
+uint8_t qos_mix_count = 1;
+uint8_t debug = 0;
+
+uint8_t keep_running = TRUE;
+uint32_t active_sessions = 0;
+char payload[MQTT_SN_MAX_PAYLOAD_LENGTH];
+mqtt_sn_event_loop_t loop;
+
+// QoS 1 PUBLISH waiting for a PUBACK, indexed by message id
+typedef struct {
+    uint16_t message_id;
+    uint8_t in_use;
+    uint64_t sent_at;
+} bench_pending_t;
+
+typedef struct {
+    mqtt_sn_client_t client;
+    mqtt_sn_timer_t timer;
+    char client_id[MQTT_SN_MAX_CLIENT_ID_LENGTH + 1];
+    uint8_t state;
+    uint16_t *topic_ids;
+    uint16_t topic_index;
+    uint16_t request_id;
+    uint64_t request_sent;
+    uint64_t last_send;
+    uint64_t next_publish;
+    uint32_t published;
+    uint32_t qos_index;
+    uint16_t outstanding;
+    bench_pending_t pending[MQTT_SN_MAX_INFLIGHT];
+} bench_session_t;
+
+// Latency samples in microseconds
+typedef struct {
+    uint32_t *samples;
+    size_t count;
+    size_t size;
+} bench_latency_t;
+
+typedef struct {
+    uint32_t connected;
+    uint32_t published;
+    uint32_t acknowledged;
+    uint32_t connect_failed;
+    uint32_t register_failed;
+    uint32_t puback_failed;
+    uint32_t disconnect_failed;
+    bench_latency_t connack;
+    bench_latency_t regack;
+    bench_latency_t puback;
+} bench_stats_t;
+
+bench_stats_t stats;
+
+
+static void usage()
+{
+    fprintf(stderr, "Usage: mqtt-sn-bench [opts]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -c <clients>   Number of client sessions to simulate. Defaults to %u.\n", client_count);
+    fprintf(stderr, "  -d             Increase debug level by one. -d can occur multiple times.\n");
+    fprintf(stderr, "  -h <host>      MQTT-SN host to connect to. Defaults to '%s'.\n", mqtt_sn_host);
+    fprintf(stderr, "  -i <prefix>    Prefix for client IDs, followed by the session number. Defaults to 'bench-' with process id.\n");
+    fprintf(stderr, "  -k <keepalive> keep alive in seconds for each client. Defaults to %d.\n", keep_alive);
+    fprintf(stderr, "  -n <count>     Number of messages to publish from each client. Defaults to %u.\n", message_count);
+    fprintf(stderr, "  -p <port>      Network port to connect to. Defaults to %s.\n", mqtt_sn_port);
+    fprintf(stderr, "  -q <qos,...>   QoS levels (0 or 1) to publish with, used in turn. Defaults to %d.\n", qos_mix[0]);
+    fprintf(stderr, "  -r <rate>      Messages per second from each client, or 0 for as fast as possible. Defaults to %g.\n", message_rate);
+    fprintf(stderr, "  -s <bytes>     Size of the message payload. Defaults to %d.\n", payload_size);
+    fprintf(stderr, "  -t <topic>     Prefix for topic names, followed by the topic number. Defaults to '%s'.\n", topic_prefix);
+    fprintf(stderr, "  -T <topics>    Number of topics to spread messages over. Defaults to %d.\n", topic_count);
+    fprintf(stderr, "  --hot <percent> Percentage of messages published to the first topic. Defaults to an even spread.\n");
+    fprintf(stderr, "  --inflight <n> Maximum number of QoS 1 messages waiting for a PUBACK per client. Defaults to %d.\n", max_inflight);
+    fprintf(stderr, "  --timeout <ms> Time to wait for a reply from the gateway. Defaults to half the keep alive, or %d ms without one.\n", MQTT_SN_DEFAULT_TIMEOUT);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_qos_mix(char *str)
+{
+    char *token;
+
+    qos_mix_count = 0;
+    for (token = strtok(str, ","); token; token = strtok(NULL, ",")) {
+        int value = atoi(token);
+        if (value != 0 && value != 1) {
+            mqtt_sn_log_err("Only QoS level 0 or 1 is supported.");
+            exit(EXIT_FAILURE);
+        }
+        if (qos_mix_count >= BENCH_MAX_QOS_MIX) {
+            mqtt_sn_log_err("No more than %d QoS levels may be given.", BENCH_MAX_QOS_MIX);
+            exit(EXIT_FAILURE);
+        }
+        qos_mix[qos_mix_count++] = value;
+    }
+
+    if (qos_mix_count == 0) {
+        usage();
+    }
+}
+
+static void parse_opts(int argc, char** argv)
+{
+
+    static struct option long_options[] = {
+        {"hot",      required_argument, 0, 1000 },
+        {"inflight", required_argument, 0, 1001 },
+        {"timeout",  required_argument, 0, 1002 },
+        {0, 0, 0, 0}
+    };
+
+    int ch;
+    /* getopt_long stores the option index here. */
+    int option_index = 0;
+
+    // Parse the options/switches
+    while ((ch = getopt_long(argc, argv, "c:dh:i:k:n:p:q:r:s:t:T:?", long_options, &option_index)) != -1) {
+        switch (ch) {
+            case 'c':
+                client_count = atoi(optarg);
+                break;
+
+            case 'd':
+                debug++;
+                break;
+
+            case 'h':
+                mqtt_sn_host = optarg;
+                break;
+
+            case 'i':
+                client_id_prefix = optarg;
+                break;
+
+            case 'k':
+                keep_alive = atoi(optarg);
+                break;
+
+            case 'n':
+                message_count = atoi(optarg);
+                break;
+
+            case 'p':
+                mqtt_sn_port = optarg;
+                break;
+
+            case 'q':
+                parse_qos_mix(optarg);
+                break;
+
+            case 'r':
+                message_rate = atof(optarg);
+                break;
+
+            case 's':
+                payload_size = atoi(optarg);
+                break;
+
+            case 't':
+                topic_prefix = optarg;
+                break;
+
+            case 'T':
+                topic_count = atoi(optarg);
+                break;
+
+            case 1000:
+                hot_topic_percent = atoi(optarg);
+                break;
+
+            case 1001:
+                max_inflight = atoi(optarg);
+                break;
+
+            case 1002:
+                timeout = atoi(optarg);
+                break;
+
+            case '?':
+            default:
+                usage();
+                break;
+        } // switch
+    } // while
+
+    if (client_count < 1 || topic_count < 1 || message_rate < 0) {
+        usage();
+    }
+
+    if (payload_size > MQTT_SN_MAX_PAYLOAD_LENGTH) {
+        mqtt_sn_log_err("Payload size must be %d bytes or less.", MQTT_SN_MAX_PAYLOAD_LENGTH);
+        exit(EXIT_FAILURE);
+    }
+
+    if (hot_topic_percent > 100) {
+        mqtt_sn_log_err("Hot topic percentage must be between 0 and 100.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (max_inflight < 1 || max_inflight > MQTT_SN_MAX_INFLIGHT) {
+        mqtt_sn_log_err("In-flight window must be between 1 and %d.", MQTT_SN_MAX_INFLIGHT);
+        exit(EXIT_FAILURE);
+    }
+
+    // Without a keep alive there is nothing to take half of
+    if (timeout == 0) {
+        timeout = keep_alive ? keep_alive * 500 : MQTT_SN_DEFAULT_TIMEOUT;
+    }
+}
+
+static void termination_handler (int signum)
+{
+    switch(signum) {
+        case SIGHUP:
+            mqtt_sn_log_debug("Got hangup signal.");
+            break;
+        case SIGTERM:
+            mqtt_sn_log_debug("Got termination signal.");
+            break;
+        case SIGINT:
+            mqtt_sn_log_debug("Got interrupt signal.");
+            break;
+    }
+
+    // Signal the main thread to stop
+    keep_running = FALSE;
+}
+
+static uint64_t bench_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void bench_record_latency(bench_latency_t *latency, uint64_t started, uint64_t now)
+{
+    if (latency->count == latency->size) {
+        latency->size = latency->size ? latency->size * 2 : 1024;
+        latency->samples = realloc(latency->samples, latency->size * sizeof(uint32_t));
+        if (!latency->samples) {
+            mqtt_sn_log_err("Failed to allocate memory for latency samples");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    latency->samples[latency->count++] = now - started;
+}
+
+static int bench_compare_samples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_print_latency(const char *name, bench_latency_t *latency)
+{
+    uint32_t *s = latency->samples;
+    size_t n = latency->count;
+
+    if (n == 0) {
+        printf("  %-10s %8d        -        -        -        -        -\n", name, 0);
+        return;
+    }
+
+    qsort(s, n, sizeof(uint32_t), bench_compare_samples);
+    printf("  %-10s %8lu %8.3f %8.3f %8.3f %8.3f %8.3f\n", name, (unsigned long)n,
+           s[0] / 1000.0, s[(n - 1) * 50 / 100] / 1000.0, s[(n - 1) * 90 / 100] / 1000.0,
+           s[(n - 1) * 99 / 100] / 1000.0, s[n - 1] / 1000.0);
+}
+
+static uint16_t bench_pick_topic()
+{
+    if (topic_count == 1) {
+        return 0;
+    } else if (hot_topic_percent && (rand() % 100) < hot_topic_percent) {
+        return 0;
+    } else {
+        return rand() % topic_count;
+    }
+}
+
+static void bench_finish(bench_session_t *session)
+{
+    mqtt_sn_event_unwatch(&loop, session->client.sock);
+    mqtt_sn_timer_stop(&loop, &session->timer);
+    close(session->client.sock);
+    session->state = BENCH_STATE_DONE;
+    active_sessions--;
+}
+
+static void bench_send_register(bench_session_t *session, uint64_t now)
+{
+    char topic_name[MQTT_SN_MAX_TOPIC_LENGTH + 1];
+
+    snprintf(topic_name, sizeof(topic_name), "%s/%u", topic_prefix, session->topic_index);
+    mqtt_sn_send_register(&session->client, topic_name);
+    session->request_id = session->client.next_message_id - 1;
+    session->request_sent = now;
+    session->last_send = now;
+}
+
+static void bench_send_disconnect(bench_session_t *session, uint64_t now)
+{
+    mqtt_sn_send_disconnect(&session->client, 0);
+    session->state = BENCH_STATE_DISCONNECTING;
+    session->request_sent = now;
+    session->last_send = now;
+}
+
+static void bench_process_packet(bench_session_t *session, const uint8_t *packet, uint64_t now)
+{
+    switch (packet[1]) {
+        case MQTT_SN_TYPE_CONNACK: {
+            const connack_packet_t *connack = (const connack_packet_t*)packet;
+            if (session->state != BENCH_STATE_CONNECTING) {
+                break;
+            }
+            if (connack->return_code) {
+                mqtt_sn_log_warn("%s: CONNECT error: %s", session->client_id, mqtt_sn_return_code_string(connack->return_code));
+                stats.connect_failed++;
+                bench_finish(session);
+                break;
+            }
+            bench_record_latency(&stats.connack, session->request_sent, now);
+            stats.connected++;
+            session->state = BENCH_STATE_REGISTERING;
+            session->topic_index = 0;
+            bench_send_register(session, now);
+            break;
+        }
+
+        case MQTT_SN_TYPE_REGACK: {
+            const regack_packet_t *regack = (const regack_packet_t*)packet;
+            if (session->state != BENCH_STATE_REGISTERING || ntohs(regack->message_id) != session->request_id) {
+                break;
+            }
+            if (regack->return_code) {
+                mqtt_sn_log_warn("%s: REGISTER failed: %s", session->client_id, mqtt_sn_return_code_string(regack->return_code));
+                stats.register_failed++;
+                bench_send_disconnect(session, now);
+                break;
+            }
+            bench_record_latency(&stats.regack, session->request_sent, now);
+            session->topic_ids[session->topic_index++] = ntohs(regack->topic_id);
+            if (session->topic_index < topic_count) {
+                bench_send_register(session, now);
+            } else {
+                // Spread the first message of each client across the publishing interval
+                session->state = BENCH_STATE_PUBLISHING;
+                session->next_publish = now;
+                if (message_rate > 0) {
+                    session->next_publish += rand() % (uint64_t)(1000000 / message_rate + 1);
+                }
+            }
+            break;
+        }
+
+        case MQTT_SN_TYPE_PUBACK: {
+            const puback_packet_t *puback = (const puback_packet_t*)packet;
+            uint16_t message_id = ntohs(puback->message_id);
+            bench_pending_t *pending = &session->pending[message_id % MQTT_SN_MAX_INFLIGHT];
+            if (!pending->in_use || pending->message_id != message_id) {
+                break;
+            }
+            if (puback->return_code) {
+                mqtt_sn_log_warn("%s: PUBLISH failed: %s", session->client_id, mqtt_sn_return_code_string(puback->return_code));
+                stats.puback_failed++;
+            } else {
+                bench_record_latency(&stats.puback, pending->sent_at, now);
+                stats.acknowledged++;
+            }
+            pending->in_use = FALSE;
+            session->outstanding--;
+            break;
+        }
+
+        case MQTT_SN_TYPE_PINGRESP:
+            break;
+
+        case MQTT_SN_TYPE_DISCONNECT:
+            if (session->state != BENCH_STATE_DISCONNECTING) {
+                mqtt_sn_log_warn("%s: Received DISCONNECT from gateway", session->client_id);
+                stats.disconnect_failed++;
+            }
+            bench_finish(session);
+            break;
+
+        default:
+            mqtt_sn_log_debug("%s: Ignoring %s packet", session->client_id, mqtt_sn_type_string(packet[1]));
+            break;
+    }
+}
+
+// Send anything that is due and expire requests that have timed out
+// Returns the time that the session next needs attention
+static uint64_t bench_service(bench_session_t *session, uint64_t now)
+{
+    uint64_t timeout_us = (uint64_t)session->client.timeout * 1000;
+    uint64_t keep_alive_us = (uint64_t)keep_alive * 1000000;
+    uint64_t next;
+    uint8_t window_full = FALSE;
+    int i, sent = 0;
+
+    switch (session->state) {
+        case BENCH_STATE_CONNECTING:
+        case BENCH_STATE_REGISTERING:
+        case BENCH_STATE_DISCONNECTING:
+            if (now - session->request_sent < timeout_us) {
+                return session->request_sent + timeout_us;
+            }
+            if (session->state == BENCH_STATE_CONNECTING) {
+                mqtt_sn_log_warn("%s: Timed out waiting for a CONNACK", session->client_id);
+                stats.connect_failed++;
+                bench_finish(session);
+            } else if (session->state == BENCH_STATE_REGISTERING) {
+                mqtt_sn_log_warn("%s: Timed out waiting for a REGACK", session->client_id);
+                stats.register_failed++;
+                bench_send_disconnect(session, now);
+                return now + timeout_us;
+            } else {
+                mqtt_sn_log_warn("%s: Timed out waiting for a DISCONNECT", session->client_id);
+                stats.disconnect_failed++;
+                bench_finish(session);
+            }
+            return UINT64_MAX;
+
+        case BENCH_STATE_PUBLISHING:
+            break;
+
+        default:
+            return UINT64_MAX;
+    }
+
+    // Give up on PUBACKs that have not arrived in time
+    next = UINT64_MAX;
+    for (i = 0; i < MQTT_SN_MAX_INFLIGHT && session->outstanding > 0; i++) {
+        bench_pending_t *pending = &session->pending[i];
+        if (!pending->in_use) {
+            continue;
+        } else if (now - pending->sent_at >= timeout_us) {
+            mqtt_sn_log_warn("%s: Failed to receive PUBACK after PUBLISH (message id 0x%4.4x)", session->client_id, pending->message_id);
+            stats.puback_failed++;
+            pending->in_use = FALSE;
+            session->outstanding--;
+        } else if (pending->sent_at + timeout_us < next) {
+            next = pending->sent_at + timeout_us;
+        }
+    }
+
+    // Publish every message that is due, without starving the other sessions
+    while (session->published < message_count && session->next_publish <= now && sent < MQTT_SN_MAX_BATCH) {
+        int8_t qos = qos_mix[session->qos_index % qos_mix_count];
+        uint16_t topic_index = bench_pick_topic();
+        uint16_t message_id;
+
+        if (qos == 1) {
+            bench_pending_t *pending = &session->pending[session->client.next_message_id % MQTT_SN_MAX_INFLIGHT];
+            if (session->outstanding >= max_inflight || pending->in_use) {
+                // Wait for a PUBACK to open up the window
+                window_full = TRUE;
+                break;
+            }
+        }
+
+        message_id = mqtt_sn_send_publish_nowait(&session->client, session->topic_ids[topic_index],
+                                                 MQTT_SN_TOPIC_TYPE_NORMAL, payload, payload_size, qos, FALSE);
+        if (qos == 1) {
+            bench_pending_t *pending = &session->pending[message_id % MQTT_SN_MAX_INFLIGHT];
+            pending->message_id = message_id;
+            pending->sent_at = now;
+            pending->in_use = TRUE;
+            session->outstanding++;
+            if (now + timeout_us < next) {
+                next = now + timeout_us;
+            }
+        }
+
+        session->qos_index++;
+        session->published++;
+        session->last_send = now;
+        stats.published++;
+        sent++;
+
+        if (message_rate > 0) {
+            session->next_publish += 1000000 / message_rate;
+        }
+    }
+
+    if (session->published >= message_count && session->outstanding == 0) {
+        bench_send_disconnect(session, now);
+        return now + timeout_us;
+    }
+
+    // Keep the session alive while it is idle
+    if (keep_alive_us && now - session->last_send >= keep_alive_us / 2) {
+        mqtt_sn_send_pingreq(&session->client);
+        session->last_send = now;
+    }
+    if (keep_alive_us && session->last_send + keep_alive_us / 2 < next) {
+        next = session->last_send + keep_alive_us / 2;
+    }
+
+    // A full window is woken up by the next PUBACK, or by the earliest one timing out
+    if (session->published < message_count && !window_full && session->next_publish < next) {
+        next = session->next_publish;
+    }
+
+    return next;
+}
+
+// Service the session and wake up again when it next needs attention
+static void bench_schedule(bench_session_t *session)
+{
+    uint64_t now = bench_now_us();
+    uint64_t next = bench_service(session, now);
+
+    if (session->state == BENCH_STATE_DONE) {
+        return;
+    } else if (next == UINT64_MAX) {
+        mqtt_sn_timer_stop(&loop, &session->timer);
+    } else {
+        mqtt_sn_timer_start(&loop, &session->timer, next > now ? (next - now + 999) / 1000 : 0);
+    }
+}
+
+static void bench_timer_handler(void *data)
+{
+    bench_schedule(data);
+}
+
+static void bench_socket_handler(void *data)
+{
+    bench_session_t *session = data;
+    uint64_t now = bench_now_us();
+
+    do {
+        uint8_t *packet = mqtt_sn_receive_packet(&session->client);
+        if (packet) {
+            bench_process_packet(session, packet, now);
+        }
+    } while (session->state != BENCH_STATE_DONE && mqtt_sn_pending_packets(&session->client) > 0);
+
+    if (session->state != BENCH_STATE_DONE) {
+        bench_schedule(session);
+    }
+}
+
+static void bench_raise_file_limit(uint32_t needed)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < needed) {
+        limit.rlim_cur = needed < limit.rlim_max ? needed : limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < needed) {
+            mqtt_sn_log_warn("Open file limit is too low for %u clients", client_count);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    bench_session_t *sessions;
+    char default_prefix[MQTT_SN_MAX_CLIENT_ID_LENGTH + 1];
+    uint32_t i;
+    uint64_t started, finished;
+    double elapsed;
+
+    // Parse the command-line options
+    parse_opts(argc, argv);
+
+    // Enable debugging?
+    mqtt_sn_set_debug(debug);
+
+    if (client_id_prefix == NULL) {
+        snprintf(default_prefix, sizeof(default_prefix), "bench-%d-", getpid());
+        client_id_prefix = default_prefix;
+    }
+
+    // Setup signal handlers
+    signal(SIGTERM, termination_handler);
+    signal(SIGINT, termination_handler);
+    signal(SIGHUP, termination_handler);
+
+    srand(time(NULL) ^ getpid());
+    for (i = 0; i < payload_size; i++) {
+        payload[i] = 'a' + (i % 26);
+    }
+
+    bench_raise_file_limit(client_count + 16);
+
+    mqtt_sn_event_loop_init(&loop);
+
+    sessions = calloc(client_count, sizeof(bench_session_t));
+    if (!sessions) {
+        mqtt_sn_log_err("Failed to allocate memory for %u sessions", client_count);
+        exit(EXIT_FAILURE);
+    }
+
+    // Create a UDP socket for each client and connect them all
+    started = bench_now_us();
+    for (i = 0; i < client_count; i++) {
+        bench_session_t *session = &sessions[i];
+
+        snprintf(session->client_id, sizeof(session->client_id), "%s%u", client_id_prefix, i + 1);
+        session->topic_ids = calloc(topic_count, sizeof(uint16_t));
+        if (!session->topic_ids) {
+            mqtt_sn_log_err("Failed to allocate memory for topic ids");
+            exit(EXIT_FAILURE);
+        }
+
+        mqtt_sn_client_init(&session->client);
+        mqtt_sn_set_timeout(&session->client, timeout);
+        // Only short acknowledgements come back, at most one per message in flight and a PINGRESP,
+        // so keep the receive ring small: it is allocated for every client
+        mqtt_sn_set_receive_batch(&session->client, max_inflight + 1, MQTT_SN_MAX_PACKET_LENGTH);
+        mqtt_sn_create_socket(&session->client, mqtt_sn_host, mqtt_sn_port, 0);
+
+        mqtt_sn_event_watch(&loop, session->client.sock, bench_socket_handler, session);
+        mqtt_sn_timer_init(&session->timer, bench_timer_handler, session);
+        active_sessions++;
+
+        session->state = BENCH_STATE_CONNECTING;
+        session->request_sent = session->last_send = bench_now_us();
+        mqtt_sn_send_connect(&session->client, session->client_id, keep_alive, TRUE);
+        bench_schedule(session);
+    }
+
+    while (keep_running && active_sessions > 0) {
+        if (mqtt_sn_event_loop_run_once(&loop, -1) < 0) {
+            if (errno != EINTR) {
+                perror("event loop");
+                break;
+            }
+        }
+    }
+    finished = bench_now_us();
+    elapsed = (finished - started) / 1000000.0;
+
+    // Report the results
+    printf("Sessions:    %u started, %u connected, %u failed\n", client_count, stats.connected,
+           stats.connect_failed + stats.register_failed);
+    printf("Messages:    %u published, %u acknowledged, %u failed\n", stats.published, stats.acknowledged,
+           stats.puback_failed);
+    printf("Failures:    connect=%u register=%u puback=%u disconnect=%u\n", stats.connect_failed,
+           stats.register_failed, stats.puback_failed, stats.disconnect_failed);
+    printf("Elapsed:     %.3f seconds\n", elapsed);
+    printf("Throughput:  %.1f messages/second\n", elapsed > 0 ? stats.published / elapsed : 0.0);
+    printf("Latency (ms)    count      min      p50      p90      p99      max\n");
+    bench_print_latency("CONNACK", &stats.connack);
+    bench_print_latency("REGACK", &stats.regack);
+    bench_print_latency("PUBACK", &stats.puback);
+
+    mqtt_sn_event_loop_cleanup(&loop);
+    for (i = 0; i < client_count; i++) {
+        if (sessions[i].state != BENCH_STATE_DONE) {
+            close(sessions[i].client.sock);
+        }
+        mqtt_sn_cleanup(&sessions[i].client);
+        free(sessions[i].topic_ids);
+    }
+    free(sessions);
+    free(stats.connack.samples);
+    free(stats.regack.samples);
+    free(stats.puback.samples);
+
+    return 0;
+}
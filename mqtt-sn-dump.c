@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -32,6 +33,9 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "mqtt-sn.h"
 
@@ -40,6 +44,84 @@ uint8_t dump_all = FALSE;
 uint8_t debug = 0;
 uint8_t verbose = 0;
 uint8_t keep_running = TRUE;
+int worker_count = 1;
+int stats_interval = 0;
+
+// Number of packet size buckets, each twice the size of the one before
+#define STATS_SIZE_BUCKETS   (10)
+
+// Number of sources and topics to list in each report
+#define STATS_TOP_ENTRIES    (10)
+
+// Packet and byte counts for one source address or topic
+typedef struct {
+    uint8_t key[17];
+    uint8_t key_len;
+    uint64_t packets;
+    uint64_t bytes;
+} stats_entry_t;
+
+// Open addressing hash table of counts
+typedef struct {
+    stats_entry_t *entries;
+    uint32_t capacity;
+    uint32_t count;
+} stats_table_t;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t invalid;
+    uint64_t type_packets[256];
+    uint64_t type_bytes[256];
+    uint64_t sizes[STATS_SIZE_BUCKETS];
+    stats_table_t sources;
+    stats_table_t topics;
+} dump_stats_t;
+
+struct dump_worker;
+
+typedef struct {
+    mqtt_sn_client_t client;
+    struct dump_worker *worker;
+} dump_socket_t;
+
+// Each worker thread has its own IPv4 and IPv6 socket bound to the port
+typedef struct dump_worker {
+    pthread_t thread;
+    mqtt_sn_event_loop_t loop;
+    dump_socket_t sockets[2];
+    int socket_count;
+    FILE *output;
+    char *output_buffer;
+    size_t output_size;
+    dump_stats_t stats;
+    pthread_mutex_t stats_lock;
+} dump_worker_t;
+
+dump_worker_t *workers = NULL;
+mqtt_sn_timer_t stats_timer;
+dump_stats_t stats_total;
+uint64_t stats_last_report = 0;
+int shutdown_pipe[2];
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Capture file block types and link type, see draft-ietf-opsawg-pcapng
+#define PCAPNG_SECTION_HEADER      (0x0A0D0D0A)
+#define PCAPNG_INTERFACE_DESC      (0x00000001)
+#define PCAPNG_ENHANCED_PACKET     (0x00000006)
+#define PCAPNG_BYTE_ORDER_MAGIC    (0x1A2B3C4D)
+#define PCAPNG_LINKTYPE_RAW        (101)
+#define PCAPNG_BUFFER_SIZE         (1024 * 1024)
+
+const char *capture_path = NULL;
+FILE *capture_file = NULL;
+char *capture_buffer = NULL;
+long capture_rotate_size = 0;
+long capture_written = 0;
+int capture_file_count = 0;
+uint16_t local_port = 0;
 
 
 static void usage()
@@ -48,26 +130,45 @@ static void usage()
     fprintf(stderr, "\n");
     fprintf(stderr, "  -a             Dump all packet types.\n");
     fprintf(stderr, "  -d             Increase debug level by one. -d can occur multiple times.\n");
+    fprintf(stderr, "  -j <threads>   Number of threads receiving and decoding packets. Defaults to %d.\n", worker_count);
     fprintf(stderr, "  -p <port>      Network port to listen on. Defaults to %s.\n", mqtt_sn_port);
     fprintf(stderr, "  -v             Print messages verbosely, showing the topic name.\n");
+    fprintf(stderr, "  -w <file>      Write the raw packets to a pcapng capture file, instead of displaying them.\n");
+    fprintf(stderr, "  -C <size>      Start a new capture file when the current one is larger than <size> megabytes.\n");
+    fprintf(stderr, "  --stats <secs> Display a summary of the traffic every <secs> seconds, instead of each packet.\n");
     exit(EXIT_FAILURE);
 }
 
 static void parse_opts(int argc, char** argv)
 {
+    static struct option long_options[] = {
+        {"stats", required_argument, 0, 1000 },
+        {0, 0, 0, 0}
+    };
+
     int ch;
+    /* getopt_long stores the option index here. */
+    int option_index = 0;
 
     // Parse the options/switches
-    while((ch = getopt(argc, argv, "adp:v?")) != -1)
+    while((ch = getopt_long(argc, argv, "aC:dj:p:vw:?", long_options, &option_index)) != -1)
         switch(ch) {
             case 'a':
                 dump_all = TRUE;
                 break;
 
+            case 'C':
+                capture_rotate_size = atol(optarg) * 1000000;
+                break;
+
             case 'd':
                 debug++;
                 break;
 
+            case 'j':
+                worker_count = atoi(optarg);
+                break;
+
             case 'p':
                 mqtt_sn_port = optarg;
                 break;
@@ -76,38 +177,528 @@ static void parse_opts(int argc, char** argv)
                 verbose++;
                 break;
 
+            case 'w':
+                capture_path = optarg;
+                break;
+
+            case 1000:
+                stats_interval = atoi(optarg);
+                if (stats_interval < 1) {
+                    mqtt_sn_log_err("Statistics interval must be 1 second or more");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case '?':
             default:
                 usage();
                 break;
         }
+
+    if (worker_count < 1) {
+        mqtt_sn_log_err("Number of threads must be 1 or more");
+        exit(EXIT_FAILURE);
+    }
 }
 
-static int bind_udp_socket(const char* port_str)
+// Returns -1 if an IPv6 socket can't be created, IPv4 is required
+static int bind_udp_socket(int family, const char* port_str)
 {
-    struct sockaddr_in si_me;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
     short port = atoi(port_str);
+    int on = 1;
     int sock;
 
-    if ((sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+    if ((sock=socket(family, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+        if (family == AF_INET6) {
+            mqtt_sn_log_debug("Not listening for IPv6: %s", strerror(errno));
+            return -1;
+        }
         perror("socket");
         exit(EXIT_FAILURE);
     }
 
-    memset((char *) &si_me, 0, sizeof(si_me));
-    si_me.sin_family = AF_INET;
-    si_me.sin_port = htons(port);
-    si_me.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(sock, (const struct sockaddr *)&si_me, sizeof(si_me)) == -1) {
-        perror("bind");
+    // Let every worker thread bind a socket to the same port
+    if (worker_count > 1 && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        perror("setsockopt SO_REUSEPORT");
         exit(EXIT_FAILURE);
     }
 
-    mqtt_sn_log_debug("mqtt-sn-dump listening on port %s", port_str);
+    memset((char *) &addr, 0, sizeof(addr));
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *si_me = (struct sockaddr_in6 *)&addr;
+        si_me->sin6_family = AF_INET6;
+        si_me->sin6_port = htons(port);
+        si_me->sin6_addr = in6addr_any;
+        addr_len = sizeof(struct sockaddr_in6);
+
+        // IPv4 packets are received by the other socket
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+    } else {
+        struct sockaddr_in *si_me = (struct sockaddr_in *)&addr;
+        si_me->sin_family = AF_INET;
+        si_me->sin_port = htons(port);
+        si_me->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr_len = sizeof(struct sockaddr_in);
+    }
+
+    if (bind(sock, (const struct sockaddr *)&addr, addr_len) == -1) {
+        if (family == AF_INET6) {
+            mqtt_sn_log_debug("Not listening for IPv6: %s", strerror(errno));
+            close(sock);
+            return -1;
+        }
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
 
     return sock;
 }
 
+static void capture_write(const void *data, size_t len)
+{
+    if (fwrite(data, 1, len, capture_file) != len) {
+        perror("capture file");
+        exit(EXIT_FAILURE);
+    }
+    capture_written += len;
+}
+
+static void capture_write_uint32(uint32_t value)
+{
+    capture_write(&value, sizeof(value));
+}
+
+static void capture_open()
+{
+    char path[FILENAME_MAX];
+
+    // Rotated files have a number added to the end of their name
+    if (capture_file_count == 0) {
+        snprintf(path, sizeof(path), "%s", capture_path);
+    } else {
+        snprintf(path, sizeof(path), "%s.%d", capture_path, capture_file_count);
+    }
+
+    capture_file = fopen(path, "wb");
+    if (!capture_file) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (capture_buffer == NULL) {
+        capture_buffer = malloc(PCAPNG_BUFFER_SIZE);
+        if (!capture_buffer) {
+            mqtt_sn_log_err("Failed to allocate memory for capture buffer");
+            exit(EXIT_FAILURE);
+        }
+    }
+    setvbuf(capture_file, capture_buffer, _IOFBF, PCAPNG_BUFFER_SIZE);
+    capture_written = 0;
+
+    mqtt_sn_log_debug("Writing capture to %s", path);
+
+    // Section Header Block, with an unspecified section length
+    capture_write_uint32(PCAPNG_SECTION_HEADER);
+    capture_write_uint32(28);
+    capture_write_uint32(PCAPNG_BYTE_ORDER_MAGIC);
+    capture_write_uint32(1);
+    capture_write_uint32(0xFFFFFFFF);
+    capture_write_uint32(0xFFFFFFFF);
+    capture_write_uint32(28);
+
+    // Interface Description Block, for raw IP packets in microseconds
+    capture_write_uint32(PCAPNG_INTERFACE_DESC);
+    capture_write_uint32(20);
+    capture_write_uint32(PCAPNG_LINKTYPE_RAW);
+    capture_write_uint32(0);
+    capture_write_uint32(20);
+}
+
+static void capture_close()
+{
+    if (capture_file) {
+        if (fclose(capture_file) != 0) {
+            perror("capture file");
+        }
+        capture_file = NULL;
+    }
+}
+
+static uint32_t checksum_add(uint32_t sum, const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (data[i] << 8) | data[i+1];
+    }
+    if (len & 1) {
+        sum += data[len-1] << 8;
+    }
+
+    return sum;
+}
+
+static uint16_t checksum_finish(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return ~sum;
+}
+
+// Write a datagram to the capture file, inside IP and UDP headers so that
+// the source address is preserved and Wireshark can decode it. The sockets
+// are bound to any address, so the destination address is left as zeros.
+static void capture_datagram(const received_datagram_t *datagram)
+{
+    static const uint8_t padding[3] = {0, 0, 0};
+    uint8_t header[48];
+    uint8_t *udp;
+    size_t header_len, udp_len, len, padded;
+    uint64_t timestamp;
+    uint16_t checksum;
+
+    memset(header, 0, sizeof(header));
+    udp_len = 8 + datagram->length;
+
+    if (datagram->addr.ss_family == AF_INET) {
+        struct sockaddr_in *from = (struct sockaddr_in *)&datagram->addr;
+        header_len = 28;
+        len = header_len + datagram->length;
+        header[0] = 0x45;
+        header[2] = len >> 8;
+        header[3] = len & 0xFF;
+        header[8] = 64;
+        header[9] = IPPROTO_UDP;
+        memcpy(&header[12], &from->sin_addr, 4);
+        checksum = checksum_finish(checksum_add(0, header, 20));
+        header[10] = checksum >> 8;
+        header[11] = checksum & 0xFF;
+        udp = &header[20];
+        memcpy(udp, &from->sin_port, 2);
+    } else if (datagram->addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *from = (struct sockaddr_in6 *)&datagram->addr;
+        header_len = 48;
+        len = header_len + datagram->length;
+        header[0] = 0x60;
+        header[4] = udp_len >> 8;
+        header[5] = udp_len & 0xFF;
+        header[6] = IPPROTO_UDP;
+        header[7] = 64;
+        memcpy(&header[8], &from->sin6_addr, 16);
+        udp = &header[40];
+        memcpy(udp, &from->sin6_port, 2);
+    } else {
+        return;
+    }
+
+    udp[2] = local_port >> 8;
+    udp[3] = local_port & 0xFF;
+    udp[4] = udp_len >> 8;
+    udp[5] = udp_len & 0xFF;
+
+    // The UDP checksum is optional for IPv4 but not for IPv6
+    if (datagram->addr.ss_family == AF_INET6) {
+        uint8_t pseudo[8] = {0, 0, udp_len >> 8, udp_len & 0xFF, 0, 0, 0, IPPROTO_UDP};
+        uint32_t sum = checksum_add(0, &header[8], 32);
+        sum = checksum_add(sum, pseudo, sizeof(pseudo));
+        sum = checksum_add(sum, udp, 8);
+        sum = checksum_add(sum, datagram->data, datagram->length);
+        checksum = checksum_finish(sum);
+        if (checksum == 0) {
+            checksum = 0xFFFF;
+        }
+        udp[6] = checksum >> 8;
+        udp[7] = checksum & 0xFF;
+    }
+
+    padded = (len + 3) & ~3;
+    timestamp = (uint64_t)datagram->timestamp.tv_sec * 1000000 + datagram->timestamp.tv_usec;
+
+    pthread_mutex_lock(&capture_lock);
+
+    // Enhanced Packet Block
+    capture_write_uint32(PCAPNG_ENHANCED_PACKET);
+    capture_write_uint32(32 + padded);
+    capture_write_uint32(0);
+    capture_write_uint32(timestamp >> 32);
+    capture_write_uint32(timestamp & 0xFFFFFFFF);
+    capture_write_uint32(len);
+    capture_write_uint32(len);
+    capture_write(header, header_len);
+    capture_write(datagram->data, datagram->length);
+    capture_write(padding, padded - len);
+    capture_write_uint32(32 + padded);
+
+    if (capture_rotate_size && capture_written >= capture_rotate_size) {
+        capture_close();
+        capture_file_count++;
+        capture_open();
+    }
+
+    pthread_mutex_unlock(&capture_lock);
+}
+
+static uint32_t stats_hash(const uint8_t *key, uint8_t key_len)
+{
+    uint32_t hash = 2166136261u;
+    uint8_t i;
+
+    for (i = 0; i < key_len; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Returns the entry for a key, adding it if it isn't in the table yet
+static stats_entry_t* stats_table_find(stats_table_t *table, const uint8_t *key, uint8_t key_len)
+{
+    stats_entry_t *entry;
+    uint32_t i;
+
+    // Keep the table no more than three quarters full
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        stats_table_t old = *table;
+
+        table->capacity = old.capacity ? old.capacity * 2 : 64;
+        table->entries = calloc(table->capacity, sizeof(stats_entry_t));
+        table->count = 0;
+        if (!table->entries) {
+            mqtt_sn_log_err("Failed to allocate memory for statistics");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < old.capacity; i++) {
+            if (old.entries[i].key_len) {
+                entry = stats_table_find(table, old.entries[i].key, old.entries[i].key_len);
+                entry->packets = old.entries[i].packets;
+                entry->bytes = old.entries[i].bytes;
+            }
+        }
+        free(old.entries);
+    }
+
+    i = stats_hash(key, key_len) & (table->capacity - 1);
+    while (table->entries[i].key_len) {
+        entry = &table->entries[i];
+        if (entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            return entry;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+
+    entry = &table->entries[i];
+    memcpy(entry->key, key, key_len);
+    entry->key_len = key_len;
+    table->count++;
+    return entry;
+}
+
+static void stats_table_add(stats_table_t *table, const uint8_t *key, uint8_t key_len, uint64_t packets, uint64_t bytes)
+{
+    stats_entry_t *entry = stats_table_find(table, key, key_len);
+    entry->packets += packets;
+    entry->bytes += bytes;
+}
+
+static void stats_table_clear(stats_table_t *table)
+{
+    if (table->entries) {
+        memset(table->entries, 0, table->capacity * sizeof(stats_entry_t));
+    }
+    table->count = 0;
+}
+
+static void stats_clear(dump_stats_t *stats)
+{
+    stats_table_t sources = stats->sources;
+    stats_table_t topics = stats->topics;
+
+    memset(stats, 0, sizeof(dump_stats_t));
+    stats->sources = sources;
+    stats->topics = topics;
+    stats_table_clear(&stats->sources);
+    stats_table_clear(&stats->topics);
+}
+
+static void stats_record(mqtt_sn_client_t *client, dump_stats_t *stats, const received_datagram_t *datagram)
+{
+    const uint8_t *packet = datagram->data;
+    size_t length = datagram->length;
+    size_t packet_len;
+    uint8_t key[17];
+    int bucket = 0;
+
+    stats->packets++;
+    stats->bytes += length;
+
+    while (bucket < STATS_SIZE_BUCKETS-1 && (length >> (bucket + 1)) > 0) {
+        bucket++;
+    }
+    stats->sizes[bucket]++;
+
+    // Sources are counted by address, without the port
+    if (datagram->addr.ss_family == AF_INET6) {
+        key[0] = AF_INET6;
+        memcpy(&key[1], &((struct sockaddr_in6 *)&datagram->addr)->sin6_addr, 16);
+        stats_table_add(&stats->sources, key, 17, 1, length);
+    } else {
+        key[0] = AF_INET;
+        memcpy(&key[1], &((struct sockaddr_in *)&datagram->addr)->sin_addr, 4);
+        stats_table_add(&stats->sources, key, 5, 1, length);
+    }
+
+    if (length < 2 || mqtt_sn_validate_packet(client, packet, length) == FALSE) {
+        stats->invalid++;
+        return;
+    }
+
+    // Count the packet inside forwarder encapsulation
+    if (packet[0] != 0x01 && packet[1] == MQTT_SN_TYPE_FRWDENCAP) {
+        packet += packet[0];
+    }
+
+    // The fields of a packet with a three byte length header are two bytes further on
+    if (packet[0] == 0x01) {
+        packet_len = ((packet[1] << 8) | packet[2]) - 2;
+        packet += 2;
+    } else {
+        packet_len = packet[0];
+    }
+
+    stats->type_packets[packet[1]]++;
+    stats->type_bytes[packet[1]] += length;
+
+    if (packet[1] == MQTT_SN_TYPE_PUBLISH && packet_len >= 7) {
+        const publish_packet_t *publish = (const publish_packet_t *)packet;
+        key[0] = publish->flags & 0x3;
+        memcpy(&key[1], &publish->topic_id, 2);
+        stats_table_add(&stats->topics, key, 3, 1, length);
+    }
+}
+
+static int stats_compare(const void *a, const void *b)
+{
+    const stats_entry_t *ea = a;
+    const stats_entry_t *eb = b;
+
+    if (ea->packets != eb->packets) {
+        return ea->packets < eb->packets ? 1 : -1;
+    }
+    return 0;
+}
+
+static void stats_print_table(stats_table_t *table, const char *name, uint8_t addresses)
+{
+    uint32_t i, j;
+
+    // Move the entries to the start of the table and sort by packet count
+    for (i = 0, j = 0; i < table->capacity; i++) {
+        if (table->entries[i].key_len) {
+            table->entries[j++] = table->entries[i];
+        }
+    }
+    qsort(table->entries, j, sizeof(stats_entry_t), stats_compare);
+
+    for (i = 0; i < j && i < STATS_TOP_ENTRIES; i++) {
+        stats_entry_t *entry = &table->entries[i];
+        char label[INET6_ADDRSTRLEN + 16];
+
+        if (addresses) {
+            inet_ntop(entry->key[0], &entry->key[1], label, sizeof(label));
+        } else if (entry->key[0] == MQTT_SN_TOPIC_TYPE_SHORT) {
+            snprintf(label, sizeof(label), "%c%c", entry->key[1], entry->key[2]);
+        } else {
+            snprintf(label, sizeof(label), "0x%2.2x%2.2x%s", entry->key[1], entry->key[2],
+                     entry->key[0] == MQTT_SN_TOPIC_TYPE_PREDEFINED ? " (predefined)" : "");
+        }
+
+        printf("  %s %s packets=%llu bytes=%llu\n", name, label,
+               (unsigned long long)entry->packets, (unsigned long long)entry->bytes);
+    }
+
+    if (j > STATS_TOP_ENTRIES) {
+        printf("  %s ... and %u more\n", name, j - STATS_TOP_ENTRIES);
+    }
+}
+
+// Add up the statistics from every worker and display them
+static void stats_report(uint64_t elapsed_ms)
+{
+    dump_stats_t *total = &stats_total;
+    time_t now = time(NULL);
+    struct tm now_tm;
+    char tm_buffer[40];
+    uint32_t i;
+    int w;
+
+    for (w = 0; w < worker_count; w++) {
+        dump_stats_t *stats = &workers[w].stats;
+
+        pthread_mutex_lock(&workers[w].stats_lock);
+        total->packets += stats->packets;
+        total->bytes += stats->bytes;
+        total->invalid += stats->invalid;
+        for (i = 0; i < 256; i++) {
+            total->type_packets[i] += stats->type_packets[i];
+            total->type_bytes[i] += stats->type_bytes[i];
+        }
+        for (i = 0; i < STATS_SIZE_BUCKETS; i++) {
+            total->sizes[i] += stats->sizes[i];
+        }
+        for (i = 0; i < stats->sources.capacity; i++) {
+            stats_entry_t *entry = &stats->sources.entries[i];
+            if (entry->key_len) {
+                stats_table_add(&total->sources, entry->key, entry->key_len, entry->packets, entry->bytes);
+            }
+        }
+        for (i = 0; i < stats->topics.capacity; i++) {
+            stats_entry_t *entry = &stats->topics.entries[i];
+            if (entry->key_len) {
+                stats_table_add(&total->topics, entry->key, entry->key_len, entry->packets, entry->bytes);
+            }
+        }
+        stats_clear(stats);
+        pthread_mutex_unlock(&workers[w].stats_lock);
+    }
+
+    strftime(tm_buffer, sizeof(tm_buffer), "%F %T", localtime_r(&now, &now_tm));
+    printf("%s packets=%llu bytes=%llu rate=%.1f/s invalid=%llu\n", tm_buffer,
+           (unsigned long long)total->packets, (unsigned long long)total->bytes,
+           elapsed_ms ? total->packets * 1000.0 / elapsed_ms : 0.0,
+           (unsigned long long)total->invalid);
+
+    for (i = 0; i < 256; i++) {
+        if (total->type_packets[i]) {
+            printf("  type %s packets=%llu bytes=%llu\n", mqtt_sn_type_string(i),
+                   (unsigned long long)total->type_packets[i], (unsigned long long)total->type_bytes[i]);
+        }
+    }
+
+    stats_print_table(&total->sources, "source", TRUE);
+    stats_print_table(&total->topics, "topic", FALSE);
+
+    if (total->packets) {
+        printf("  size");
+        for (i = 0; i < STATS_SIZE_BUCKETS; i++) {
+            if (total->sizes[i]) {
+                if (i == STATS_SIZE_BUCKETS-1) {
+                    printf(" %d+=%llu", 1 << i, (unsigned long long)total->sizes[i]);
+                } else {
+                    printf(" %d-%d=%llu", i ? 1 << i : 0, (2 << i) - 1, (unsigned long long)total->sizes[i]);
+                }
+            }
+        }
+        printf("\n");
+    }
+
+    stats_clear(total);
+}
+
 static void termination_handler (int signum)
 {
     switch(signum) {
@@ -122,13 +713,110 @@ static void termination_handler (int signum)
             break;
     }
 
-    // Signal the main thread to stop
+    // Signal the worker threads to stop
     keep_running = FALSE;
+    if (write(shutdown_pipe[1], "", 1) != 1) {
+        perror("write");
+    }
+}
+
+static void dump_readable(void *data)
+{
+    dump_socket_t *listener = data;
+    mqtt_sn_client_t *client = &listener->client;
+
+    if (stats_interval) {
+        pthread_mutex_lock(&listener->worker->stats_lock);
+    }
+
+    // Process every packet that was read by a single wakeup
+    do {
+        char* packet;
+
+        if (capture_path || stats_interval) {
+            received_datagram_t *datagram = mqtt_sn_receive_datagram(client);
+            if (datagram == NULL) {
+                continue;
+            }
+            if (capture_path) {
+                capture_datagram(datagram);
+            }
+            if (stats_interval) {
+                stats_record(client, &listener->worker->stats, datagram);
+            }
+            continue;
+        }
+
+        packet = mqtt_sn_receive_packet(client);
+        if (packet == NULL) {
+            continue;
+        } else if (dump_all) {
+            mqtt_sn_dump_packet(client, packet);
+        } else if (packet[1] == MQTT_SN_TYPE_PUBLISH) {
+            mqtt_sn_print_publish_packet(client, (publish_packet_t *)packet);
+        }
+    } while (mqtt_sn_pending_packets(client) > 0);
+
+    if (stats_interval) {
+        pthread_mutex_unlock(&listener->worker->stats_lock);
+    }
+}
+
+static void shutdown_readable(void *data)
+{
+    // Nothing to do, the worker checks keep_running once woken up
+}
+
+// Copy everything that a worker has printed to STDOUT in one go, so that
+// the output of different threads isn't mixed up
+static void flush_output(dump_worker_t *worker)
+{
+    fflush(worker->output);
+    if (worker->output_size == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&output_lock);
+    fwrite(worker->output_buffer, 1, worker->output_size, stdout);
+    pthread_mutex_unlock(&output_lock);
+
+    rewind(worker->output);
+}
+
+static void stats_timer_handler(void *data)
+{
+    mqtt_sn_event_loop_t *loop = data;
+    uint64_t now = mqtt_sn_monotonic_ms();
+
+    stats_report(now - stats_last_report);
+    stats_last_report = now;
+
+    mqtt_sn_timer_start(loop, &stats_timer, stats_interval * 1000);
+}
+
+static void* dump_worker(void *data)
+{
+    dump_worker_t *worker = data;
+
+    while (keep_running) {
+        if (mqtt_sn_event_loop_run_once(&worker->loop, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("event loop");
+            exit(EXIT_FAILURE);
+        }
+        flush_output(worker);
+    }
+
+    return NULL;
 }
 
 int main(int argc, char* argv[])
 {
-    int sock;
+    mqtt_sn_event_loop_t loop;
+    sigset_t signals;
+    int i, j;
 
     // Disable buffering on STDOUT
     setvbuf(stdout, NULL, _IONBF, 0);
@@ -138,32 +826,132 @@ int main(int argc, char* argv[])
 
     // Enable debugging?
     mqtt_sn_set_debug(debug);
-    mqtt_sn_set_verbose(verbose);
+
+    // Signals are only handled by the main thread, the workers block them
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (pipe(shutdown_pipe) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    local_port = atoi(mqtt_sn_port);
+    if (capture_path) {
+        capture_open();
+    }
+
+    workers = calloc(worker_count, sizeof(dump_worker_t));
+    if (!workers) {
+        mqtt_sn_log_err("Failed to allocate memory for worker threads");
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the listening UDP sockets
+    for (i = 0; i < worker_count; i++) {
+        dump_worker_t *worker = &workers[i];
+        int families[2] = {AF_INET, AF_INET6};
+
+        worker->output = open_memstream(&worker->output_buffer, &worker->output_size);
+        if (!worker->output) {
+            perror("open_memstream");
+            exit(EXIT_FAILURE);
+        }
+
+        mqtt_sn_event_loop_init(&worker->loop);
+        mqtt_sn_event_watch(&worker->loop, shutdown_pipe[0], shutdown_readable, NULL);
+
+        for (j = 0; j < 2; j++) {
+            dump_socket_t *listener = &worker->sockets[worker->socket_count];
+            mqtt_sn_client_t *client = &listener->client;
+            int sock = bind_udp_socket(families[j], mqtt_sn_port);
+            if (sock < 0) {
+                continue;
+            }
+
+            mqtt_sn_client_init(client);
+            mqtt_sn_set_verbose(client, verbose);
+            client->sock = sock;
+            client->output = worker->output;
+            if (capture_path) {
+                mqtt_sn_enable_timestamps(client);
+            }
+
+            listener->worker = worker;
+            mqtt_sn_event_watch(&worker->loop, sock, dump_readable, listener);
+            worker->socket_count++;
+        }
+
+        pthread_mutex_init(&worker->stats_lock, NULL);
+    }
+
+    mqtt_sn_log_debug("mqtt-sn-dump listening on port %s", mqtt_sn_port);
+
+    for (i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, dump_worker, &workers[i]) != 0) {
+            mqtt_sn_log_err("Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Setup signal handlers
     signal(SIGTERM, termination_handler);
     signal(SIGINT, termination_handler);
     signal(SIGHUP, termination_handler);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
 
-    // Create a listening UDP socket
-    sock = bind_udp_socket(mqtt_sn_port);
+    // Wait for a signal to stop, displaying statistics while waiting
+    mqtt_sn_event_loop_init(&loop);
+    mqtt_sn_event_watch(&loop, shutdown_pipe[0], shutdown_readable, NULL);
+    if (stats_interval) {
+        stats_last_report = mqtt_sn_monotonic_ms();
+        mqtt_sn_timer_init(&stats_timer, stats_timer_handler, &loop);
+        mqtt_sn_timer_start(&loop, &stats_timer, stats_interval * 1000);
+    }
 
     while (keep_running) {
-        int ret = mqtt_sn_select(sock);
-        if (ret < 0) {
+        if (mqtt_sn_event_loop_run_once(&loop, -1) < 0 && errno != EINTR) {
+            perror("event loop");
             break;
-        } else if (ret > 0) {
-            char* packet = mqtt_sn_receive_packet(sock);
-            if (dump_all) {
-                mqtt_sn_dump_packet(packet);
-            } else if (packet[1] == MQTT_SN_TYPE_PUBLISH) {
-                mqtt_sn_print_publish_packet((publish_packet_t *)packet);
-            }
         }
     }
 
-    close(sock);
+    for (i = 0; i < worker_count; i++) {
+        dump_worker_t *worker = &workers[i];
+
+        pthread_join(worker->thread, NULL);
+        mqtt_sn_event_loop_cleanup(&worker->loop);
+        for (j = 0; j < worker->socket_count; j++) {
+            close(worker->sockets[j].client.sock);
+            mqtt_sn_cleanup(&worker->sockets[j].client);
+        }
+        fclose(worker->output);
+        free(worker->output_buffer);
+    }
+
+    // Display the statistics for the last part of an interval
+    if (stats_interval) {
+        stats_report(mqtt_sn_monotonic_ms() - stats_last_report);
+    }
+
+    mqtt_sn_event_loop_cleanup(&loop);
+    for (i = 0; i < worker_count; i++) {
+        free(workers[i].stats.sources.entries);
+        free(workers[i].stats.topics.entries);
+        pthread_mutex_destroy(&workers[i].stats_lock);
+    }
+    free(workers);
+    free(stats_total.sources.entries);
+    free(stats_total.topics.entries);
+
+    capture_close();
+    free(capture_buffer);
+
+    close(shutdown_pipe[0]);
+    close(shutdown_pipe[1]);
 
     return 0;
 }
-
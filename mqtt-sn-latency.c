@@ -0,0 +1,607 @@
+/*
+  MQTT-SN end-to-end latency and loss measurement tool
+  Copyright (C) Nicholas Humfrey
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+  LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+  OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "mqtt-sn.h"
+
+// Each payload starts with a sequence number and the time it was due to be sent
+#define LATENCY_HEADER_LENGTH      (12)
+
+// Log-linear histogram of latencies in microseconds: every power of two is
+// split into 64 sub-buckets, so recorded values are accurate to within 1/64
+#define LATENCY_SUB_BUCKET_BITS    (7)
+#define LATENCY_SUB_BUCKET_COUNT   (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_SUB_BUCKET_HALF    (LATENCY_SUB_BUCKET_COUNT / 2)
+#define LATENCY_HISTOGRAM_SIZE     ((64 - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKET_HALF)
+
+const char *client_id_prefix = NULL;
+const char *topic_name = "latency";
+const char *mqtt_sn_host = "127.0.0.1";
+const char *mqtt_sn_port = MQTT_SN_DEFAULT_PORT;
+uint32_t message_count = 1000;
+double message_rate = 100;
+uint16_t payload_size = 16;
+uint16_t keep_alive = MQTT_SN_DEFAULT_KEEP_ALIVE;
+uint16_t max_inflight = 1;
+uint32_t timeout = 0;
+uint16_t drain_time = 2;
+int8_t qos = 0;
+uint8_t show_histogram = FALSE;
+uint8_t debug = 0;
+
+uint8_t keep_running = TRUE;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint8_t subscribed;
+    uint8_t *seen;
+    uint32_t sent;
+    uint32_t received;
+    uint32_t duplicates;
+    uint32_t reordered;
+    uint32_t unexpected;
+    int64_t highest_sequence;
+    uint64_t histogram[LATENCY_HISTOGRAM_SIZE];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} latency_stats_t;
+
+latency_stats_t stats;
+
+
+static void usage()
+{
+    fprintf(stderr, "Usage: mqtt-sn-latency [opts]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -c <count>     Number of messages to publish. Defaults to %u.\n", message_count);
+    fprintf(stderr, "  -d             Increase debug level by one. -d can occur multiple times.\n");
+    fprintf(stderr, "  -h <host>      MQTT-SN host to connect to. Defaults to '%s'.\n", mqtt_sn_host);
+    fprintf(stderr, "  -H             Display the full latency histogram.\n");
+    fprintf(stderr, "  -i <prefix>    Prefix for client IDs, followed by '-pub' and '-sub'. Defaults to 'latency-' with process id.\n");
+    fprintf(stderr, "  -k <keepalive> keep alive in seconds for each client. Defaults to %d.\n", keep_alive);
+    fprintf(stderr, "  -p <port>      Network port to connect to. Defaults to %s.\n", mqtt_sn_port);
+    fprintf(stderr, "  -q <qos>       QoS level (0 or 1) to publish and subscribe with. Defaults to %d.\n", qos);
+    fprintf(stderr, "  -r <rate>      Messages per second, or 0 for as fast as possible. Defaults to %g.\n", message_rate);
+    fprintf(stderr, "  -s <bytes>     Size of the message payload, at least %d. Defaults to %d.\n", LATENCY_HEADER_LENGTH, payload_size);
+    fprintf(stderr, "  -t <topic>     MQTT-SN topic name to publish and subscribe to. Defaults to '%s'.\n", topic_name);
+    fprintf(stderr, "  -w <seconds>   Time to wait for messages to arrive after the last one is sent. Defaults to %d.\n", drain_time);
+    fprintf(stderr, "  --inflight <n> Maximum number of QoS 1 messages waiting for a PUBACK. Defaults to %d.\n", max_inflight);
+    fprintf(stderr, "  --timeout <ms> Time to wait for a reply from the gateway. Defaults to half the keep alive, or %d ms without one.\n", MQTT_SN_DEFAULT_TIMEOUT);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_opts(int argc, char** argv)
+{
+
+    static struct option long_options[] = {
+        {"inflight", required_argument, 0, 1000 },
+        {"timeout",  required_argument, 0, 1001 },
+        {0, 0, 0, 0}
+    };
+
+    int ch;
+    /* getopt_long stores the option index here. */
+    int option_index = 0;
+
+    // Parse the options/switches
+    while ((ch = getopt_long(argc, argv, "c:dh:Hi:k:p:q:r:s:t:w:?", long_options, &option_index)) != -1) {
+        switch (ch) {
+            case 'c':
+                message_count = atoi(optarg);
+                break;
+
+            case 'd':
+                debug++;
+                break;
+
+            case 'h':
+                mqtt_sn_host = optarg;
+                break;
+
+            case 'H':
+                show_histogram = TRUE;
+                break;
+
+            case 'i':
+                client_id_prefix = optarg;
+                break;
+
+            case 'k':
+                keep_alive = atoi(optarg);
+                break;
+
+            case 'p':
+                mqtt_sn_port = optarg;
+                break;
+
+            case 'q':
+                qos = atoi(optarg);
+                break;
+
+            case 'r':
+                message_rate = atof(optarg);
+                break;
+
+            case 's':
+                payload_size = atoi(optarg);
+                break;
+
+            case 't':
+                topic_name = optarg;
+                break;
+
+            case 'w':
+                drain_time = atoi(optarg);
+                break;
+
+            case 1000:
+                max_inflight = atoi(optarg);
+                break;
+
+            case 1001:
+                timeout = atoi(optarg);
+                break;
+
+            case '?':
+            default:
+                usage();
+                break;
+        } // switch
+    } // while
+
+    if (message_count < 1 || message_rate < 0) {
+        usage();
+    }
+
+    if (qos != 0 && qos != 1) {
+        mqtt_sn_log_err("Only QoS level 0 or 1 is supported.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (payload_size < LATENCY_HEADER_LENGTH || payload_size > MQTT_SN_MAX_PAYLOAD_LENGTH) {
+        mqtt_sn_log_err("Payload size must be between %d and %d bytes.", LATENCY_HEADER_LENGTH, MQTT_SN_MAX_PAYLOAD_LENGTH);
+        exit(EXIT_FAILURE);
+    }
+
+    if (max_inflight < 1 || max_inflight > MQTT_SN_MAX_INFLIGHT) {
+        mqtt_sn_log_err("In-flight window must be between 1 and %d.", MQTT_SN_MAX_INFLIGHT);
+        exit(EXIT_FAILURE);
+    }
+
+    // Without a keep alive there is nothing to take half of
+    if (timeout == 0) {
+        timeout = keep_alive ? keep_alive * 500 : MQTT_SN_DEFAULT_TIMEOUT;
+    }
+}
+
+static void termination_handler (int signum)
+{
+    switch(signum) {
+        case SIGHUP:
+            mqtt_sn_log_debug("Got hangup signal.");
+            break;
+        case SIGTERM:
+            mqtt_sn_log_debug("Got termination signal.");
+            break;
+        case SIGINT:
+            mqtt_sn_log_debug("Got interrupt signal.");
+            break;
+    }
+
+    // Signal the main thread to stop
+    keep_running = FALSE;
+}
+
+static uint64_t latency_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void latency_sleep_until(uint64_t when)
+{
+    uint64_t now = latency_now_us();
+
+    if (when > now) {
+        struct timespec ts;
+        ts.tv_sec = (when - now) / 1000000;
+        ts.tv_nsec = ((when - now) % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static uint32_t latency_histogram_index(uint64_t value)
+{
+    uint32_t bucket = 0;
+
+    while ((value >> bucket) >= LATENCY_SUB_BUCKET_COUNT) {
+        bucket++;
+    }
+
+    if (bucket == 0) {
+        return value;
+    } else {
+        return (bucket * LATENCY_SUB_BUCKET_HALF) + (value >> bucket);
+    }
+}
+
+// The highest value that is recorded in the same histogram slot
+static uint64_t latency_histogram_value(uint32_t index)
+{
+    uint32_t bucket;
+
+    if (index < LATENCY_SUB_BUCKET_COUNT) {
+        return index;
+    }
+
+    bucket = (index / LATENCY_SUB_BUCKET_HALF) - 1;
+    return ((uint64_t)(index - (bucket * LATENCY_SUB_BUCKET_HALF) + 1) << bucket) - 1;
+}
+
+static uint64_t latency_percentile(double percentile)
+{
+    uint64_t wanted = (uint64_t)((percentile / 100.0) * stats.total + 0.5);
+    uint64_t count = 0;
+    uint32_t i;
+
+    if (wanted < 1) {
+        wanted = 1;
+    }
+
+    for (i = 0; i < LATENCY_HISTOGRAM_SIZE; i++) {
+        count += stats.histogram[i];
+        if (count >= wanted) {
+            uint64_t value = latency_histogram_value(i);
+            return value < stats.max ? value : stats.max;
+        }
+    }
+
+    return stats.max;
+}
+
+static void latency_write_header(uint8_t *payload, uint32_t sequence, uint64_t timestamp)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        payload[i] = sequence >> (24 - (i * 8));
+    }
+    for (i = 0; i < 8; i++) {
+        payload[4 + i] = timestamp >> (56 - (i * 8));
+    }
+}
+
+static void latency_record(const publish_packet_t *packet, uint64_t now)
+{
+    const uint8_t *payload = (const uint8_t*)packet->data;
+    uint32_t sequence = 0;
+    uint64_t timestamp = 0;
+    uint64_t latency;
+    int i;
+
+    if (packet->length - 7 != payload_size) {
+        mqtt_sn_log_debug("Ignoring PUBLISH with unexpected payload size: %d", packet->length - 7);
+        stats.unexpected++;
+        return;
+    }
+
+    for (i = 0; i < 4; i++) {
+        sequence = (sequence << 8) | payload[i];
+    }
+    for (i = 0; i < 8; i++) {
+        timestamp = (timestamp << 8) | payload[4 + i];
+    }
+
+    if (sequence >= message_count || timestamp > now) {
+        mqtt_sn_log_debug("Ignoring PUBLISH that was not sent by this test");
+        stats.unexpected++;
+        return;
+    }
+
+    if (stats.seen[sequence / 8] & (1 << (sequence % 8))) {
+        stats.duplicates++;
+        return;
+    }
+    stats.seen[sequence / 8] |= (1 << (sequence % 8));
+    stats.received++;
+
+    if ((int64_t)sequence < stats.highest_sequence) {
+        stats.reordered++;
+    } else {
+        stats.highest_sequence = sequence;
+    }
+
+    latency = now - timestamp;
+    stats.histogram[latency_histogram_index(latency)]++;
+    stats.sum += latency;
+    if (stats.total == 0 || latency < stats.min)
+        stats.min = latency;
+    if (latency > stats.max)
+        stats.max = latency;
+    stats.total++;
+}
+
+// Receive the published messages until the main thread says to stop,
+// then disconnect, still counting any messages that arrive in the meantime
+static void* latency_subscriber(void *data)
+{
+    mqtt_sn_client_t *client = data;
+    uint8_t disconnecting = FALSE;
+
+    while (TRUE) {
+        int ready;
+
+        if (!disconnecting) {
+            pthread_mutex_lock(&stats.lock);
+            disconnecting = !stats.subscribed;
+            pthread_mutex_unlock(&stats.lock);
+            if (disconnecting) {
+                mqtt_sn_log_debug("Disconnecting subscriber...");
+                mqtt_sn_send_disconnect(client, 0);
+            }
+        }
+
+        ready = mqtt_sn_select(client);
+        if (ready > 0) {
+            publish_packet_t *packet = mqtt_sn_receive_packet(client);
+            uint64_t now = latency_now_us();
+
+            if (packet == NULL) {
+                continue;
+            } else if (packet->type == MQTT_SN_TYPE_PUBLISH) {
+                if ((packet->flags & MQTT_SN_FLAG_QOS_MASK) == MQTT_SN_FLAG_QOS_1) {
+                    mqtt_sn_send_puback(client, packet, MQTT_SN_ACCEPTED);
+                }
+
+                pthread_mutex_lock(&stats.lock);
+                latency_record(packet, now);
+                pthread_mutex_unlock(&stats.lock);
+            } else if (packet->type == MQTT_SN_TYPE_DISCONNECT) {
+                if (!disconnecting) {
+                    mqtt_sn_log_err("Received DISCONNECT from gateway.");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+        } else if (ready == 0 && disconnecting) {
+            mqtt_sn_log_err("Failed to disconnect from MQTT-SN gateway.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return NULL;
+}
+
+static void latency_print_histogram()
+{
+    uint64_t count = 0;
+    uint32_t i;
+
+    printf("       Value   Percentile   TotalCount 1/(1-Percentile)\n");
+    for (i = 0; i < LATENCY_HISTOGRAM_SIZE; i++) {
+        double percentile;
+        uint64_t value;
+
+        if (stats.histogram[i] == 0) {
+            continue;
+        }
+
+        count += stats.histogram[i];
+        percentile = (double)count / stats.total;
+        value = latency_histogram_value(i);
+        if (value > stats.max) {
+            value = stats.max;
+        }
+
+        if (count < stats.total) {
+            printf("%12.3f %12.6f %12llu %14.2f\n", value / 1000.0, percentile,
+                   (unsigned long long)count, 1.0 / (1.0 - percentile));
+        } else {
+            printf("%12.3f %12.6f %12llu\n", value / 1000.0, percentile, (unsigned long long)count);
+        }
+    }
+}
+
+static void latency_connect(mqtt_sn_client_t *client, const char *suffix)
+{
+    char client_id[MQTT_SN_MAX_CLIENT_ID_LENGTH + 1];
+
+    snprintf(client_id, sizeof(client_id), "%s%s", client_id_prefix, suffix);
+
+    mqtt_sn_client_init(client);
+    mqtt_sn_set_timeout(client, timeout);
+    mqtt_sn_create_socket(client, mqtt_sn_host, mqtt_sn_port, 0);
+
+    mqtt_sn_log_debug("Connecting %s...", client_id);
+    mqtt_sn_send_connect(client, client_id, keep_alive, TRUE);
+    mqtt_sn_receive_connack(client);
+}
+
+int main(int argc, char* argv[])
+{
+    mqtt_sn_client_t publisher;
+    mqtt_sn_client_t subscriber;
+    char default_prefix[MQTT_SN_MAX_CLIENT_ID_LENGTH + 1];
+    uint8_t payload[MQTT_SN_MAX_PAYLOAD_LENGTH];
+    uint16_t topic_id = 0;
+    uint8_t topic_id_type = MQTT_SN_TOPIC_TYPE_NORMAL;
+    pthread_t thread;
+    sigset_t signals;
+    uint64_t started, finished, deadline;
+    uint32_t i, lost;
+    double elapsed;
+
+    // Parse the command-line options
+    parse_opts(argc, argv);
+
+    // Enable debugging?
+    mqtt_sn_set_debug(debug);
+
+    if (client_id_prefix == NULL) {
+        snprintf(default_prefix, sizeof(default_prefix), "latency-%d", getpid());
+        client_id_prefix = default_prefix;
+    }
+
+    // Setup signal handlers
+    signal(SIGTERM, termination_handler);
+    signal(SIGINT, termination_handler);
+    signal(SIGHUP, termination_handler);
+
+    pthread_mutex_init(&stats.lock, NULL);
+    stats.highest_sequence = -1;
+    stats.seen = calloc((message_count + 7) / 8, 1);
+    if (!stats.seen) {
+        mqtt_sn_log_err("Failed to allocate memory for %u messages", message_count);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = LATENCY_HEADER_LENGTH; i < payload_size; i++) {
+        payload[i] = 'a' + (i % 26);
+    }
+
+    // Subscribe first, so that none of the messages are missed
+    latency_connect(&subscriber, "-sub");
+    mqtt_sn_send_subscribe_topic_name(&subscriber, topic_name, qos);
+    mqtt_sn_receive_suback(&subscriber);
+    mqtt_sn_set_timeout(&subscriber, 1000);
+
+    latency_connect(&publisher, "-pub");
+    mqtt_sn_set_max_inflight(&publisher, max_inflight);
+    if (strlen(topic_name) == 2) {
+        // Convert the 2 character topic name into a 2 byte topic id
+        topic_id = (topic_name[0] << 8) + topic_name[1];
+        topic_id_type = MQTT_SN_TOPIC_TYPE_SHORT;
+    } else {
+        mqtt_sn_send_register(&publisher, topic_name);
+        topic_id = mqtt_sn_receive_regack(&publisher);
+    }
+
+    // Signals are only handled by the main thread
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    stats.subscribed = TRUE;
+    if (pthread_create(&thread, NULL, latency_subscriber, &subscriber) != 0) {
+        mqtt_sn_log_err("Failed to start subscriber thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    // Messages are timestamped with when they were due to be sent, so that
+    // time spent waiting for the publisher to catch up counts as latency
+    started = latency_now_us();
+    for (i = 0; i < message_count && keep_running; i++) {
+        uint64_t due = started;
+
+        if (message_rate > 0) {
+            due += (uint64_t)(i * (1000000.0 / message_rate));
+            latency_sleep_until(due);
+        } else {
+            due = latency_now_us();
+        }
+
+        latency_write_header(payload, i, due);
+        mqtt_sn_send_publish(&publisher, topic_id, topic_id_type, payload, payload_size, qos, FALSE);
+        stats.sent++;
+    }
+    mqtt_sn_wait_for_pubacks(&publisher);
+    finished = latency_now_us();
+
+    // Wait for the rest of the messages to arrive
+    deadline = finished + (uint64_t)drain_time * 1000000;
+    while (keep_running && latency_now_us() < deadline) {
+        uint32_t received;
+
+        pthread_mutex_lock(&stats.lock);
+        received = stats.received;
+        pthread_mutex_unlock(&stats.lock);
+        if (received >= stats.sent) {
+            break;
+        }
+
+        latency_sleep_until(latency_now_us() + 10000);
+    }
+
+    pthread_mutex_lock(&stats.lock);
+    stats.subscribed = FALSE;
+    pthread_mutex_unlock(&stats.lock);
+    pthread_join(thread, NULL);
+
+    // Finally, disconnect the publisher
+    mqtt_sn_log_debug("Disconnecting publisher...");
+    mqtt_sn_send_disconnect(&publisher, 0);
+    mqtt_sn_receive_disconnect(&publisher);
+
+    // Report the results
+    elapsed = (finished - started) / 1000000.0;
+    lost = stats.sent - stats.received;
+    printf("Messages:    %u sent, %u received, %u lost (%.2f%%), %u duplicates, %u reordered, %u unexpected\n",
+           stats.sent, stats.received, lost, stats.sent ? 100.0 * lost / stats.sent : 0.0,
+           stats.duplicates, stats.reordered, stats.unexpected);
+    printf("Elapsed:     %.3f seconds\n", elapsed);
+    printf("Throughput:  %.1f messages/second\n", elapsed > 0 ? stats.sent / elapsed : 0.0);
+    printf("Latency (ms)    count      min     mean      p50      p90      p99    p99.9      max\n");
+    if (stats.total == 0) {
+        printf("  %-10s %8d        -        -        -        -        -        -        -\n", "PUBLISH", 0);
+    } else {
+        printf("  %-10s %8llu %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n", "PUBLISH",
+               (unsigned long long)stats.total, stats.min / 1000.0,
+               (double)stats.sum / stats.total / 1000.0,
+               latency_percentile(50) / 1000.0, latency_percentile(90) / 1000.0,
+               latency_percentile(99) / 1000.0, latency_percentile(99.9) / 1000.0,
+               stats.max / 1000.0);
+    }
+    if (show_histogram && stats.total > 0) {
+        printf("\n");
+        latency_print_histogram();
+    }
+
+    close(publisher.sock);
+    close(subscriber.sock);
+    mqtt_sn_cleanup(&publisher);
+    mqtt_sn_cleanup(&subscriber);
+    pthread_mutex_destroy(&stats.lock);
+    free(stats.seen);
+
+    return 0;
+}
@@ -33,6 +33,11 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mqtt-sn.h"
 
@@ -40,23 +45,46 @@ const char *client_id = NULL;
 const char *topic_name = NULL;
 const char *message_data = NULL;
 const char *message_file = NULL;
+const char *cache_file = NULL;
 const char *mqtt_sn_host = "127.0.0.1";
 const char *mqtt_sn_port = MQTT_SN_DEFAULT_PORT;
 uint16_t source_port = 0;
+uint8_t discover = FALSE;
+uint32_t discover_wait = MQTT_SN_DEFAULT_DISCOVERY_WAIT;
+const char *gateway_cache_file = NULL;
 uint16_t topic_id = 0;
 uint8_t topic_id_type = MQTT_SN_TOPIC_TYPE_NORMAL;
 uint16_t keep_alive = MQTT_SN_DEFAULT_KEEP_ALIVE;
 uint16_t sleep_duration = 0;
+uint32_t timeout = 0;
+uint8_t retries = MQTT_SN_DEFAULT_RETRIES;
+uint16_t max_inflight = 1;
+uint8_t max_inflight_given = FALSE;
+uint16_t chunk_size = 0;
+double rate = 0;
+uint16_t burst = 1;
+uint8_t adaptive_rate = FALSE;
+uint32_t interval = 0;
+uint32_t count = 0;
+uint16_t batch_size = 0;
+uint16_t batch_latency = MQTT_SN_DEFAULT_BATCH_LATENCY;
 int8_t qos = 0;
 uint8_t retain = FALSE;
+uint8_t clean_session = TRUE;
 uint8_t one_message_per_line = FALSE;
 uint8_t debug = 0;
+mqtt_sn_client_t client;
 
+uint8_t keep_running = TRUE;
+
+// Input from pipes is read in blocks of this size
+#define READ_BUFFER_SIZE   (1024 * 1024)
 
 static void usage()
 {
     fprintf(stderr, "Usage: mqtt-sn-pub [opts] -t <topic> -m <message>\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "  -c             disable 'clean session' (keep registered topics when client disconnects).\n");
     fprintf(stderr, "  -d             Increase debug level by one. -d can occur multiple times.\n");
     fprintf(stderr, "  -f <file>      A file to send as the message payload.\n");
     fprintf(stderr, "  -h <host>      MQTT-SN host to connect to. Defaults to '%s'.\n", mqtt_sn_host);
@@ -64,7 +92,7 @@ static void usage()
     fprintf(stderr, "  -k <keepalive> keep alive in seconds for this client. Defaults to %d.\n", keep_alive);
     fprintf(stderr, "  -e <sleep>     sleep duration in seconds when disconnecting. Defaults to %d.\n", sleep_duration);
     fprintf(stderr, "  -m <message>   Message payload to send.\n");
-    fprintf(stderr, "  -l             Read from STDIN, one message per line.\n");
+    fprintf(stderr, "  -l             Read from STDIN (or -f file), one message per line.\n");
     fprintf(stderr, "  -n             Send a null (zero length) message.\n");
     fprintf(stderr, "  -p <port>      Network port to connect to. Defaults to %s.\n", mqtt_sn_port);
     fprintf(stderr, "  -q <qos>       Quality of Service value (0, 1 or -1). Defaults to %d.\n", qos);
@@ -75,6 +103,21 @@ static void usage()
     fprintf(stderr, "  --fe           Enables Forwarder Encapsulation. Mqtt-sn packets are encapsulated according to MQTT-SN Protocol Specification v1.2, chapter 5.5 Forwarder Encapsulation.\n");
     fprintf(stderr, "  --wlnid        If Forwarder Encapsulation is enabled, wireless node ID for this client. Defaults to process id.\n");
     fprintf(stderr, "  --cport <port> Source port for outgoing packets. Uses port in ephemeral range if not specified or set to %d.\n", source_port);
+    fprintf(stderr, "  --inflight <n> Maximum number of QoS 1 messages waiting for a PUBACK. Defaults to %d.\n", max_inflight);
+    fprintf(stderr, "  --batch <n>    Send QoS 0 and -1 messages in batches of up to <n> packets per system call.\n");
+    fprintf(stderr, "  --batch-latency <ms> Maximum time a message is held back waiting for a batch to fill. Defaults to %d.\n", batch_latency);
+    fprintf(stderr, "  --timeout <ms> Time to wait for a reply from the gateway. Defaults to half the keep alive.\n");
+    fprintf(stderr, "  --retries <n>  Number of times to resend a message that is not acknowledged. Defaults to %d.\n", MQTT_SN_DEFAULT_RETRIES);
+    fprintf(stderr, "  --cache <file> File to keep topic ids and message ids in between runs, for use with -c.\n");
+    fprintf(stderr, "  --chunk <n>    Split messages longer than <n> bytes into chunks, for mqtt-sn-sub --reassemble.\n");
+    fprintf(stderr, "  --rate <n>     Maximum number of messages to send per second.\n");
+    fprintf(stderr, "  --burst <n>    Number of messages that can be sent at once, within the rate. Defaults to %d.\n", burst);
+    fprintf(stderr, "  --adaptive     Halve the rate when the gateway is congested, then increase it slowly again.\n");
+    fprintf(stderr, "  --interval <ms> Send the message repeatedly, every <ms> milliseconds.\n");
+    fprintf(stderr, "  --count <n>    Number of times to send the message with --interval. Defaults to until interrupted.\n");
+    fprintf(stderr, "  --discover     Send SEARCHGW to the -h address, which can be broadcast or multicast, and connect to the gateway that replies fastest.\n");
+    fprintf(stderr, "  --discover-wait <ms> Time to wait for gateways to reply to SEARCHGW. Defaults to %d.\n", discover_wait);
+    fprintf(stderr, "  --gateway-cache <file> File to keep discovered gateways in between runs, until they expire. Implies --discover.\n");
     exit(EXIT_FAILURE);
 }
 
@@ -85,6 +128,21 @@ static void parse_opts(int argc, char** argv)
         {"fe",    no_argument,       0, 1000 },
         {"wlnid", required_argument, 0, 1001 },
         {"cport", required_argument, 0, 1002 },
+        {"inflight", required_argument, 0, 1003 },
+        {"batch", required_argument, 0, 1004 },
+        {"batch-latency", required_argument, 0, 1005 },
+        {"timeout", required_argument, 0, 1006 },
+        {"retries", required_argument, 0, 1007 },
+        {"cache", required_argument, 0, 1008 },
+        {"chunk", required_argument, 0, 1009 },
+        {"rate", required_argument, 0, 1010 },
+        {"burst", required_argument, 0, 1011 },
+        {"adaptive", no_argument, 0, 1012 },
+        {"interval", required_argument, 0, 1013 },
+        {"count", required_argument, 0, 1014 },
+        {"discover", no_argument, 0, 1015 },
+        {"discover-wait", required_argument, 0, 1016 },
+        {"gateway-cache", required_argument, 0, 1017 },
         {0, 0, 0, 0}
     };
 
@@ -93,8 +151,12 @@ static void parse_opts(int argc, char** argv)
     int option_index = 0;
 
     // Parse the options/switches
-    while ((ch = getopt_long (argc, argv, "df:h:i:k:e:lm:np:q:rst:T:?", long_options, &option_index)) != -1) {
+    while ((ch = getopt_long (argc, argv, "cdf:h:i:k:e:lm:np:q:rst:T:?", long_options, &option_index)) != -1) {
         switch (ch) {
+            case 'c':
+                clean_session = FALSE;
+                break;
+
             case 'd':
                 debug++;
                 break;
@@ -112,7 +174,10 @@ static void parse_opts(int argc, char** argv)
                 break;
 
             case 'l':
-                message_file = "-";
+                // Lines are read from STDIN, unless a file is given with -f
+                if (message_file == NULL) {
+                    message_file = "-";
+                }
                 one_message_per_line = TRUE;
                 break;
 
@@ -158,17 +223,79 @@ static void parse_opts(int argc, char** argv)
                 break;
 
             case 1000:
-                mqtt_sn_enable_frwdencap();
+                mqtt_sn_enable_frwdencap(&client);
                 break;
 
             case 1001:
-                mqtt_sn_set_frwdencap_parameters((uint8_t*)optarg, strlen(optarg));
+                mqtt_sn_set_frwdencap_parameters(&client, (uint8_t*)optarg, strlen(optarg));
                 break;
 
             case 1002:
                 source_port = atoi(optarg);
                 break;
 
+            case 1003:
+                max_inflight = atoi(optarg);
+                max_inflight_given = TRUE;
+                break;
+
+            case 1004:
+                batch_size = atoi(optarg);
+                break;
+
+            case 1005:
+                batch_latency = atoi(optarg);
+                break;
+
+            case 1006:
+                timeout = atoi(optarg);
+                break;
+
+            case 1007:
+                retries = atoi(optarg);
+                break;
+
+            case 1008:
+                cache_file = optarg;
+                break;
+
+            case 1009:
+                chunk_size = atoi(optarg);
+                break;
+
+            case 1010:
+                rate = atof(optarg);
+                break;
+
+            case 1011:
+                burst = atoi(optarg);
+                break;
+
+            case 1012:
+                adaptive_rate = TRUE;
+                break;
+
+            case 1013:
+                interval = atoi(optarg);
+                break;
+
+            case 1014:
+                count = atoi(optarg);
+                break;
+
+            case 1015:
+                discover = TRUE;
+                break;
+
+            case 1016:
+                discover_wait = atoi(optarg);
+                break;
+
+            case 1017:
+                gateway_cache_file = optarg;
+                discover = TRUE;
+                break;
+
             case '?':
             default:
                 usage();
@@ -198,6 +325,22 @@ static void parse_opts(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
 
+    if (adaptive_rate && rate <= 0) {
+        mqtt_sn_log_err("Please give a --rate to adapt.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (interval && message_file) {
+        mqtt_sn_log_err("Only a message given with -m or -n can be sent repeatedly.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only the last chunk would be kept by the gateway
+    if (chunk_size && retain) {
+        mqtt_sn_log_err("Retained messages can not be split into chunks.");
+        exit(EXIT_FAILURE);
+    }
+
     // Check topic is valid for QoS level -1
     if (qos == -1 && topic_id == 0 && strlen(topic_name) != 2) {
         mqtt_sn_log_err("Either a pre-defined topic id or a short topic name must be given for QoS -1.");
@@ -205,77 +348,261 @@ static void parse_opts(int argc, char** argv)
     }
 }
 
-static void publish_file(int sock, const char* filename)
+// Send a message, split into chunks if it is longer than the chunk size
+static void publish_message(mqtt_sn_client_t *client, const char* data, size_t len)
 {
-    char buffer[MQTT_SN_MAX_PAYLOAD_LENGTH];
-    uint16_t message_len = 0;
-    FILE* file = NULL;
-
-    if (strcmp(filename, "-") == 0) {
-        file = stdin;
+    if (chunk_size && len > chunk_size) {
+        mqtt_sn_send_publish_chunks(client, topic_id, topic_id_type, data, len, chunk_size, qos);
+    } else if (len > MQTT_SN_MAX_LONG_PAYLOAD_LENGTH) {
+        mqtt_sn_log_err("Payload is too big");
+        exit(EXIT_FAILURE);
     } else {
-        file = fopen(filename, "rb");
+        mqtt_sn_send_publish(client, topic_id, topic_id_type, data, len, qos, retain);
     }
+}
 
-    if (!file) {
-        perror("Failed to open message file");
+// Send the message every interval, keeping to the schedule however long each send takes
+static void publish_repeatedly(mqtt_sn_client_t *client)
+{
+    uint64_t next = mqtt_sn_monotonic_us();
+    uint32_t sent = 0;
+
+    while (keep_running) {
+        publish_message(client, message_data, strlen(message_data));
+        if (count && ++sent >= count) {
+            break;
+        }
+
+        next += (uint64_t)interval * 1000;
+        if (!mqtt_sn_wait_until(client, next) && !keep_running) {
+            break;
+        }
+    }
+}
+
+// Send a whole file as one message, unless it is split into chunks
+static void publish_whole(mqtt_sn_client_t *client, const char* data, size_t len)
+{
+    if (!chunk_size && len > MQTT_SN_MAX_LONG_PAYLOAD_LENGTH) {
+        mqtt_sn_log_warn("Input file is longer than the maximum message size");
+        len = MQTT_SN_MAX_LONG_PAYLOAD_LENGTH;
+    }
+
+    publish_message(client, data, len);
+}
+
+// Publish each complete line, and return the number of bytes used.
+// memchr() is vectorised by the C library, so this is much faster than looking at each byte.
+static size_t publish_lines(mqtt_sn_client_t *client, const char* data, size_t len)
+{
+    const char *start = data;
+    const char *end = data + len;
+    const char *newline;
+
+    while (start < end && (newline = memchr(start, '\n', end - start)) != NULL) {
+        size_t line_len = newline - start;
+
+        if (line_len > 0 && start[line_len - 1] == '\r') {
+            line_len--;
+        }
+
+        if (!chunk_size && line_len > MQTT_SN_MAX_LONG_PAYLOAD_LENGTH) {
+            mqtt_sn_log_warn("Skipping line longer than the maximum message size");
+        } else {
+            publish_message(client, start, line_len);
+        }
+        start = newline + 1;
+    }
+
+    return start - data;
+}
+
+// Publish straight from the page cache, without copying the file into a buffer first
+static void publish_mapped_file(mqtt_sn_client_t *client, int fd, size_t size)
+{
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (data == MAP_FAILED) {
+        perror("Failed to map message file");
         exit(EXIT_FAILURE);
     }
+    madvise(data, size, MADV_SEQUENTIAL);
 
     if (one_message_per_line) {
-        // One message per line
-        while(!feof(file) && !ferror(file)) {
-            char* message = fgets(buffer, MQTT_SN_MAX_PAYLOAD_LENGTH, file);
-            if (message) {
-                char* end = strpbrk(message, "\n\r");
-                if (end) {
-                    uint16_t message_len = (end - message);
-                    mqtt_sn_send_publish(sock, topic_id, topic_id_type, message, message_len, qos, retain);
-                } else {
-                    mqtt_sn_log_err("Failed to find newline when reading message");
-                }
-            } else if (ferror(file)) {
-                perror("Failed to read message line");
+        if (publish_lines(client, data, size) < size) {
+            mqtt_sn_log_err("Failed to find newline when reading message");
+        }
+    } else {
+        publish_whole(client, data, size);
+    }
+
+    munmap(data, size);
+}
+
+// Read from a pipe in large blocks, keeping any partial line for the next block
+static void publish_stream(mqtt_sn_client_t *client, int fd)
+{
+    size_t size = READ_BUFFER_SIZE;
+    char *buffer = malloc(size);
+    size_t len = 0;
+
+    while (TRUE) {
+        ssize_t bytes_read;
+        int batch_timeout;
+
+        // A line, or a whole message, that does not fit yet
+        if (len == size) {
+            size *= 2;
+            buffer = realloc(buffer, size);
+        }
+        if (!buffer) {
+            mqtt_sn_log_err("Failed to allocate memory for message");
+            exit(EXIT_FAILURE);
+        }
+
+        // Send a partly filled batch once it has waited for the maximum latency,
+        // rather than holding it until the next line arrives
+        batch_timeout = mqtt_sn_batch_timeout(client);
+        if (batch_timeout >= 0) {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            int ret = poll(&pfd, 1, batch_timeout);
+            if (ret == 0) {
+                mqtt_sn_flush_batch(client);
+            } else if (ret < 0 && errno != EINTR) {
+                perror("Failed to wait for message file");
                 exit(EXIT_FAILURE);
             }
+            if (ret <= 0) {
+                continue;
+            }
         }
-    } else {
-        // One message until EOF
-        message_len = fread(buffer, 1, MQTT_SN_MAX_PAYLOAD_LENGTH, file);
-        if (ferror(file)) {
+
+        bytes_read = read(fd, buffer + len, size - len);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("Failed to read message file");
             exit(EXIT_FAILURE);
-        } else if (!feof(file)) {
-            mqtt_sn_log_warn("Input file is longer than the maximum message size");
+        } else if (bytes_read == 0) {
+            break;
+        }
+        len += bytes_read;
+
+        if (one_message_per_line) {
+            size_t used = publish_lines(client, buffer, len);
+            memmove(buffer, buffer + used, len - used);
+            len -= used;
+        } else if (!chunk_size && len > MQTT_SN_MAX_LONG_PAYLOAD_LENGTH) {
+            // No need to read any more, to know that it is too long
+            break;
         }
+    }
 
-        mqtt_sn_send_publish(sock, topic_id, topic_id_type, buffer, message_len, qos, retain);
+    if (!one_message_per_line) {
+        publish_whole(client, buffer, len);
+    } else if (len > 0) {
+        mqtt_sn_log_err("Failed to find newline when reading message");
     }
 
-    fclose(file);
+    free(buffer);
+}
+
+static void publish_file(mqtt_sn_client_t *client, const char* filename)
+{
+    struct stat st;
+    int fd;
+
+    if (strcmp(filename, "-") == 0) {
+        fd = STDIN_FILENO;
+    } else {
+        fd = open(filename, O_RDONLY);
+    }
+
+    if (fd < 0) {
+        perror("Failed to open message file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Regular files, including one redirected to STDIN, can be mapped into memory
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0) {
+        publish_mapped_file(client, fd, st.st_size);
+    } else {
+        publish_stream(client, fd);
+    }
+
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+}
+
+static void termination_handler (int signum)
+{
+    switch(signum) {
+        case SIGHUP:
+            mqtt_sn_log_debug("Got hangup signal.");
+            break;
+        case SIGTERM:
+            mqtt_sn_log_debug("Got termination signal.");
+            break;
+        case SIGINT:
+            mqtt_sn_log_debug("Got interrupt signal.");
+            break;
+    }
+
+    // Signal the main thread to stop
+    keep_running = FALSE;
 }
 
 int main(int argc, char* argv[])
 {
     int sock;
 
-    mqtt_sn_disable_frwdencap();
+    mqtt_sn_client_init(&client);
 
     // Parse the command-line options
     parse_opts(argc, argv);
 
     // Enable debugging?
     mqtt_sn_set_debug(debug);
-    mqtt_sn_set_timeout(keep_alive / 2);
+    mqtt_sn_set_timeout(&client, timeout ? timeout : keep_alive * 500);
+    mqtt_sn_set_retries(&client, retries);
+    // Pipeline the chunks of a message, unless told otherwise
+    if (chunk_size && !max_inflight_given) {
+        max_inflight = MQTT_SN_CHUNK_WINDOW;
+    }
+    mqtt_sn_set_max_inflight(&client, max_inflight);
+    mqtt_sn_set_rate(&client, rate, burst, adaptive_rate);
+
+    // Stop sending a repeated message cleanly, disconnecting from the gateway
+    if (interval) {
+        signal(SIGTERM, termination_handler);
+        signal(SIGINT, termination_handler);
+        signal(SIGHUP, termination_handler);
+    }
+    if (qos <= 0) {
+        mqtt_sn_set_batch(&client, batch_size, batch_latency);
+    }
 
-    // Create a UDP socket
-    sock = mqtt_sn_create_socket(mqtt_sn_host, mqtt_sn_port, source_port);
+    // Create a UDP socket, connected to a gateway that was found or to the one given
+    if (gateway_cache_file) {
+        mqtt_sn_open_gateway_cache(&client, gateway_cache_file);
+    }
+    if (discover) {
+        sock = mqtt_sn_discover_gateway(&client, mqtt_sn_host, mqtt_sn_port, source_port, discover_wait);
+    } else {
+        sock = mqtt_sn_create_socket(&client, mqtt_sn_host, mqtt_sn_port, source_port);
+    }
     if (sock) {
+        if (cache_file && qos >= 0) {
+            mqtt_sn_open_session_cache(&client, cache_file);
+        }
+
         // Connect to gateway
         if (qos >= 0) {
             mqtt_sn_log_debug("Connecting...");
-            mqtt_sn_send_connect(sock, client_id, keep_alive, TRUE);
-            mqtt_sn_receive_connack(sock);
+            mqtt_sn_send_connect(&client, client_id, keep_alive, clean_session);
+            mqtt_sn_receive_connack(&client);
         }
 
         if (topic_id) {
@@ -286,31 +613,40 @@ int main(int argc, char* argv[])
             topic_id = (topic_name[0] << 8) + topic_name[1];
             topic_id_type = MQTT_SN_TOPIC_TYPE_SHORT;
         } else if (qos >= 0) {
-            // Register the topic name
-            mqtt_sn_send_register(sock, topic_name);
-            topic_id = mqtt_sn_receive_regack(sock);
+            // Register the topic name, unless it is still registered from a previous session
+            topic_id = mqtt_sn_lookup_topic_id(&client, topic_name);
+            if (topic_id == 0) {
+                topic_request_t request = { topic_name, 0 };
+                mqtt_sn_register_topics(&client, &request, 1, 1);
+                topic_id = request.topic_id;
+            }
             topic_id_type = MQTT_SN_TOPIC_TYPE_NORMAL;
         }
 
         // Publish to the topic
         if (message_file) {
-            publish_file(sock, message_file);
+            publish_file(&client, message_file);
+        } else if (interval) {
+            publish_repeatedly(&client);
         } else {
-            uint16_t message_len = strlen(message_data);
-            mqtt_sn_send_publish(sock, topic_id, topic_id_type, message_data, message_len, qos, retain);
+            publish_message(&client, message_data, strlen(message_data));
         }
 
+        // Send anything still queued and wait for any outstanding QoS 1 acknowledgements
+        mqtt_sn_flush_batch(&client);
+        mqtt_sn_wait_for_pubacks(&client);
+
         // Finally, disconnect
         if (qos >= 0) {
             mqtt_sn_log_debug("Disconnecting...");
-            mqtt_sn_send_disconnect(sock, sleep_duration);
-            mqtt_sn_receive_disconnect(sock);
+            mqtt_sn_send_disconnect(&client, sleep_duration);
+            mqtt_sn_receive_disconnect(&client);
         }
 
         close(sock);
     }
 
-    mqtt_sn_cleanup();
+    mqtt_sn_cleanup(&client);
 
     return 0;
 }
@@ -32,6 +32,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <termios.h>
@@ -46,13 +47,47 @@
 
 const char *mqtt_sn_host = "127.0.0.1";
 const char *mqtt_sn_port = MQTT_SN_DEFAULT_PORT;
-const char *serial_device = NULL;
 uint16_t source_port = 0;
 int serial_baud = 9600;
 uint8_t debug = 0;
 uint8_t frwdencap = FALSE;
 
 uint8_t keep_running = TRUE;
+mqtt_sn_client_t client;
+mqtt_sn_event_loop_t loop;
+
+// Bytes buffered from each serial port while looking for whole packets,
+// the buffer grows when a longer packet is announced
+#define SERIAL_BUFFER_SIZE   (1024)
+
+// Time to wait for the rest of a partial packet before skipping a byte
+#define SERIAL_RESYNC_MS     (50)
+
+// Most bytes queued for a device that is slower than the gateway, before packets are dropped
+#define SERIAL_MAX_QUEUE     (256 * 1024)
+
+typedef struct {
+    const char *path;
+    int baud;
+    uint8_t wireless_node_id[MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH];
+    uint8_t wireless_node_id_len;
+    int fd;
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffer_start;
+    size_t buffer_len;
+    mqtt_sn_timer_t resync_timer;
+
+    // Packets waiting to be written, while the port is not ready for them
+    uint8_t *queue;
+    size_t queue_size;
+    size_t queue_start;
+    size_t queue_len;
+} serial_device_t;
+
+serial_device_t *devices = NULL;
+int device_count = 0;
+int open_devices = 0;
 
 static speed_t baud_lookup(int baud)
 {
@@ -103,18 +138,57 @@ static speed_t baud_lookup(int baud)
 
 static void usage()
 {
-    fprintf(stderr, "Usage: mqtt-sn-serial-bridge [opts] <device>\n");
+    fprintf(stderr, "Usage: mqtt-sn-serial-bridge [opts] <device>[:<baud>[:<wlnid>]] [<device>...]\n");
     fprintf(stderr, "\n");
-    fprintf(stderr, "  -b <baud>      Set the baud rate. Defaults to %d.\n", (int)serial_baud);
+    fprintf(stderr, "  -b <baud>      Set the baud rate for devices without one. Defaults to %d.\n", (int)serial_baud);
     fprintf(stderr, "  -d             Increase debug level by one. -d can occur multiple times.\n");
     fprintf(stderr, "  -dd            Enable extended debugging - display packets in hex.\n");
     fprintf(stderr, "  -h <host>      MQTT-SN host to connect to. Defaults to '%s'.\n", mqtt_sn_host);
     fprintf(stderr, "  -p <port>      Network port to connect to. Defaults to %s.\n", mqtt_sn_port);
     fprintf(stderr, "  --fe           Enables Forwarder Encapsulation. Mqtt-sn packets are encapsulated according to MQTT-SN Protocol Specification v1.2, chapter 5.5 Forwarder Encapsulation.\n");
+    fprintf(stderr, "                 Always enabled when bridging more than one device.\n");
     fprintf(stderr, "  --cport <port> Source port for outgoing packets. Uses port in ephemeral range if not specified or set to %d.\n", source_port);
     exit(EXIT_FAILURE);
 }
 
+// Parse a device argument in the form <device>[:<baud>[:<wlnid>]]
+static void parse_device(serial_device_t *device, char* arg)
+{
+    char *baud = strchr(arg, ':');
+    char *wlnid = NULL;
+    const char *name;
+
+    device->path = arg;
+    device->baud = serial_baud;
+    device->fd = -1;
+
+    if (baud) {
+        *baud++ = '\0';
+        wlnid = strchr(baud, ':');
+        if (wlnid) {
+            *wlnid++ = '\0';
+        }
+        if (*baud) {
+            device->baud = atoi(baud);
+            baud_lookup(device->baud);
+        }
+    }
+
+    // Default to the name of the device, without the directory
+    if (wlnid == NULL || *wlnid == '\0') {
+        name = strrchr(arg, '/');
+        wlnid = (char*)(name ? name + 1 : arg);
+    }
+
+    if (strlen(wlnid) > MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH) {
+        mqtt_sn_log_err("Wireless node ID for %s is too long", arg);
+        exit(EXIT_FAILURE);
+    }
+
+    device->wireless_node_id_len = strlen(wlnid);
+    memcpy(device->wireless_node_id, wlnid, device->wireless_node_id_len);
+}
+
 static void parse_opts(int argc, char** argv)
 {
 
@@ -149,7 +223,6 @@ static void parse_opts(int argc, char** argv)
                 break;
 
             case 1000:
-                mqtt_sn_enable_frwdencap();
                 frwdencap = TRUE;
                 break;
             case 1001:
@@ -163,23 +236,37 @@ static void parse_opts(int argc, char** argv)
         } // switch
     } // while
 
-    // Final argument is the serial port device path
+    // Remaining arguments are the serial port device paths
     if (argc-optind < 1) {
         fprintf(stderr, "Missing serial port.\n");
         usage();
     } else {
-        serial_device = argv[optind];
+        int i;
+
+        device_count = argc-optind;
+        devices = calloc(device_count, sizeof(serial_device_t));
+        if (!devices) {
+            mqtt_sn_log_err("Failed to allocate memory for serial devices");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i=0; i<device_count; i++) {
+            parse_device(&devices[i], argv[optind+i]);
+        }
+    }
+
+    // Replies from the gateway can only be routed by wireless node ID
+    if (device_count > 1) {
+        frwdencap = TRUE;
     }
 }
 
 
-static int serial_open(const char* device_path)
+static int serial_open(const char* device_path, int baud)
 {
     struct termios tios;
     int fd;
 
-    mqtt_sn_disable_frwdencap();
-
     mqtt_sn_log_debug("Opening %s", device_path);
 
     fd = open(device_path, O_RDWR | O_NOCTTY | O_NDELAY);
@@ -188,15 +275,15 @@ static int serial_open(const char* device_path)
         exit(EXIT_FAILURE);
     }
 
-    // Turn back on blocking reads
-    fcntl(fd, F_SETFL, 0);
+    // The port stays non-blocking, so that a slow device can't hold up the others
+    fcntl(fd, F_SETFL, O_NONBLOCK);
 
     // Read existing serial port settings
     tcgetattr(fd, &tios);
 
     // Set the input and output baud rates
-    cfsetispeed(&tios, baud_lookup(serial_baud));
-    cfsetospeed(&tios, baud_lookup(serial_baud));
+    cfsetispeed(&tios, baud_lookup(baud));
+    cfsetospeed(&tios, baud_lookup(baud));
 
     // Set to local mode
     tios.c_cflag |= CLOCAL | CREAD;
@@ -217,74 +304,224 @@ static int serial_open(const char* device_path)
     // set input mode (non-canonical, no echo,...)
     tios.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
 
-    // Set VMIN high, so that we wait for a gap in the data
+    // Reads return whatever is available straight away, the event loop
+    // tells us when there is something to read
     // http://www.unixwiz.net/techtips/termios-vmin-vtime.html
-    tios.c_cc[VMIN]     = 255;
-    tios.c_cc[VTIME]    = 1;
+    tios.c_cc[VMIN]     = 0;
+    tios.c_cc[VTIME]    = 0;
 
     tcsetattr(fd, TCSAFLUSH, &tios);
 
-    // Flush the input buffer
-    sleep(1);
-    tcflush(fd, TCIOFLUSH);
-
     return fd;
 }
 
-static void* serial_read_packet(int fd)
+static void serial_forward_packet(serial_device_t *device, uint8_t *packet, size_t length)
 {
-    static uint8_t buf[MQTT_SN_MAX_PACKET_LENGTH+1];
+    if (mqtt_sn_validate_packet(&client, packet, length) == FALSE) {
+        return;
+    }
+
+    if (debug) {
+        const char* type = mqtt_sn_type_string(packet[packet[0] == 0x01 ? 3 : 1]);
+        char hex[MQTT_SN_MAX_PACKET_LENGTH * 5 + 8] = "";
 
-    // First get the length of the packet
-    int bytes_read = read(fd, buf, 1);
-    if (bytes_read != 1) {
-        mqtt_sn_log_err("Error reading packet length from serial port: %d, %d", bytes_read, errno);
-        return NULL;
+        // Display the packet in hex on the following line, only the start of long packets
+        if (debug > 1) {
+            size_t i;
+            char *ptr = hex + sprintf(hex, "\n  ");
+            for (i=0; i<length && i<MQTT_SN_MAX_PACKET_LENGTH; i++) {
+                ptr += sprintf(ptr, "0x%2.2X ", packet[i]);
+            }
+            if (length > MQTT_SN_MAX_PACKET_LENGTH) {
+                strcat(ptr, "...");
+            }
+        }
+        mqtt_sn_log_debug("Serial -> UDP (device=%s, bytes_read=%d, type=%s)%s", device->path, (int)length, type, hex);
     }
 
-    if (buf[0] == 0x00) {
-        mqtt_sn_log_err("Packets of length 0 are invalid.");
-        return NULL;
+    packet = mqtt_sn_packet_from_wire(packet);
+
+    if (frwdencap) {
+        mqtt_sn_send_frwdencap_packet(&client, packet, device->wireless_node_id, device->wireless_node_id_len);
+    } else {
+        mqtt_sn_send_packet(&client, packet);
     }
+}
 
-    // Read in the rest of the packet
-    bytes_read = read(fd, &buf[1], buf[0]-1);
-    if (bytes_read <= 0) {
-        mqtt_sn_log_err("Error reading rest of packet from serial port: %d, %d", bytes_read, errno);
-        return NULL;
+static void serial_skip(serial_device_t *device, size_t count)
+{
+    device->buffer_start += count;
+    device->buffer_len -= count;
+    if (device->buffer_len == 0) {
+        device->buffer_start = 0;
+    }
+}
+
+static void serial_grow_buffer(serial_device_t *device, size_t size)
+{
+    uint8_t *buffer = realloc(device->buffer, size);
+
+    if (buffer == NULL) {
+        mqtt_sn_log_err("Failed to allocate memory for serial buffer");
+        exit(EXIT_FAILURE);
+    }
+    device->buffer = buffer;
+    device->buffer_size = size;
+}
+
+// Extract every complete packet from the buffer, skipping over anything
+// that can't be the start of a packet until the stream is back in step.
+// If the port has gone quiet, partial packets are skipped over too.
+static void serial_process_buffer(serial_device_t *device, uint8_t stalled)
+{
+    size_t skipped = 0;
+
+    while (device->buffer_len > 0) {
+        uint8_t *buf = &device->buffer[device->buffer_start];
+        size_t header_len = 1;
+        size_t length = buf[0];
+
+        if (buf[0] == 0x01) {
+            // Three byte length field
+            if (device->buffer_len < 3) {
+                break;
+            }
+            header_len = 3;
+            length = (buf[1] << 8) | buf[2];
+        }
+
+        if (length <= header_len || length > MQTT_SN_MAX_LONG_PACKET_LENGTH) {
+            serial_skip(device, 1);
+            skipped++;
+            continue;
+        }
+
+        if (device->buffer_len > header_len && !mqtt_sn_valid_type(buf[header_len])) {
+            serial_skip(device, 1);
+            skipped++;
+            continue;
+        }
+
+        if (device->buffer_len < length) {
+            if (stalled) {
+                serial_skip(device, 1);
+                skipped++;
+                continue;
+            }
+            if (length > device->buffer_size) {
+                serial_grow_buffer(device, length);
+            }
+            break;
+        }
+
+        serial_forward_packet(device, buf, length);
+        serial_skip(device, length);
+    }
+
+    if (skipped) {
+        mqtt_sn_log_warn("Skipped %d bytes from %s", (int)skipped, device->path);
+    }
+
+    // Give up on a partial packet if the rest doesn't arrive soon
+    if (device->buffer_len > 0) {
+        mqtt_sn_timer_start(&loop, &device->resync_timer, SERIAL_RESYNC_MS);
     } else {
-        bytes_read += 1;
+        mqtt_sn_timer_stop(&loop, &device->resync_timer);
     }
+}
+
+static void serial_writable(void *data);
 
-    if (mqtt_sn_validate_packet(buf, bytes_read) == FALSE) {
-        return NULL;
+// Add bytes to the end of the queue, making room at the front first
+static void serial_queue(serial_device_t *device, const uint8_t *data, size_t len)
+{
+    if (device->queue_start > 0) {
+        memmove(device->queue, &device->queue[device->queue_start], device->queue_len);
+        device->queue_start = 0;
     }
 
-    // NULL-terminate the packet
-    buf[bytes_read] = '\0';
+    if (device->queue_len + len > device->queue_size) {
+        size_t size = device->queue_size ? device->queue_size : SERIAL_BUFFER_SIZE;
+        uint8_t *queue;
 
-    if (debug) {
-        const char* type = mqtt_sn_type_string(buf[1]);
-        mqtt_sn_log_debug("Serial -> UDP (bytes_read=%d, type=%s)", bytes_read, type);
-        if (debug > 1) {
-            int i;
-            fprintf(stderr, "  ");
-            for (i=0; i<buf[0]; i++) {
-                fprintf(stderr, "0x%2.2X ", buf[i]);
+        while (size < device->queue_len + len) {
+            size *= 2;
+        }
+        queue = realloc(device->queue, size);
+        if (queue == NULL) {
+            mqtt_sn_log_err("Failed to allocate memory for serial queue");
+            exit(EXIT_FAILURE);
+        }
+        device->queue = queue;
+        device->queue_size = size;
+    }
+
+    memcpy(&device->queue[device->queue_len], data, len);
+    device->queue_len += len;
+}
+
+// Write as much as the port will take straight away, and queue the rest
+// until the event loop says that the port is ready for more
+static void serial_write_packet(serial_device_t *device, const void* packet)
+{
+    uint8_t header[3];
+    struct iovec iov[2];
+    int iovcnt = mqtt_sn_packet_iov(packet, header, iov);
+    size_t len = mqtt_sn_packet_length(packet);
+    ssize_t sent = 0;
+    int i;
+
+    if (device->fd < 0) {
+        mqtt_sn_log_warn("Dropping packet for closed serial port %s", device->path);
+        return;
+    } else if (device->queue_len + len > SERIAL_MAX_QUEUE) {
+        mqtt_sn_log_warn("Dropping %d byte packet for %s, which is not keeping up", (int)len, device->path);
+        return;
+    }
+
+    if (device->queue_len == 0) {
+        sent = writev(device->fd, iov, iovcnt);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                mqtt_sn_log_warn("Error writing to serial port %s: %s", device->path, strerror(errno));
+                return;
             }
-            fprintf(stderr, "\n");
+            sent = 0;
+        }
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if ((size_t)sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+        } else {
+            serial_queue(device, (uint8_t*)iov[i].iov_base + sent, iov[i].iov_len - sent);
+            sent = 0;
         }
     }
-    return buf;
+
+    if (device->queue_len > 0) {
+        mqtt_sn_event_watch_write(&loop, device->fd, serial_writable);
+    }
 }
 
-void serial_write_packet(int fd, const void* packet)
+static void serial_writable(void *data)
 {
-    size_t sent, len = ((uint8_t*)packet)[0];
+    serial_device_t *device = data;
+    ssize_t sent = write(device->fd, &device->queue[device->queue_start], device->queue_len);
+
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return;
+        }
+        mqtt_sn_log_warn("Error writing to serial port %s: %s", device->path, strerror(errno));
+        sent = device->queue_len;
+    }
 
-    sent = write(fd, packet, len);
-    if (sent != len) {
-        mqtt_sn_log_warn("Warning: only sent %d of %d bytes", (int)sent, (int)len);
+    device->queue_start += sent;
+    device->queue_len -= sent;
+    if (device->queue_len == 0) {
+        device->queue_start = 0;
+        mqtt_sn_event_watch_write(&loop, device->fd, NULL);
     }
 }
 
@@ -307,10 +544,93 @@ static void termination_handler (int signum)
 }
 
 
+static serial_device_t* lookup_device(const uint8_t *wireless_node_id, uint8_t wireless_node_id_len)
+{
+    int i;
+
+    // Without forwarder encapsulation there is only a single device
+    if (wireless_node_id == NULL) {
+        return device_count == 1 ? &devices[0] : NULL;
+    }
+
+    for (i=0; i<device_count; i++) {
+        if (devices[i].wireless_node_id_len == wireless_node_id_len &&
+                memcmp(devices[i].wireless_node_id, wireless_node_id, wireless_node_id_len) == 0) {
+            return &devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void serial_readable(void *data)
+{
+    serial_device_t *device = data;
+    ssize_t bytes_read;
+
+    // Move any partial packet to the start of the buffer
+    if (device->buffer_start > 0) {
+        memmove(device->buffer, &device->buffer[device->buffer_start], device->buffer_len);
+        device->buffer_start = 0;
+    }
+
+    bytes_read = read(device->fd, &device->buffer[device->buffer_len], device->buffer_size - device->buffer_len);
+    if (bytes_read <= 0) {
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        mqtt_sn_log_err("Error reading from serial port %s: %d, %d", device->path, (int)bytes_read, errno);
+        mqtt_sn_event_unwatch(&loop, device->fd);
+        mqtt_sn_timer_stop(&loop, &device->resync_timer);
+        close(device->fd);
+        device->fd = -1;
+        if (--open_devices == 0) {
+            keep_running = FALSE;
+        }
+        return;
+    }
+
+    device->buffer_len += bytes_read;
+    serial_process_buffer(device, FALSE);
+}
+
+static void serial_resync(void *data)
+{
+    serial_device_t *device = data;
+
+    mqtt_sn_log_warn("Timed out waiting for rest of packet from %s", device->path);
+    serial_process_buffer(device, TRUE);
+}
+
+static void socket_readable(void *data)
+{
+    do {
+        uint8_t *wireless_node_id = NULL;
+        uint8_t wireless_node_id_len = 0;
+        void *packet = mqtt_sn_receive_frwdencap_packet(&client, &wireless_node_id, &wireless_node_id_len);
+
+        if (packet) {
+            serial_device_t *device = lookup_device(wireless_node_id, wireless_node_id_len);
+            if (device) {
+                if (debug) {
+                    mqtt_sn_log_debug("UDP -> Serial (device=%s, type=%s)", device->path,
+                                      mqtt_sn_type_string(((uint8_t*)packet)[1]));
+                }
+                serial_write_packet(device, packet);
+            } else {
+                mqtt_sn_log_warn("No serial device for wireless node ID '%.*s'",
+                                 (int)wireless_node_id_len, wireless_node_id ? (char*)wireless_node_id : "");
+            }
+        }
+    } while (mqtt_sn_pending_packets(&client) > 0);
+}
+
 int main(int argc, char* argv[])
 {
-    int fd = -1;
     int sock = -1;
+    int i;
+
+    mqtt_sn_client_init(&client);
 
     // Parse the command-line options
     parse_opts(argc, argv);
@@ -323,49 +643,50 @@ int main(int argc, char* argv[])
     signal(SIGHUP, termination_handler);
 
     // Create a UDP socket
-    sock = mqtt_sn_create_socket(mqtt_sn_host, mqtt_sn_port, source_port);
+    sock = mqtt_sn_create_socket(&client, mqtt_sn_host, mqtt_sn_port, source_port);
 
-    // Open the serial port
-    fd = serial_open(serial_device);
+    // Open the serial ports
+    for (i=0; i<device_count; i++) {
+        devices[i].fd = serial_open(devices[i].path, devices[i].baud);
+        serial_grow_buffer(&devices[i], SERIAL_BUFFER_SIZE);
+    }
 
-    while (keep_running) {
-        fd_set fdset;
+    // Flush the input buffers, once all the ports have settled
+    sleep(1);
+    for (i=0; i<device_count; i++) {
+        tcflush(devices[i].fd, TCIOFLUSH);
+    }
 
-        FD_ZERO(&fdset);                // Clear the socket set
-        FD_SET(fd, &fdset);             // Add serial into fdset
-        FD_SET(sock, &fdset);           // Add socket into fdset
+    mqtt_sn_event_loop_init(&loop);
+    for (i=0; i<device_count; i++) {
+        mqtt_sn_timer_init(&devices[i].resync_timer, serial_resync, &devices[i]);
+        mqtt_sn_event_watch(&loop, devices[i].fd, serial_readable, &devices[i]);
+    }
+    open_devices = device_count;
+    mqtt_sn_event_watch(&loop, sock, socket_readable, NULL);
 
-        if (select(FD_SETSIZE, &fdset, NULL, NULL, NULL) < 0) {
+    while (keep_running) {
+        if (mqtt_sn_event_loop_run_once(&loop, -1) < 0) {
             if (errno != EINTR) {
-                perror("select");
+                perror("event loop");
             }
             break;
         }
+    }
 
-        // Read serial line
-        if (FD_ISSET(fd, &fdset)) {
-            void *packet = serial_read_packet(fd);
-            if (packet) {
-                if (frwdencap) {
-                    mqtt_sn_send_frwdencap_packet(sock, packet, NULL, 0);
-                } else {
-                    mqtt_sn_send_packet(sock, packet);
-                }
-            }
-        }
+    mqtt_sn_event_loop_cleanup(&loop);
 
-        if (FD_ISSET(sock, &fdset)) {
-            void *packet = mqtt_sn_receive_packet(sock);
-            if (packet) {
-                serial_write_packet(fd, packet);
-            }
+    close(sock);
+    for (i=0; i<device_count; i++) {
+        if (devices[i].fd >= 0) {
+            close(devices[i].fd);
         }
+        free(devices[i].buffer);
+        free(devices[i].queue);
     }
+    free(devices);
 
-    close(sock);
-    close(fd);
-
-    mqtt_sn_cleanup();
+    mqtt_sn_cleanup(&client);
 
     return 0;
 }
@@ -38,28 +38,34 @@
 #include "mqtt-sn.h"
 
 const char *client_id = NULL;
-// Array of pointers to topic names
-char **topic_name_ar = NULL;
-// Topic names array size. When too small it is incremented by ARRAY_INCREMENT.
-uint16_t topic_name_ar_size = 0;
-uint16_t topic_name_index = 0;
-// Array of predefined topic IDs to subscribe to
-uint16_t *predef_topic_id_ar = NULL;
-// Predefined topic IDs array size. When too small it is incremented by ARRAY_INCREMENT.
-uint16_t predef_topic_id_ar_size = 0;
-uint16_t predef_topic_id_index = 0;
-#define ARRAY_INCREMENT 10
+const char *cache_file = NULL;
+// Topic names and predefined topic IDs to subscribe to. The array doubles in size when full.
+topic_request_t *topics = NULL;
+uint32_t topics_size = 0;
+uint32_t topics_count = 0;
+// Contents of the topic file, which the topic names point into
+char *topic_file_data = NULL;
+uint16_t subscribe_window = 1;
 const char *mqtt_sn_host = "127.0.0.1";
 const char *mqtt_sn_port = MQTT_SN_DEFAULT_PORT;
 uint16_t source_port = 0;
+uint8_t discover = FALSE;
+uint32_t discover_wait = MQTT_SN_DEFAULT_DISCOVERY_WAIT;
+const char *gateway_cache_file = NULL;
 uint16_t keep_alive = MQTT_SN_DEFAULT_KEEP_ALIVE;
 uint16_t sleep_duration = 0;
+uint32_t timeout = 0;
+uint8_t retries = MQTT_SN_DEFAULT_RETRIES;
 int8_t qos = 0;
 uint8_t retain = FALSE;
 uint8_t debug = 0;
 uint8_t single_message = FALSE;
 uint8_t clean_session = TRUE;
 uint8_t verbose = 0;
+int8_t output_format = MQTT_SN_OUTPUT_TEXT;
+uint16_t flush_interval = 0;
+uint32_t reassembly_limit = 0;
+mqtt_sn_client_t client;
 
 uint8_t keep_running = TRUE;
 
@@ -78,14 +84,93 @@ static void usage()
     fprintf(stderr, "  -q <qos>       QoS level to subscribe with (0 or 1). Defaults to %d.\n", qos);
     fprintf(stderr, "  -t <topic>     MQTT-SN topic name to subscribe to. It may repeat multiple times.\n");
     fprintf(stderr, "  -T <topicid>   Pre-defined MQTT-SN topic ID to subscribe to. It may repeat multiple times.\n");
+    fprintf(stderr, "  --topic-file <file> File of MQTT-SN topic names to subscribe to, one per line.\n");
+    fprintf(stderr, "  --window <n>   Maximum number of SUBSCRIBE packets waiting for a SUBACK. Defaults to %d.\n", subscribe_window);
     fprintf(stderr, "  --fe           Enables Forwarder Encapsulation. Mqtt-sn packets are encapsulated according to MQTT-SN Protocol Specification v1.2, chapter 5.5 Forwarder Encapsulation.\n");
     fprintf(stderr, "  --wlnid        If Forwarder Encapsulation is enabled, wireless node ID for this client. Defaults to process id.\n");
     fprintf(stderr, "  --cport <port> Source port for outgoing packets. Uses port in ephemeral range if not specified or set to %d.\n", source_port);
     fprintf(stderr, "  -v             Print messages verbosely, showing the topic name.\n");
     fprintf(stderr, "  -V             Print messages verbosely, showing current time and the topic name.\n");
+    fprintf(stderr, "  --format <fmt> Output format for messages: text, json, csv or binary. Defaults to text.\n");
+    fprintf(stderr, "  --flush <ms>   Maximum time that messages are buffered before being written. Defaults to %d, for every message.\n", flush_interval);
+    fprintf(stderr, "  --timeout <ms> Time to wait for a reply from the gateway. Defaults to half the keep alive.\n");
+    fprintf(stderr, "  --retries <n>  Number of times to resend a message that is not acknowledged. Defaults to %d.\n", MQTT_SN_DEFAULT_RETRIES);
+    fprintf(stderr, "  --cache <file> File to keep topic ids and message ids in between runs, for use with -c.\n");
+    fprintf(stderr, "  --reassemble   Put messages split into chunks by mqtt-sn-pub --chunk back together.\n");
+    fprintf(stderr, "  --reassemble-limit <n> Maximum bytes of messages being put back together. Defaults to %d.\n", MQTT_SN_DEFAULT_REASSEMBLY_LIMIT);
+    fprintf(stderr, "  --discover     Send SEARCHGW to the -h address, which can be broadcast or multicast, and connect to the gateway that replies fastest.\n");
+    fprintf(stderr, "  --discover-wait <ms> Time to wait for gateways to reply to SEARCHGW. Defaults to %d.\n", discover_wait);
+    fprintf(stderr, "  --gateway-cache <file> File to keep discovered gateways in between runs, until they expire. Implies --discover.\n");
     exit(EXIT_FAILURE);
 }
 
+static void add_topic(const char* topic_name, uint16_t topic_id)
+{
+    if (topics_count == topics_size) {
+        topics_size = topics_size ? topics_size * 2 : 16;
+        topics = realloc(topics, topics_size * sizeof(topic_request_t));
+        if (topics == NULL) {
+            mqtt_sn_log_err("Failed to allocate memory for topics");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    topics[topics_count].topic_name = topic_name;
+    topics[topics_count].topic_id = topic_id;
+    topics_count++;
+}
+
+static void read_topic_file(const char* filename)
+{
+    FILE* file = NULL;
+    size_t length = 0;
+    size_t size = 0;
+    char *line;
+
+    if (topic_file_data) {
+        mqtt_sn_log_err("Only one topic file can be given");
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(filename, "-") == 0) {
+        file = stdin;
+    } else {
+        file = fopen(filename, "rb");
+    }
+
+    if (!file) {
+        perror("Failed to open topic file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the whole file, then split it into lines in place
+    do {
+        if (length + 1 >= size) {
+            size = size ? size * 2 : 4096;
+            topic_file_data = realloc(topic_file_data, size);
+            if (topic_file_data == NULL) {
+                mqtt_sn_log_err("Failed to allocate memory for topic file");
+                exit(EXIT_FAILURE);
+            }
+        }
+        length += fread(topic_file_data + length, 1, size - length - 1, file);
+    } while (!feof(file) && !ferror(file));
+
+    if (ferror(file)) {
+        perror("Failed to read topic file");
+        exit(EXIT_FAILURE);
+    }
+
+    if (file != stdin) {
+        fclose(file);
+    }
+    topic_file_data[length] = '\0';
+
+    for (line = strtok(topic_file_data, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+        add_topic(line, 0);
+    }
+}
+
 static void parse_opts(int argc, char** argv)
 {
 
@@ -93,6 +178,18 @@ static void parse_opts(int argc, char** argv)
         {"fe",    no_argument,       0, 1000 },
         {"wlnid", required_argument, 0, 1001 },
         {"cport", required_argument, 0, 1002 },
+        {"format", required_argument, 0, 1003 },
+        {"flush", required_argument, 0, 1004 },
+        {"timeout", required_argument, 0, 1005 },
+        {"retries", required_argument, 0, 1006 },
+        {"cache", required_argument, 0, 1007 },
+        {"topic-file", required_argument, 0, 1008 },
+        {"window", required_argument, 0, 1009 },
+        {"reassemble", no_argument, 0, 1010 },
+        {"reassemble-limit", required_argument, 0, 1011 },
+        {"discover", no_argument, 0, 1012 },
+        {"discover-wait", required_argument, 0, 1013 },
+        {"gateway-cache", required_argument, 0, 1014 },
         {0, 0, 0, 0}
     };
 
@@ -140,35 +237,80 @@ static void parse_opts(int argc, char** argv)
                 break;
 
             case 't':
-                // Resize topic names array when too small
-                if (topic_name_index == topic_name_ar_size) {
-                    topic_name_ar = realloc(topic_name_ar, (topic_name_ar_size + ARRAY_INCREMENT) * sizeof(char*)) ;
-                    topic_name_ar_size += ARRAY_INCREMENT;
-                }
-                topic_name_ar[topic_name_index++] = optarg;
+                add_topic(optarg, 0);
                 break;
 
             case 'T':
-                // Resize predefined topic IDs array when too small
-                if (predef_topic_id_index == predef_topic_id_ar_size) {
-                    predef_topic_id_ar = realloc(predef_topic_id_ar, (predef_topic_id_ar_size + ARRAY_INCREMENT) * sizeof(uint16_t));
-                    predef_topic_id_ar_size += ARRAY_INCREMENT;
-                }
-                predef_topic_id_ar[predef_topic_id_index++] = atoi(optarg);
+                add_topic(NULL, atoi(optarg));
                 break;
 
             case 1000:
-                mqtt_sn_enable_frwdencap();
+                mqtt_sn_enable_frwdencap(&client);
                 break;
 
             case 1001:
-                mqtt_sn_set_frwdencap_parameters((uint8_t*)optarg, strlen(optarg));
+                mqtt_sn_set_frwdencap_parameters(&client, (uint8_t*)optarg, strlen(optarg));
                 break;
 
             case 1002:
                 source_port = atoi(optarg);
                 break;
 
+            case 1003:
+                output_format = mqtt_sn_parse_output_format(optarg);
+                if (output_format < 0) {
+                    mqtt_sn_log_err("Unknown output format: %s", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 1004:
+                flush_interval = atoi(optarg);
+                break;
+
+            case 1005:
+                timeout = atoi(optarg);
+                break;
+
+            case 1006:
+                retries = atoi(optarg);
+                break;
+
+            case 1007:
+                cache_file = optarg;
+                break;
+
+            case 1008:
+                read_topic_file(optarg);
+                break;
+
+            case 1009:
+                subscribe_window = atoi(optarg);
+                break;
+
+            case 1010:
+                if (reassembly_limit == 0) {
+                    reassembly_limit = MQTT_SN_DEFAULT_REASSEMBLY_LIMIT;
+                }
+                break;
+
+            case 1011:
+                reassembly_limit = strtoul(optarg, NULL, 10);
+                break;
+
+            case 1012:
+                discover = TRUE;
+                break;
+
+            case 1013:
+                discover_wait = atoi(optarg);
+                break;
+
+            case 1014:
+                gateway_cache_file = optarg;
+                discover = TRUE;
+                break;
+
             case 'v':
                 // Prevent -v setting verbose level back down to 1 if already set to 2 by -V
                 verbose = (verbose == 0) ? 1 : verbose;
@@ -185,7 +327,7 @@ static void parse_opts(int argc, char** argv)
         }
 
     // Missing Parameter?
-    if (!topic_name_index && !predef_topic_id_index) {
+    if (!topics_count) {
         usage();
     }
 }
@@ -210,79 +352,91 @@ static void termination_handler (int signum)
 
 int main(int argc, char* argv[])
 {
+    int exit_code = EXIT_SUCCESS;
     int sock;
 
-    mqtt_sn_disable_frwdencap();
+    mqtt_sn_client_init(&client);
 
     // Parse the command-line options
     parse_opts(argc, argv);
 
     // Enable debugging?
     mqtt_sn_set_debug(debug);
-    mqtt_sn_set_verbose(verbose);
-    mqtt_sn_set_timeout(keep_alive / 2);
+    mqtt_sn_set_verbose(&client, verbose);
+    mqtt_sn_set_output_format(&client, output_format, flush_interval);
+    mqtt_sn_set_timeout(&client, timeout ? timeout : keep_alive * 500);
+    mqtt_sn_set_retries(&client, retries);
+    mqtt_sn_set_reassembly(&client, reassembly_limit);
+
+    // Queue PUBACKs, so that those for a batch of received packets are sent together
+    mqtt_sn_set_batch(&client, MQTT_SN_MAX_BATCH, MQTT_SN_DEFAULT_BATCH_LATENCY);
 
     // Setup signal handlers
     signal(SIGTERM, termination_handler);
     signal(SIGINT, termination_handler);
     signal(SIGHUP, termination_handler);
 
-    // Create a UDP socket
-    sock = mqtt_sn_create_socket(mqtt_sn_host, mqtt_sn_port, source_port);
+    // Create a UDP socket, connected to a gateway that was found or to the one given
+    if (gateway_cache_file) {
+        mqtt_sn_open_gateway_cache(&client, gateway_cache_file);
+    }
+    if (discover) {
+        sock = mqtt_sn_discover_gateway(&client, mqtt_sn_host, mqtt_sn_port, source_port, discover_wait);
+    } else {
+        sock = mqtt_sn_create_socket(&client, mqtt_sn_host, mqtt_sn_port, source_port);
+    }
     if (sock) {
-        // Connect to server
-        mqtt_sn_log_debug("Connecting...");
-        mqtt_sn_send_connect(sock, client_id, keep_alive, clean_session);
-        mqtt_sn_receive_connack(sock);
-
-        uint16_t i;
-        // Subscribe to the each topic name
-        for (i = 0; i < topic_name_index; i++) {
-            mqtt_sn_log_debug("Subscribing to topic name: %s ...", topic_name_ar[i]);
-            mqtt_sn_send_subscribe_topic_name(sock, topic_name_ar[i], qos);
-
-            // Wait for the subscription acknowledgment
-            uint16_t topic_id = mqtt_sn_receive_suback(sock);
-            if (topic_id && strlen(topic_name_ar[i]) > 2) {
-                mqtt_sn_register_topic(topic_id, topic_name_ar[i]);
-            }
+        // Take the time that each message was received from the kernel
+        if (verbose == 2 || output_format != MQTT_SN_OUTPUT_TEXT) {
+            mqtt_sn_enable_timestamps(&client);
         }
 
-        // Subscribe to the each predefined topic ID
-        for (i = 0; i < predef_topic_id_index; i++) {
-            mqtt_sn_log_debug("Subscribing to predefined topic ID: %u ...", predef_topic_id_ar[i]);
-            mqtt_sn_send_subscribe_topic_id(sock, predef_topic_id_ar[i], qos);
-
-            // Wait for the subscription acknowledgment
-            mqtt_sn_receive_suback(sock);
+        if (cache_file) {
+            mqtt_sn_open_session_cache(&client, cache_file);
         }
 
+        // Connect to server
+        mqtt_sn_log_debug("Connecting...");
+        mqtt_sn_send_connect(&client, client_id, keep_alive, clean_session);
+        mqtt_sn_receive_connack(&client);
+
+        // Subscribe to each topic, with up to a window of SUBSCRIBE packets waiting for a SUBACK
+        mqtt_sn_log_debug("Subscribing to %u topics...", topics_count);
+        mqtt_sn_subscribe_topics(&client, topics, topics_count, qos, subscribe_window);
+
         // Keep processing packets until process is terminated
         while(keep_running) {
-            publish_packet_t *packet = mqtt_sn_wait_for(MQTT_SN_TYPE_PUBLISH, sock);
+            publish_packet_t *packet = mqtt_sn_wait_for(&client, MQTT_SN_TYPE_PUBLISH);
             if (packet) {
                 uint8_t packet_qos = packet->flags & MQTT_SN_FLAG_QOS_MASK;
                 if (packet_qos == MQTT_SN_FLAG_QOS_1) {
-                    mqtt_sn_send_puback(sock, packet, MQTT_SN_ACCEPTED);
+                    mqtt_sn_send_puback(&client, packet, MQTT_SN_ACCEPTED);
                 }
+            }
 
-                if (single_message) {
-                    break;
-                }
+            if (single_message && !client.partial_message && client.reassembly_failed) {
+                mqtt_sn_log_err("Failed to reassemble the message.");
+                exit_code = EXIT_FAILURE;
+                break;
+            }
+
+            // Wait for the rest of a message that was split into chunks
+            if (packet && single_message && !client.partial_message) {
+                break;
             }
         }
 
         // Finally, disconnect
         mqtt_sn_log_debug("Disconnecting...");
-        mqtt_sn_send_disconnect(sock, sleep_duration);
-        mqtt_sn_receive_disconnect(sock);
+        mqtt_sn_send_disconnect(&client, sleep_duration);
+        mqtt_sn_receive_disconnect(&client);
 
         close(sock);
     }
 
-    mqtt_sn_cleanup();
-    free(topic_name_ar);
-    free(predef_topic_id_ar);
+    mqtt_sn_cleanup(&client);
+    free(topics);
+    free(topic_file_data);
 
-    return 0;
+    return exit_code;
 }
@@ -22,6 +22,8 @@
   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -35,6 +37,18 @@
 #include <time.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
 
 #include "mqtt-sn.h"
 
@@ -44,46 +58,238 @@
 #endif
 
 static uint8_t debug = 0;
-static uint8_t verbose = 0;
-static uint8_t timeout = MQTT_SN_DEFAULT_TIMEOUT;
-static uint16_t next_message_id = 1;
-static time_t last_transmit = 0;
-static time_t last_receive = 0;
-static time_t keep_alive = 0;
-static uint8_t forwarder_encapsulation = FALSE;
-const uint8_t *wireless_node_id = NULL;
-uint8_t wireless_node_id_len  = 0;
 
-topic_map_t *topic_map = NULL;
+static void* mqtt_sn_wait_for_timeout(mqtt_sn_client_t *client, uint8_t type, uint64_t timeout);
+static void mqtt_sn_load_session_cache(mqtt_sn_client_t *client, const char* client_id, uint8_t clean_session);
+static void mqtt_sn_clear_session_cache(mqtt_sn_client_t *client);
+static void mqtt_sn_refresh_gateway(mqtt_sn_client_t *client, const uint8_t *packet);
+static void mqtt_sn_forget_gateway(mqtt_sn_client_t *client);
 
 
+void mqtt_sn_client_init(mqtt_sn_client_t *client)
+{
+    memset(client, 0, sizeof(mqtt_sn_client_t));
+    client->sock = -1;
+    client->gateway_cache_fd = -1;
+    client->output = stdout;
+    client->timeout = MQTT_SN_DEFAULT_TIMEOUT;
+    client->next_message_id = 1;
+    client->forwarder_encapsulation = FALSE;
+    client->max_inflight = 1;
+    client->max_retries = MQTT_SN_DEFAULT_RETRIES;
+    client->rto = MQTT_SN_INITIAL_RTO;
+    client->batch_latency = MQTT_SN_DEFAULT_BATCH_LATENCY;
+    client->receive_depth = MQTT_SN_MAX_RECEIVE_BATCH;
+    client->receive_max_length = MQTT_SN_MAX_DATAGRAM_LENGTH;
+}
+
 void mqtt_sn_set_debug(uint8_t value)
 {
+#ifdef NDEBUG
+    if (value) {
+        mqtt_sn_log_warn("Debug logging was disabled when this program was compiled.");
+    }
+#else
     debug = value;
     mqtt_sn_log_debug("Debug level is: %d.", debug);
+#endif
+}
+
+void mqtt_sn_set_verbose(mqtt_sn_client_t *client, uint8_t value)
+{
+    client->verbose = value;
+    mqtt_sn_log_debug("Verbose level is: %d.", client->verbose);
+}
+
+void mqtt_sn_set_output_format(mqtt_sn_client_t *client, uint8_t format, uint16_t flush_interval)
+{
+    client->output_format = format;
+    client->output_flush_interval = flush_interval;
+    client->output_second = 0;
+
+    // Write whole blocks, rather than a line at a time
+    if (flush_interval > 0) {
+        setvbuf(client->output, NULL, _IOFBF, MQTT_SN_OUTPUT_BUFFER_SIZE);
+    }
+    mqtt_sn_log_debug("Output format is: %d, flushed every %d ms.", format, flush_interval);
+}
+
+// Returns -1 if the name is not a known output format
+int mqtt_sn_parse_output_format(const char *name)
+{
+    if (strcmp(name, "text") == 0) {
+        return MQTT_SN_OUTPUT_TEXT;
+    } else if (strcmp(name, "json") == 0) {
+        return MQTT_SN_OUTPUT_JSON;
+    } else if (strcmp(name, "csv") == 0) {
+        return MQTT_SN_OUTPUT_CSV;
+    } else if (strcmp(name, "binary") == 0) {
+        return MQTT_SN_OUTPUT_BINARY;
+    } else {
+        return -1;
+    }
+}
+
+void mqtt_sn_flush_output(mqtt_sn_client_t *client)
+{
+    if (client->output_pending_since) {
+        fflush(client->output);
+        client->output_pending_since = 0;
+    }
 }
 
-void mqtt_sn_set_verbose(uint8_t value)
+static void mqtt_sn_set_socket_timeout(mqtt_sn_client_t *client)
 {
-    verbose = value;
-    mqtt_sn_log_debug("Verbose level is: %d.", verbose);
+    struct timeval tv;
+
+    tv.tv_sec = client->timeout / 1000;
+    tv.tv_usec = (client->timeout % 1000) * 1000;
+    if (setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("Error setting timeout on socket");
+    }
+}
+
+void mqtt_sn_set_timeout(mqtt_sn_client_t *client, uint32_t timeout_ms)
+{
+    if (timeout_ms < 1) {
+        client->timeout = MQTT_SN_DEFAULT_TIMEOUT;
+    } else {
+        client->timeout = timeout_ms;
+    }
+    mqtt_sn_log_debug("Network timeout is: %u ms.", client->timeout);
+
+    if (client->sock >= 0) {
+        mqtt_sn_set_socket_timeout(client);
+    }
 }
 
-void mqtt_sn_set_timeout(uint8_t value)
+void mqtt_sn_set_max_inflight(mqtt_sn_client_t *client, uint16_t value)
 {
     if (value < 1) {
-        timeout = MQTT_SN_DEFAULT_TIMEOUT;
+        client->max_inflight = 1;
+    } else if (value > MQTT_SN_MAX_INFLIGHT) {
+        client->max_inflight = MQTT_SN_MAX_INFLIGHT;
+    } else {
+        client->max_inflight = value;
+    }
+    mqtt_sn_log_debug("In-flight window is: %d messages.", client->max_inflight);
+}
+
+void mqtt_sn_set_retries(mqtt_sn_client_t *client, uint8_t value)
+{
+    client->max_retries = value;
+    mqtt_sn_log_debug("Unacknowledged messages are resent up to %d times.", client->max_retries);
+}
+
+void mqtt_sn_set_batch(mqtt_sn_client_t *client, uint16_t size, uint16_t max_latency)
+{
+    mqtt_sn_flush_batch(client);
+
+    if (size > MQTT_SN_MAX_BATCH) {
+        client->batch_size = MQTT_SN_MAX_BATCH;
     } else {
-        timeout = value;
+        client->batch_size = size;
+    }
+    client->batch_latency = max_latency;
+
+    if (client->batch_size > 1 && client->batch == NULL) {
+        client->batch = malloc(sizeof(queued_packet_t) * MQTT_SN_MAX_BATCH);
+        if (!client->batch) {
+            mqtt_sn_log_err("Failed to allocate memory for batch of packets");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (client->batch_size > 1) {
+        mqtt_sn_log_debug("Sending up to %d packets per batch, waiting at most %d ms.", client->batch_size, client->batch_latency);
+    }
+}
+
+// Pace PUBLISH packets to an average of rate per second, allowing bursts of up to burst packets.
+// An adaptive rate starts at the given rate and backs off when the gateway is congested.
+void mqtt_sn_set_rate(mqtt_sn_client_t *client, double rate, uint16_t burst, uint8_t adaptive)
+{
+    client->rate = client->max_rate = rate;
+    client->burst = burst ? burst : 1;
+    client->tokens = client->burst;
+    client->tokens_updated = mqtt_sn_monotonic_us();
+    client->adaptive_rate = adaptive;
+    if (rate > 0) {
+        mqtt_sn_log_debug("Sending at up to %.1f messages per second, in bursts of up to %d%s.",
+                          rate, client->burst, adaptive ? ", backing off when congested" : "");
+    }
+}
+
+// Read up to depth datagrams of up to max_length bytes with each system call.
+// Every slot in the ring is max_length bytes, so clients that only expect short
+// packets should use a small max_length. Longer datagrams are dropped.
+// Call this before receiving anything, as the ring is allocated again.
+void mqtt_sn_set_receive_batch(mqtt_sn_client_t *client, uint16_t depth, uint16_t max_length)
+{
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > MQTT_SN_MAX_RECEIVE_BATCH) {
+        depth = MQTT_SN_MAX_RECEIVE_BATCH;
+    }
+
+    if (max_length < MQTT_SN_MAX_PACKET_LENGTH) {
+        max_length = MQTT_SN_MAX_PACKET_LENGTH;
+    } else if (max_length > MQTT_SN_MAX_DATAGRAM_LENGTH) {
+        max_length = MQTT_SN_MAX_DATAGRAM_LENGTH;
+    }
+
+    free(client->receive_ring);
+    free(client->receive_buffer);
+    client->receive_ring = NULL;
+    client->receive_buffer = NULL;
+    client->receive_count = 0;
+    client->receive_next = 0;
+    client->receive_depth = depth;
+    client->receive_max_length = max_length;
+    mqtt_sn_log_debug("Receiving up to %d datagrams of up to %d bytes at a time.", depth, max_length);
+}
+
+// Put messages that were split into chunks back together, using up to limit bytes of memory.
+// A limit of 0 turns reassembly off, so that chunks are output as they are.
+void mqtt_sn_set_reassembly(mqtt_sn_client_t *client, uint32_t limit)
+{
+    client->reassembly_limit = limit;
+    if (limit) {
+        mqtt_sn_log_debug("Reassembling chunked messages of up to %u bytes.", limit);
+    }
+}
+
+// Record the time that the kernel received each datagram
+void mqtt_sn_enable_timestamps(mqtt_sn_client_t *client)
+{
+    int on = 1;
+
+    if (setsockopt(client->sock, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) < 0) {
+        perror("setsockopt SO_TIMESTAMP");
+        exit(EXIT_FAILURE);
     }
-    mqtt_sn_log_debug("Network timeout is: %d seconds.", timeout);
+
+    client->receive_timestamps = TRUE;
 }
 
-int mqtt_sn_create_socket(const char* host, const char* port, uint16_t source_port)
+uint64_t mqtt_sn_monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+uint64_t mqtt_sn_monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+int mqtt_sn_create_socket(mqtt_sn_client_t *client, const char* host, const char* port, uint16_t source_port)
 {
     struct addrinfo hints;
     struct addrinfo *result, *rp;
-    struct timeval tv;
     int fd, ret;
 
     // Set options for the resolver
@@ -161,130 +367,453 @@ int mqtt_sn_create_socket(const char* host, const char* port, uint16_t source_po
 
     // FIXME: set the Don't Fragment flag
 
+    client->sock = fd;
+
     // Setup timeout on the socket
-    tv.tv_sec = timeout;
-    tv.tv_usec = 0;
-    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        perror("Error setting timeout on socket");
-    }
+    mqtt_sn_set_socket_timeout(client);
 
     return fd;
 }
 
-void mqtt_sn_send_packet(int sock, const void* data)
+void mqtt_sn_flush_batch(mqtt_sn_client_t *client)
+{
+    int i;
+
+    if (client->batch_count == 0) {
+        return;
+    }
+
+    if (debug > 1) {
+        mqtt_sn_log_debug("Sending batch of %d packets on Socket: %d.", client->batch_count, client->sock);
+    }
+
+#ifdef __linux__
+    {
+        struct mmsghdr msgs[MQTT_SN_MAX_BATCH];
+        struct iovec iov[MQTT_SN_MAX_BATCH];
+        int done = 0;
+
+        memset(msgs, 0, sizeof(struct mmsghdr) * client->batch_count);
+        for (i = 0; i < client->batch_count; i++) {
+            iov[i].iov_base = client->batch[i].data;
+            iov[i].iov_len = client->batch[i].length;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        while (done < client->batch_count) {
+            int ret = sendmmsg(client->sock, &msgs[done], client->batch_count - done, 0);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                mqtt_sn_log_warn("Failed to send %d packets: %s", client->batch_count - done, strerror(errno));
+                break;
+            }
+            done += ret;
+        }
+
+        for (i = 0; i < done; i++) {
+            if (msgs[i].msg_len != client->batch[i].length) {
+                mqtt_sn_log_warn("Only sent %d of %d bytes", (int)msgs[i].msg_len, (int)client->batch[i].length);
+            }
+        }
+    }
+#else
+    for (i = 0; i < client->batch_count; i++) {
+        ssize_t sent = send(client->sock, client->batch[i].data, client->batch[i].length, 0);
+        if (sent != client->batch[i].length) {
+            mqtt_sn_log_warn("Only sent %d of %d bytes", (int)sent, (int)client->batch[i].length);
+        }
+    }
+#endif
+
+    client->batch_count = 0;
+
+    // Store the last time that we sent a packet
+    client->last_transmit = mqtt_sn_monotonic_ms();
+}
+
+static void mqtt_sn_queue_packet(mqtt_sn_client_t *client, const void* data, size_t len)
+{
+    uint64_t now = mqtt_sn_monotonic_ms();
+
+    if (debug > 1) {
+        mqtt_sn_log_debug("Queueing %2lu bytes. Type=%s on Socket: %d.", (long unsigned int)len,
+                          mqtt_sn_type_string(((uint8_t*)data)[1]), client->sock);
+    }
+
+    if (client->batch_count == 0) {
+        client->batch_started = now;
+    }
+
+    memcpy(client->batch[client->batch_count].data, data, len);
+    client->batch[client->batch_count].length = len;
+    client->batch_count++;
+
+    if (client->batch_count >= client->batch_size || (now - client->batch_started) >= client->batch_latency) {
+        mqtt_sn_flush_batch(client);
+    }
+}
+
+// Milliseconds until the queued batch has waited for the maximum latency, or -1 if nothing is queued
+int mqtt_sn_batch_timeout(mqtt_sn_client_t *client)
+{
+    uint64_t now, deadline;
+
+    if (client->batch_count == 0) {
+        return -1;
+    }
+
+    now = mqtt_sn_monotonic_ms();
+    deadline = client->batch_started + client->batch_latency;
+    return deadline > now ? deadline - now : 0;
+}
+
+// The length of a packet, whether it has a one or three byte length header
+size_t mqtt_sn_packet_length(const void *packet)
+{
+    const uint8_t *p = packet;
+
+    if (p[0] == 0x01) {
+        return (p[-2] << 8) | p[-1];
+    } else {
+        return p[0];
+    }
+}
+
+// Rotate the three byte length header of a packet read from the network into the
+// order used in memory, and return a pointer to the packet
+void* mqtt_sn_packet_from_wire(void *buffer)
+{
+    uint8_t *p = buffer;
+
+    if (p[0] == 0x01) {
+        p[0] = p[1];
+        p[1] = p[2];
+        p[2] = 0x01;
+        return p + 2;
+    }
+
+    return p;
+}
+
+// Describe a packet in the order that it is sent on the network, without copying it
+int mqtt_sn_packet_iov(const void *packet, uint8_t header[3], struct iovec *iov)
+{
+    const uint8_t *p = packet;
+    size_t len = mqtt_sn_packet_length(packet);
+
+    if (p[0] != 0x01) {
+        iov[0].iov_base = (void*)p;
+        iov[0].iov_len = len;
+        return 1;
+    }
+
+    header[0] = 0x01;
+    header[1] = p[-2];
+    header[2] = p[-1];
+    iov[0].iov_base = header;
+    iov[0].iov_len = 3;
+    iov[1].iov_base = (void*)(p + 1);
+    iov[1].iov_len = len - 3;
+    return 2;
+}
+
+void mqtt_sn_send_packet(mqtt_sn_client_t *client, const void* data)
 {
+    uint8_t header[3];
+    struct iovec iov[2];
+    struct msghdr msg;
     ssize_t sent = 0;
-    size_t len = ((uint8_t*)data)[0];
+    size_t len = mqtt_sn_packet_length(data);
 
     // If forwarder encapsulation enabled, wrap packet
-    if (forwarder_encapsulation) {
-        return mqtt_sn_send_frwdencap_packet(sock, data, wireless_node_id, wireless_node_id_len);
+    if (client->forwarder_encapsulation) {
+        return mqtt_sn_send_frwdencap_packet(client, data, client->wireless_node_id, client->wireless_node_id_len);
+    }
+
+    // Only short packets fit in the batch, so long ones are sent straight away, in order
+    if (client->batch_size > 1 && len <= MQTT_SN_MAX_PACKET_LENGTH) {
+        mqtt_sn_queue_packet(client, data, len);
+        return;
     }
+    mqtt_sn_flush_batch(client);
 
     if (debug > 1) {
         mqtt_sn_log_debug("Sending  %2lu bytes. Type=%s on Socket: %d.", (long unsigned int)len,
-                          mqtt_sn_type_string(((uint8_t*)data)[1]), sock);
+                          mqtt_sn_type_string(((uint8_t*)data)[1]), client->sock);
     }
 
-    sent = send(sock, data, len, 0);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = mqtt_sn_packet_iov(data, header, iov);
+
+    sent = sendmsg(client->sock, &msg, 0);
     if (sent != len) {
         mqtt_sn_log_warn("Only sent %d of %d bytes", (int)sent, (int)len);
     }
 
     // Store the last time that we sent a packet
-    last_transmit = time(NULL);
+    client->last_transmit = mqtt_sn_monotonic_ms();
 }
 
-void mqtt_sn_send_frwdencap_packet(int sock, const void* data, const uint8_t *wireless_node_id, uint8_t wireless_node_id_len)
+void mqtt_sn_send_frwdencap_packet(mqtt_sn_client_t *client, const void* data, const uint8_t *wireless_node_id, uint8_t wireless_node_id_len)
 {
+    frwdencap_header_t header;
+    uint8_t length_header[3];
+    struct iovec iov[3];
+    struct msghdr msg;
     ssize_t sent = 0;
-    size_t len = ((uint8_t*)data)[0];
-    uint8_t orig_packet_type = ((uint8_t*)data)[1];
-    frwdencap_packet_t *packet;
+    size_t len;
+
+    // Send the header and the original packet together, without copying
+    iov[0].iov_base = &header;
+    iov[0].iov_len = mqtt_sn_build_frwdencap_header(&header, wireless_node_id, wireless_node_id_len);
+    len = iov[0].iov_len + mqtt_sn_packet_length(data);
 
-    packet = mqtt_sn_create_frwdencap_packet(data, &len, wireless_node_id, wireless_node_id_len);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1 + mqtt_sn_packet_iov(data, length_header, &iov[1]);
 
     if (debug > 1) {
         mqtt_sn_log_debug("Sending  %2lu bytes. Type=%s with %s inside on Socket: %d.", (long unsigned int)len,
-                          mqtt_sn_type_string(packet->type), mqtt_sn_type_string(orig_packet_type), sock);
+                          mqtt_sn_type_string(header.type), mqtt_sn_type_string(((uint8_t*)data)[1]), client->sock);
     }
 
-    sent = send(sock, packet, len, 0);
+    sent = sendmsg(client->sock, &msg, 0);
     if (sent != len) {
         mqtt_sn_log_debug("Warning: only sent %d of %d bytes.", (int)sent, (int)len);
     }
 
     // Store the last time that we sent a packet
-    last_transmit = time(NULL);
-
-    free(packet);
+    client->last_transmit = mqtt_sn_monotonic_ms();
 }
 
-uint8_t mqtt_sn_validate_packet(const void *packet, size_t length)
+// Read the length and type of a packet, as it is on the network
+static uint8_t mqtt_sn_wire_header(const uint8_t *buf, size_t available, size_t *length, uint8_t *type)
 {
-    const uint8_t* buf = packet;
-
-    if (buf[0] == 0x00) {
-        mqtt_sn_log_warn("Packet length header is not valid");
+    if (available < 2 || buf[0] == 0x00) {
         return FALSE;
     }
 
     if (buf[0] == 0x01) {
-        mqtt_sn_log_warn("Packet received is longer than this tool can handle");
+        if (available < 4) {
+            return FALSE;
+        }
+        *length = (buf[1] << 8) | buf[2];
+        *type = buf[3];
+        return *length >= 4;
+    }
+
+    *length = buf[0];
+    *type = buf[1];
+    return TRUE;
+}
+
+uint8_t mqtt_sn_validate_packet(mqtt_sn_client_t *client, const void *packet, size_t length)
+{
+    const uint8_t* buf = packet;
+    size_t expected, inner_length;
+    uint8_t type, inner_type;
+
+    if (!mqtt_sn_wire_header(buf, length, &expected, &type)) {
+        mqtt_sn_log_warn("Packet length header is not valid");
         return FALSE;
     }
 
     // When forwarder encapsulation is enabled each packet must be FRWDENCAP type
-    if (forwarder_encapsulation && buf[1] != MQTT_SN_TYPE_FRWDENCAP) {
-        mqtt_sn_log_warn("Expecting FRWDENCAP packet and got Type=%s.", mqtt_sn_type_string(buf[1]));
+    if (client->forwarder_encapsulation && type != MQTT_SN_TYPE_FRWDENCAP) {
+        mqtt_sn_log_warn("Expecting FRWDENCAP packet and got Type=%s.", mqtt_sn_type_string(type));
         return FALSE;
     }
 
     // If packet is forwarder encapsulation expected packet length is sum of forwarder encapsulation
     // header and length of encapsulated packet.
-    if ((buf[1] == MQTT_SN_TYPE_FRWDENCAP && buf[0] + buf[buf[0]] != length) ||
-            (buf[1] != MQTT_SN_TYPE_FRWDENCAP && buf[0] != length)) {
-        mqtt_sn_log_warn("Read %d bytes but packet length is %d bytes.", (int)length,
-                         buf[1] != MQTT_SN_TYPE_FRWDENCAP ? (int)buf[0] : (int)(buf[0] + buf[buf[0]]));
+    if (type == MQTT_SN_TYPE_FRWDENCAP) {
+        if (buf[0] == 0x01 || !mqtt_sn_wire_header(&buf[buf[0]], length > buf[0] ? length - buf[0] : 0, &inner_length, &inner_type)) {
+            mqtt_sn_log_warn("Packet length header is not valid");
+            return FALSE;
+        }
+        expected = buf[0] + inner_length;
+    }
+
+    if (expected != length) {
+        mqtt_sn_log_warn("Read %d bytes but packet length is %d bytes.", (int)length, (int)expected);
         return FALSE;
     }
 
     return TRUE;
 }
 
-void* mqtt_sn_receive_packet(int sock)
+void* mqtt_sn_receive_packet(mqtt_sn_client_t *client)
 {
     uint8_t *wireless_node_id  = NULL;
     uint8_t wireless_node_id_len = 0;
 
-    return mqtt_sn_receive_frwdencap_packet(sock, &wireless_node_id, &wireless_node_id_len);
+    return mqtt_sn_receive_frwdencap_packet(client, &wireless_node_id, &wireless_node_id_len);
+}
+
+int mqtt_sn_pending_packets(mqtt_sn_client_t *client)
+{
+    return client->receive_count - client->receive_next;
+}
+
+// Take the kernel receive time from the control messages, if there is one
+static void mqtt_sn_receive_timestamp(received_datagram_t *datagram, struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+            memcpy(&datagram->timestamp, CMSG_DATA(cmsg), sizeof(struct timeval));
+            return;
+        }
+    }
+
+    gettimeofday(&datagram->timestamp, NULL);
+}
+
+// Read as many datagrams as are waiting, up to the size of the ring
+static int mqtt_sn_receive_batch(mqtt_sn_client_t *client)
+{
+    char control[MQTT_SN_MAX_RECEIVE_BATCH][CMSG_SPACE(sizeof(struct timeval))];
+    int count = 0;
+
+    client->receive_count = 0;
+    client->receive_next = 0;
+
+    if (client->receive_ring == NULL) {
+        // One extra byte per slot, to tell datagrams that are too long from ones that fit exactly,
+        // and to NULL-terminate the ones that fit
+        size_t slot_size = (size_t)client->receive_max_length + 1;
+        int i;
+
+        client->receive_ring = malloc(sizeof(received_datagram_t) * client->receive_depth);
+        client->receive_buffer = malloc(slot_size * client->receive_depth);
+        if (!client->receive_ring || !client->receive_buffer) {
+            mqtt_sn_log_err("Failed to allocate memory for received packets");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < client->receive_depth; i++) {
+            client->receive_ring[i].data = client->receive_buffer + slot_size * i;
+        }
+    }
+
+#ifdef __linux__
+    {
+        struct mmsghdr msgs[MQTT_SN_MAX_RECEIVE_BATCH];
+        struct iovec iov[MQTT_SN_MAX_RECEIVE_BATCH];
+        int i;
+
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < client->receive_depth; i++) {
+            iov[i].iov_base = client->receive_ring[i].data;
+            iov[i].iov_len = client->receive_max_length + 1;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &client->receive_ring[i].addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(client->receive_ring[i].addr);
+            if (client->receive_timestamps) {
+                msgs[i].msg_hdr.msg_control = control[i];
+                msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+            }
+        }
+
+        // Block for the first datagram, then take whatever else has already arrived
+        count = recvmmsg(client->sock, msgs, client->receive_depth, MSG_WAITFORONE, NULL);
+        for (i = 0; i < count; i++) {
+            client->receive_ring[i].length = msgs[i].msg_len;
+            if (client->receive_timestamps) {
+                mqtt_sn_receive_timestamp(&client->receive_ring[i], &msgs[i].msg_hdr);
+            }
+        }
+    }
+#else
+    {
+        struct iovec iov;
+        struct msghdr msg;
+
+        iov.iov_base = client->receive_ring[0].data;
+        iov.iov_len = client->receive_max_length + 1;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_name = &client->receive_ring[0].addr;
+        msg.msg_namelen = sizeof(client->receive_ring[0].addr);
+        if (client->receive_timestamps) {
+            msg.msg_control = control[0];
+            msg.msg_controllen = sizeof(control[0]);
+        }
+
+        client->receive_ring[0].length = recvmsg(client->sock, &msg, 0);
+        count = client->receive_ring[0].length < 0 ? -1 : 1;
+        if (count > 0 && client->receive_timestamps) {
+            mqtt_sn_receive_timestamp(&client->receive_ring[0], &msg);
+        }
+    }
+#endif
+
+    if (count > 0) {
+        client->receive_count = count;
+    }
+
+    return count;
+}
+
+// Returns the next datagram, as it was read from the socket
+received_datagram_t* mqtt_sn_receive_datagram(mqtt_sn_client_t *client)
+{
+    received_datagram_t *datagram;
+
+    if (mqtt_sn_pending_packets(client) == 0) {
+        // Make sure that anything we are waiting for a reply to has been sent
+        mqtt_sn_flush_batch(client);
+
+        mqtt_sn_log_debug("waiting for packet...");
+
+        // Read in the next batch of packets
+        if (mqtt_sn_receive_batch(client) < 0) {
+            if (errno == EAGAIN) {
+                mqtt_sn_log_debug("Timed out waiting for packet.");
+                return NULL;
+            } else {
+                perror("recv failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    datagram = &client->receive_ring[client->receive_next++];
+    if (datagram->length > client->receive_max_length) {
+        mqtt_sn_log_warn("Dropping datagram longer than the %d byte receive buffer", client->receive_max_length);
+        return NULL;
+    }
+
+    return datagram;
 }
 
-void* mqtt_sn_receive_frwdencap_packet(int sock, uint8_t **wireless_node_id, uint8_t *wireless_node_id_len)
+void* mqtt_sn_receive_frwdencap_packet(mqtt_sn_client_t *client, uint8_t **wireless_node_id, uint8_t *wireless_node_id_len)
 {
-    static uint8_t buffer[MQTT_SN_MAX_PACKET_LENGTH + MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH + 3  + 1];
+    received_datagram_t *datagram;
     struct sockaddr_storage addr;
-    socklen_t slen = sizeof(addr);
-    uint8_t *packet = buffer;
+    uint8_t *buffer;
+    uint8_t *packet;
     ssize_t bytes_read;
 
     *wireless_node_id = NULL;
     *wireless_node_id_len = 0;
 
-    mqtt_sn_log_debug("waiting for packet...");
-
-    // Read in the packet
-    bytes_read = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&addr, &slen);
-    if (bytes_read < 0) {
-        if (errno == EAGAIN) {
-            mqtt_sn_log_debug("Timed out waiting for packet.");
-            return NULL;
-        } else {
-            perror("recv failed");
-            exit(EXIT_FAILURE);
-        }
+    datagram = mqtt_sn_receive_datagram(client);
+    if (datagram == NULL) {
+        return NULL;
     }
 
+    buffer = packet = datagram->data;
+    bytes_read = datagram->length;
+    addr = datagram->addr;
+
     // Convert the source address into a string
     if (debug) {
         char addrstr[INET6_ADDRSTRLEN] = "unknown";
@@ -300,18 +829,19 @@ void* mqtt_sn_receive_frwdencap_packet(int sock, uint8_t **wireless_node_id, uin
             port = ntohs(in6->sin6_port);
         }
 
-        if (packet[1] == MQTT_SN_TYPE_FRWDENCAP) {
+        if (bytes_read > 1 && packet[1] == MQTT_SN_TYPE_FRWDENCAP && packet[0] < bytes_read) {
+            const uint8_t *inner = &packet[packet[0]];
             mqtt_sn_log_debug("Received %2d bytes from %s:%d. Type=%s with %s inside on Socket: %d",
                               (int)bytes_read, addrstr, port,
-                              mqtt_sn_type_string(buffer[1]), mqtt_sn_type_string(packet[packet[0] + 1]), sock);
+                              mqtt_sn_type_string(buffer[1]), mqtt_sn_type_string(inner[inner[0] == 0x01 ? 3 : 1]), client->sock);
         } else {
             mqtt_sn_log_debug("Received %2d bytes from %s:%d. Type=%s on Socket: %d",
                               (int)bytes_read, addrstr, port,
-                              mqtt_sn_type_string(buffer[1]), sock);
+                              mqtt_sn_type_string(buffer[buffer[0] == 0x01 ? 3 : 1]), client->sock);
         }
     }
 
-    if (mqtt_sn_validate_packet(buffer, bytes_read) == FALSE) {
+    if (mqtt_sn_validate_packet(client, buffer, bytes_read) == FALSE) {
         return NULL;
     }
 
@@ -324,14 +854,15 @@ void* mqtt_sn_receive_frwdencap_packet(int sock, uint8_t **wireless_node_id, uin
         // Shift packet by the actual length of FRWDENCAP header
         packet += packet[0];
     }
+    packet = mqtt_sn_packet_from_wire(packet);
 
     // Store the last time that we received a packet
-    last_receive = time(NULL);
+    client->last_receive = mqtt_sn_monotonic_ms();
 
     return packet;
 }
 
-void mqtt_sn_send_connect(int sock, const char* client_id, uint16_t keepalive, uint8_t clean_session)
+void mqtt_sn_send_connect(mqtt_sn_client_t *client, const char* client_id, uint16_t keepalive, uint8_t clean_session)
 {
     connect_packet_t packet;
     memset(&packet, 0, sizeof(packet));
@@ -357,61 +888,213 @@ void mqtt_sn_send_connect(int sock, const char* client_id, uint16_t keepalive, u
 
     packet.length = 0x06 + strlen(packet.client_id);
 
+    if (client->session_cache) {
+        mqtt_sn_load_session_cache(client, packet.client_id, clean_session);
+    }
+
     mqtt_sn_log_debug("Sending CONNECT packet...");
 
     // Store the keep alive period
     if (keepalive) {
-        keep_alive = keepalive;
+        client->keep_alive = keepalive;
     }
 
-    mqtt_sn_send_packet(sock, &packet);
+    mqtt_sn_send_packet(client, &packet);
 }
 
-void mqtt_sn_send_register(int sock, const char* topic_name)
+// Make sure that a buffer has space for at least size bytes
+static void mqtt_sn_reserve_buffer(uint8_t **buffer, size_t *buffer_size, size_t size)
 {
-    size_t topic_name_len = strlen(topic_name);
-    register_packet_t packet;
-    memset(&packet, 0, sizeof(packet));
+    uint8_t *grown;
 
-    if (topic_name_len > MQTT_SN_MAX_TOPIC_LENGTH) {
-        mqtt_sn_log_err("Topic name is too long");
-        exit(EXIT_FAILURE);
+    if (*buffer_size >= size) {
+        return;
     }
 
-    packet.type = MQTT_SN_TYPE_REGISTER;
-    packet.topic_id = 0;
-    packet.message_id = htons(next_message_id++);
-    strncpy(packet.topic_name, topic_name, sizeof(packet.topic_name));
-    packet.length = 0x06 + topic_name_len;
-
-    mqtt_sn_log_debug("Sending REGISTER packet...");
-
-    mqtt_sn_send_packet(sock, &packet);
+    grown = realloc(*buffer, size);
+    if (grown == NULL) {
+        mqtt_sn_log_err("Failed to allocate memory for packet");
+        exit(EXIT_FAILURE);
+    }
+    *buffer = grown;
+    *buffer_size = size;
 }
 
-void mqtt_sn_send_regack(int sock, int topic_id, int mesage_id)
+// Copy a packet into a buffer, growing it if needed, and return a pointer to the copy
+static uint8_t* mqtt_sn_copy_packet(uint8_t **buffer, size_t *buffer_size, const void* data)
 {
-    regack_packet_t packet;
-    memset(&packet, 0, sizeof(packet));
+    const uint8_t *packet = data;
+    size_t len = mqtt_sn_packet_length(packet);
 
-    packet.type = MQTT_SN_TYPE_REGACK;
-    packet.topic_id = htons(topic_id);
-    packet.message_id = htons(mesage_id);
-    packet.return_code = 0x00;
-    packet.length = 0x07;
+    mqtt_sn_reserve_buffer(buffer, buffer_size, len + MQTT_SN_PACKET_HEADROOM);
+    if (packet[0] == 0x01) {
+        memcpy(*buffer, packet - MQTT_SN_PACKET_HEADROOM, len);
+    } else {
+        memcpy(*buffer + MQTT_SN_PACKET_HEADROOM, packet, len);
+    }
 
-    mqtt_sn_log_debug("Sending REGACK packet...");
+    return *buffer + MQTT_SN_PACKET_HEADROOM;
+}
 
-    mqtt_sn_send_packet(sock, &packet);
+// Keep a copy of a packet that expects a reply, so that it can be resent
+static void mqtt_sn_send_request(mqtt_sn_client_t *client, const void* data)
+{
+    client->request = mqtt_sn_copy_packet(&client->request_buffer, &client->request_buffer_size, data);
+    client->request_sent = mqtt_sn_monotonic_ms();
+    mqtt_sn_send_packet(client, data);
 }
 
-static uint8_t mqtt_sn_get_qos_flag(int8_t qos)
+// The message id of a request or reply, or -1 if the packet does not have one
+static int mqtt_sn_packet_message_id(const uint8_t *packet)
 {
-    switch (qos) {
-        case -1:
-            return MQTT_SN_FLAG_QOS_N1;
-        case 0:
-            return MQTT_SN_FLAG_QOS_0;
+    switch (packet[1]) {
+        case MQTT_SN_TYPE_SUBSCRIBE:
+            return (packet[3] << 8) | packet[4];
+        case MQTT_SN_TYPE_REGISTER:
+        case MQTT_SN_TYPE_REGACK:
+        case MQTT_SN_TYPE_PUBACK:
+            return (packet[4] << 8) | packet[5];
+        case MQTT_SN_TYPE_PUBLISH:
+        case MQTT_SN_TYPE_SUBACK:
+            return (packet[5] << 8) | packet[6];
+        default:
+            return -1;
+    }
+}
+
+static void mqtt_sn_resend(mqtt_sn_client_t *client, uint8_t *packet, uint8_t attempt)
+{
+    if (packet[1] == MQTT_SN_TYPE_PUBLISH || packet[1] == MQTT_SN_TYPE_SUBSCRIBE) {
+        packet[2] |= MQTT_SN_FLAG_DUP;
+    }
+
+    mqtt_sn_log_debug("Resending %s packet (message id 0x%4.4x, attempt %d)...",
+                      mqtt_sn_type_string(packet[1]), mqtt_sn_packet_message_id(packet), attempt + 1);
+    mqtt_sn_send_packet(client, packet);
+}
+
+// Update the smoothed round trip time and retransmission timeout,
+// using only replies to packets that were not resent (Karn's algorithm)
+static void mqtt_sn_update_rtt(mqtt_sn_client_t *client, uint32_t rtt)
+{
+    uint32_t rto;
+
+    if (client->srtt == 0 && client->rttvar == 0) {
+        client->srtt = rtt;
+        client->rttvar = rtt / 2;
+    } else {
+        uint32_t delta = client->srtt > rtt ? client->srtt - rtt : rtt - client->srtt;
+        client->rttvar = ((3 * client->rttvar) + delta) / 4;
+        client->srtt = ((7 * client->srtt) + rtt) / 8;
+    }
+
+    rto = client->srtt + (client->rttvar > 0 ? 4 * client->rttvar : 1);
+    if (rto < MQTT_SN_MIN_RTO) {
+        rto = MQTT_SN_MIN_RTO;
+    } else if (rto > MQTT_SN_MAX_RTO) {
+        rto = MQTT_SN_MAX_RTO;
+    }
+    client->rto = rto;
+}
+
+static uint32_t mqtt_sn_backoff(uint32_t rto)
+{
+    return rto < MQTT_SN_MAX_RTO / 2 ? rto * 2 : MQTT_SN_MAX_RTO;
+}
+
+// Wait for the reply to the last request, resending it each time the
+// retransmission timeout expires, until the network timeout is reached
+static void* mqtt_sn_wait_for_reply(mqtt_sn_client_t *client, uint8_t type)
+{
+    uint64_t deadline = client->request_sent + client->timeout;
+    uint64_t resend_at = client->request_sent + client->rto;
+    int message_id = mqtt_sn_packet_message_id(client->request);
+    uint8_t attempts = 0;
+
+    while (TRUE) {
+        uint64_t now = mqtt_sn_monotonic_ms();
+        uint64_t until = (attempts < client->max_retries && resend_at < deadline) ? resend_at : deadline;
+        uint8_t *packet;
+
+        if (now >= until) {
+            if (until == deadline) {
+                return NULL;
+            }
+
+            mqtt_sn_resend(client, client->request, attempts++);
+            client->rto = mqtt_sn_backoff(client->rto);
+            resend_at = now + client->rto;
+            continue;
+        }
+
+        packet = mqtt_sn_wait_for_timeout(client, type, until - now);
+        if (packet == NULL) {
+            continue;
+        }
+
+        // The gateway may reply to both copies of a request that was resent
+        if (client->resent_message_id && mqtt_sn_packet_message_id(packet) == client->resent_message_id) {
+            mqtt_sn_log_debug("Ignoring duplicate %s for message id 0x%4.4x", mqtt_sn_type_string(type), client->resent_message_id);
+            continue;
+        }
+
+        if (attempts == 0) {
+            mqtt_sn_update_rtt(client, mqtt_sn_monotonic_ms() - client->request_sent);
+            mqtt_sn_log_debug("Round trip time is %u ms, retransmission timeout is %u ms.", client->srtt, client->rto);
+            client->resent_message_id = 0;
+        } else {
+            client->resent_message_id = message_id;
+        }
+
+        return packet;
+    }
+}
+
+void mqtt_sn_send_register(mqtt_sn_client_t *client, const char* topic_name)
+{
+    size_t topic_name_len = strlen(topic_name);
+    register_packet_t packet;
+    memset(&packet, 0, sizeof(packet));
+
+    if (topic_name_len > MQTT_SN_MAX_TOPIC_LENGTH) {
+        mqtt_sn_log_err("Topic name is too long");
+        exit(EXIT_FAILURE);
+    }
+
+    packet.type = MQTT_SN_TYPE_REGISTER;
+    packet.topic_id = 0;
+    packet.message_id = htons(client->next_message_id++);
+    strncpy(packet.topic_name, topic_name, sizeof(packet.topic_name));
+    packet.length = 0x06 + topic_name_len;
+
+    mqtt_sn_log_debug("Sending REGISTER packet...");
+
+    mqtt_sn_send_request(client, &packet);
+}
+
+void mqtt_sn_send_regack(mqtt_sn_client_t *client, int topic_id, int mesage_id)
+{
+    regack_packet_t packet;
+    memset(&packet, 0, sizeof(packet));
+
+    packet.type = MQTT_SN_TYPE_REGACK;
+    packet.topic_id = htons(topic_id);
+    packet.message_id = htons(mesage_id);
+    packet.return_code = 0x00;
+    packet.length = 0x07;
+
+    mqtt_sn_log_debug("Sending REGACK packet...");
+
+    mqtt_sn_send_packet(client, &packet);
+}
+
+static uint8_t mqtt_sn_get_qos_flag(int8_t qos)
+{
+    switch (qos) {
+        case -1:
+            return MQTT_SN_FLAG_QOS_N1;
+        case 0:
+            return MQTT_SN_FLAG_QOS_0;
         case 1:
             return MQTT_SN_FLAG_QOS_1;
         case 2:
@@ -421,38 +1104,294 @@ static uint8_t mqtt_sn_get_qos_flag(int8_t qos)
     }
 }
 
-void mqtt_sn_send_publish(int sock, uint16_t topic_id, uint8_t topic_type, const void* data, uint16_t data_len, int8_t qos, uint8_t retain)
+// Additive increase, multiplicative decrease of the rate, like TCP congestion control
+static void mqtt_sn_rate_feedback(mqtt_sn_client_t *client, uint8_t congested)
 {
-    publish_packet_t packet;
-    memset(&packet, 0, sizeof(packet));
+    if (!client->adaptive_rate || client->rate <= 0) {
+        return;
+    }
+
+    if (congested) {
+        client->rate /= 2;
+        if (client->rate < MQTT_SN_MIN_RATE) {
+            client->rate = MQTT_SN_MIN_RATE;
+        }
+        mqtt_sn_log_debug("Gateway is congested, reducing rate to %.1f messages per second.", client->rate);
+    } else if (client->rate < client->max_rate) {
+        // One step per acknowledgement adds up to the increase per second
+        client->rate += (client->max_rate / MQTT_SN_RATE_INCREASE) / client->rate;
+        if (client->rate > client->max_rate) {
+            client->rate = client->max_rate;
+        }
+    }
+}
+
+// Wait for a token from the bucket before sending the next PUBLISH
+static void mqtt_sn_pace(mqtt_sn_client_t *client)
+{
+    uint64_t now;
+
+    if (client->rate <= 0) {
+        return;
+    }
+
+    now = mqtt_sn_monotonic_us();
+    client->tokens += (now - client->tokens_updated) * client->rate / 1000000.0;
+    if (client->tokens > client->burst) {
+        client->tokens = client->burst;
+    }
+    client->tokens_updated = now;
+
+    if (client->tokens < 1.0) {
+        uint64_t deadline = now + (uint64_t)((1.0 - client->tokens) * 1000000.0 / client->rate);
+
+        mqtt_sn_wait_until(client, deadline);
+        client->tokens = 1.0;
+        client->tokens_updated = deadline;
+    }
+
+    client->tokens -= 1.0;
+}
+
+static inflight_publish_t* mqtt_sn_inflight_slot(mqtt_sn_client_t *client, uint16_t message_id)
+{
+    return &client->inflight[message_id % MQTT_SN_MAX_INFLIGHT];
+}
+
+// Resend the in-flight messages whose retransmission timeout has expired,
+// and give up on those that have not been acknowledged within the network timeout.
+// Returns the time that this next needs to be called.
+static uint64_t mqtt_sn_service_inflight(mqtt_sn_client_t *client)
+{
+    uint64_t now = mqtt_sn_monotonic_ms();
+    uint64_t next = now + client->timeout;
+    int i;
+
+    for (i = 0; i < MQTT_SN_MAX_INFLIGHT; i++) {
+        inflight_publish_t *entry = &client->inflight[i];
+        uint64_t resend_at, deadline;
+
+        if (!entry->in_use) {
+            continue;
+        }
+
+        deadline = entry->first_sent + client->timeout;
+        if (now >= deadline) {
+            mqtt_sn_log_warn("Failed to receive PUBACK after PUBLISH (message id 0x%4.4x)", entry->message_id);
+            entry->in_use = FALSE;
+            client->inflight_count--;
+            continue;
+        }
+
+        resend_at = entry->last_sent + entry->rto;
+        if (entry->attempts < client->max_retries && now >= resend_at) {
+            mqtt_sn_resend(client, entry->buffer + MQTT_SN_PACKET_HEADROOM, entry->attempts++);
+            entry->rto = mqtt_sn_backoff(entry->rto);
+            entry->last_sent = now;
+            resend_at = now + entry->rto;
+        }
+
+        if (entry->attempts < client->max_retries && resend_at < deadline) {
+            deadline = resend_at;
+        }
+        if (deadline < next) {
+            next = deadline;
+        }
+    }
+
+    return next;
+}
+
+// Returns TRUE if the PUBACK acknowledged a message in the in-flight window
+static uint8_t mqtt_sn_process_puback(mqtt_sn_client_t *client, const puback_packet_t *packet)
+{
+    uint16_t message_id = ntohs(packet->message_id);
+    inflight_publish_t *entry = mqtt_sn_inflight_slot(client, message_id);
+
+    if (!entry->in_use || entry->message_id != message_id) {
+        return FALSE;
+    }
+
+    if (entry->topic_id != ntohs(packet->topic_id)) {
+        mqtt_sn_log_warn("Topic id in PUBACK does not equal topic id sent");
+    }
+
+    // Leave the message in the window, to be resent when its retransmission timeout expires
+    mqtt_sn_rate_feedback(client, packet->return_code == MQTT_SN_REJECTED_CONGESTION);
+    if (packet->return_code == MQTT_SN_REJECTED_CONGESTION && entry->attempts < client->max_retries) {
+        mqtt_sn_log_debug("Gateway is congested, will resend message id 0x%4.4x", message_id);
+        entry->rto = mqtt_sn_backoff(entry->rto);
+        entry->last_sent = mqtt_sn_monotonic_ms();
+        return TRUE;
+    }
+
+    if (packet->return_code) {
+        mqtt_sn_log_warn("PUBLISH failed: %s", mqtt_sn_return_code_string(packet->return_code));
+        if (packet->return_code == MQTT_SN_REJECTED_INVALID) {
+            mqtt_sn_clear_session_cache(client);
+        }
+    } else {
+        mqtt_sn_log_debug("Received PUBACK for message id 0x%4.4x", message_id);
+    }
+
+    if (entry->attempts == 0) {
+        mqtt_sn_update_rtt(client, mqtt_sn_monotonic_ms() - entry->first_sent);
+    }
+
+    entry->in_use = FALSE;
+    client->inflight_count--;
+
+    return TRUE;
+}
 
-    if (data_len > sizeof(packet.data)) {
+static void mqtt_sn_wait_for_inflight_puback(mqtt_sn_client_t *client)
+{
+    uint64_t next = mqtt_sn_service_inflight(client);
+    uint64_t now = mqtt_sn_monotonic_ms();
+
+    if (client->inflight_count > 0) {
+        mqtt_sn_wait_for_timeout(client, MQTT_SN_TYPE_PUBACK, next > now ? next - now : 0);
+    }
+}
+
+static void mqtt_sn_wait_for_inflight_slot(mqtt_sn_client_t *client, uint16_t message_id)
+{
+    while (client->inflight_count >= client->max_inflight || mqtt_sn_inflight_slot(client, message_id)->in_use) {
+        mqtt_sn_wait_for_inflight_puback(client);
+    }
+}
+
+void mqtt_sn_wait_for_pubacks(mqtt_sn_client_t *client)
+{
+    while (client->inflight_count > 0) {
+        mqtt_sn_wait_for_inflight_puback(client);
+    }
+}
+
+// Build a PUBLISH packet in the space given, or in the client's packet buffer
+// if the payload is too big for it, and return a pointer to the packet
+static publish_packet_t* mqtt_sn_build_publish(mqtt_sn_client_t *client, publish_packet_t *space, uint16_t topic_id, uint8_t topic_type, const void* data, uint16_t data_len, int8_t qos, uint8_t retain)
+{
+    publish_packet_t *packet = space;
+
+    if (data_len > MQTT_SN_MAX_LONG_PAYLOAD_LENGTH) {
         mqtt_sn_log_err("Payload is too big");
         exit(EXIT_FAILURE);
     }
 
-    packet.type = MQTT_SN_TYPE_PUBLISH;
-    packet.flags = 0x00;
+    if (data_len > sizeof(packet->data)) {
+        size_t length = 0x09 + data_len;
+        uint8_t *p;
+
+        mqtt_sn_reserve_buffer(&client->packet_buffer, &client->packet_buffer_size, length);
+        p = client->packet_buffer + MQTT_SN_PACKET_HEADROOM;
+        p[-2] = (length >> 8) & 0xFF;
+        p[-1] = length & 0xFF;
+        packet = (publish_packet_t*)p;
+        memset(packet, 0, 0x07);
+        packet->length = 0x01;
+    } else {
+        memset(packet, 0, sizeof(*packet));
+        packet->length = 0x07 + data_len;
+    }
+
+    packet->type = MQTT_SN_TYPE_PUBLISH;
+    packet->flags = 0x00;
     if (retain)
-        packet.flags += MQTT_SN_FLAG_RETAIN;
-    packet.flags += mqtt_sn_get_qos_flag(qos);
-    packet.flags += (topic_type & 0x3);
-    packet.topic_id = htons(topic_id);
+        packet->flags += MQTT_SN_FLAG_RETAIN;
+    packet->flags += mqtt_sn_get_qos_flag(qos);
+    packet->flags += (topic_type & 0x3);
+    packet->topic_id = htons(topic_id);
     if (qos > 0) {
-        packet.message_id = htons(next_message_id++);
+        packet->message_id = htons(client->next_message_id++);
     } else {
-        packet.message_id = 0x0000;
+        packet->message_id = 0x0000;
     }
-    memcpy(packet.data, data, sizeof(packet.data));
-    packet.length = 0x07 + data_len;
+    memcpy(packet->data, data, data_len);
+
+    return packet;
+}
+
+uint16_t mqtt_sn_send_publish_nowait(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t topic_type, const void* data, uint16_t data_len, int8_t qos, uint8_t retain)
+{
+    publish_packet_t space;
+    publish_packet_t *packet;
+
+    mqtt_sn_pace(client);
+    packet = mqtt_sn_build_publish(client, &space, topic_id, topic_type, data, data_len, qos, retain);
 
     mqtt_sn_log_debug("Sending PUBLISH packet...");
-    mqtt_sn_send_packet(sock, &packet);
+    mqtt_sn_send_packet(client, packet);
+
+    return ntohs(packet->message_id);
+}
+
+void mqtt_sn_send_publish(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t topic_type, const void* data, uint16_t data_len, int8_t qos, uint8_t retain)
+{
+    publish_packet_t space;
+    publish_packet_t *packet;
+    uint16_t message_id;
+
+    if (qos != 1) {
+        mqtt_sn_send_publish_nowait(client, topic_id, topic_type, data, data_len, qos, retain);
+        return;
+    }
+
+    mqtt_sn_pace(client);
+
+    if (client->max_inflight > 1) {
+        inflight_publish_t *entry;
+
+        // Make room in the window, before adding the next message to it
+        mqtt_sn_wait_for_inflight_slot(client, client->next_message_id);
+
+        packet = mqtt_sn_build_publish(client, &space, topic_id, topic_type, data, data_len, qos, retain);
+        message_id = ntohs(packet->message_id);
+
+        // Keep a copy of the message, in case it needs to be resent
+        entry = mqtt_sn_inflight_slot(client, message_id);
+        mqtt_sn_copy_packet(&entry->buffer, &entry->buffer_size, packet);
+        entry->message_id = message_id;
+        entry->topic_id = topic_id;
+        entry->in_use = TRUE;
+        entry->attempts = 0;
+        entry->rto = client->rto;
+        entry->first_sent = entry->last_sent = mqtt_sn_monotonic_ms();
+        client->inflight_count++;
+
+        mqtt_sn_log_debug("Sending PUBLISH packet...");
+        mqtt_sn_send_packet(client, packet);
+    } else {
+        puback_packet_t *reply;
+        uint8_t attempts = 0;
+
+        packet = mqtt_sn_build_publish(client, &space, topic_id, topic_type, data, data_len, qos, retain);
+
+        mqtt_sn_log_debug("Sending PUBLISH packet...");
+        mqtt_sn_send_request(client, packet);
+
+        // Now wait for a PUBACK, sending the message again later if the gateway is congested
+        reply = mqtt_sn_wait_for_reply(client, MQTT_SN_TYPE_PUBACK);
+        while (reply && reply->return_code == MQTT_SN_REJECTED_CONGESTION && attempts < client->max_retries) {
+            mqtt_sn_rate_feedback(client, TRUE);
+            if (client->adaptive_rate) {
+                mqtt_sn_pace(client);
+            } else {
+                mqtt_sn_wait_until(client, mqtt_sn_monotonic_us() + (uint64_t)client->rto * 1000);
+                client->rto = mqtt_sn_backoff(client->rto);
+            }
+            mqtt_sn_resend(client, client->request, attempts++);
+            client->request_sent = mqtt_sn_monotonic_ms();
+            reply = mqtt_sn_wait_for_reply(client, MQTT_SN_TYPE_PUBACK);
+        }
 
-    if (qos == 1) {
-        // Now wait for a PUBACK
-        puback_packet_t *packet = mqtt_sn_wait_for(MQTT_SN_TYPE_PUBACK, sock);
-        if (packet) {
+        mqtt_sn_rate_feedback(client, reply && reply->return_code == MQTT_SN_REJECTED_CONGESTION);
+        if (reply && reply->return_code) {
+            mqtt_sn_log_warn("PUBLISH failed: %s", mqtt_sn_return_code_string(reply->return_code));
+            if (reply->return_code == MQTT_SN_REJECTED_INVALID) {
+                mqtt_sn_clear_session_cache(client);
+            }
+        } else if (reply) {
             mqtt_sn_log_debug("Received PUBACK");
         } else {
             mqtt_sn_log_warn("Failed to receive PUBACK after PUBLISH");
@@ -460,7 +1399,52 @@ void mqtt_sn_send_publish(int sock, uint16_t topic_id, uint8_t topic_type, const
     }
 }
 
-void mqtt_sn_send_puback(int sock, publish_packet_t* publish, uint8_t return_code)
+// Split a message into chunks of up to chunk_size bytes and publish them one after another.
+// With QoS 1, up to the in-flight window of chunks are waiting for a PUBACK at a time.
+void mqtt_sn_send_publish_chunks(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t topic_type, const void* data, size_t data_len, uint16_t chunk_size, int8_t qos)
+{
+    uint16_t transfer_id = (uint16_t)(mqtt_sn_monotonic_ms() ^ getpid());
+    chunk_header_t *header;
+    uint8_t *buffer;
+    size_t offset = 0;
+
+    if (chunk_size == 0 || chunk_size > MQTT_SN_MAX_LONG_PAYLOAD_LENGTH - sizeof(chunk_header_t)) {
+        mqtt_sn_log_err("Chunk size must be between 1 and %d bytes.", (int)(MQTT_SN_MAX_LONG_PAYLOAD_LENGTH - sizeof(chunk_header_t)));
+        exit(EXIT_FAILURE);
+    }
+
+    if (data_len > UINT32_MAX) {
+        mqtt_sn_log_err("Message is too big to split into chunks");
+        exit(EXIT_FAILURE);
+    }
+
+    buffer = malloc(sizeof(chunk_header_t) + chunk_size);
+    if (buffer == NULL) {
+        mqtt_sn_log_err("Failed to allocate memory for chunk");
+        exit(EXIT_FAILURE);
+    }
+
+    header = (chunk_header_t*)buffer;
+    memcpy(header->magic, MQTT_SN_CHUNK_MAGIC, sizeof(header->magic));
+    header->transfer_id = htons(transfer_id);
+    header->total_length = htonl(data_len);
+
+    mqtt_sn_log_debug("Sending %lu bytes in chunks of up to %d bytes (transfer id 0x%4.4x)...",
+                      (long unsigned int)data_len, chunk_size, transfer_id);
+
+    do {
+        size_t len = (data_len - offset) < chunk_size ? (data_len - offset) : chunk_size;
+
+        header->offset = htonl(offset);
+        memcpy(buffer + sizeof(chunk_header_t), (const uint8_t*)data + offset, len);
+        mqtt_sn_send_publish(client, topic_id, topic_type, buffer, sizeof(chunk_header_t) + len, qos, FALSE);
+        offset += len;
+    } while (offset < data_len);
+
+    free(buffer);
+}
+
+void mqtt_sn_send_puback(mqtt_sn_client_t *client, publish_packet_t* publish, uint8_t return_code)
 {
     puback_packet_t puback;
     memset(&puback, 0, sizeof(puback));
@@ -473,10 +1457,10 @@ void mqtt_sn_send_puback(int sock, publish_packet_t* publish, uint8_t return_cod
 
     mqtt_sn_log_debug("Sending PUBACK packet...");
 
-    mqtt_sn_send_packet(sock, &puback);
+    mqtt_sn_send_packet(client, &puback);
 }
 
-void mqtt_sn_send_subscribe_topic_name(int sock, const char* topic_name, uint8_t qos)
+void mqtt_sn_send_subscribe_topic_name(mqtt_sn_client_t *client, const char* topic_name, uint8_t qos)
 {
     size_t topic_name_len = strlen(topic_name);
     subscribe_packet_t packet;
@@ -490,17 +1474,17 @@ void mqtt_sn_send_subscribe_topic_name(int sock, const char* topic_name, uint8_t
     } else {
         packet.flags += MQTT_SN_TOPIC_TYPE_NORMAL;
     }
-    packet.message_id = htons(next_message_id++);
+    packet.message_id = htons(client->next_message_id++);
     strncpy(packet.topic_name, topic_name, sizeof(packet.topic_name));
     packet.topic_name[sizeof(packet.topic_name)-1] = '\0';
     packet.length = 0x05 + topic_name_len;
 
     mqtt_sn_log_debug("Sending SUBSCRIBE packet...");
 
-    mqtt_sn_send_packet(sock, &packet);
+    mqtt_sn_send_request(client, &packet);
 }
 
-void mqtt_sn_send_subscribe_topic_id(int sock, uint16_t topic_id, uint8_t qos)
+void mqtt_sn_send_subscribe_topic_id(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t qos)
 {
     subscribe_packet_t packet;
     memset(&packet, 0, sizeof(packet));
@@ -509,16 +1493,16 @@ void mqtt_sn_send_subscribe_topic_id(int sock, uint16_t topic_id, uint8_t qos)
     packet.flags = 0x00;
     packet.flags += mqtt_sn_get_qos_flag(qos);
     packet.flags += MQTT_SN_TOPIC_TYPE_PREDEFINED;
-    packet.message_id = htons(next_message_id++);
+    packet.message_id = htons(client->next_message_id++);
     packet.topic_id = htons(topic_id);
     packet.length = 0x05 + 2;
 
     mqtt_sn_log_debug("Sending SUBSCRIBE packet...");
 
-    mqtt_sn_send_packet(sock, &packet);
+    mqtt_sn_send_request(client, &packet);
 }
 
-void mqtt_sn_send_pingreq(int sock)
+void mqtt_sn_send_pingreq(mqtt_sn_client_t *client)
 {
     char packet[2];
 
@@ -527,10 +1511,10 @@ void mqtt_sn_send_pingreq(int sock)
 
     mqtt_sn_log_debug("Sending PINGREQ packet...");
 
-    mqtt_sn_send_packet(sock, &packet);
+    mqtt_sn_send_packet(client, &packet);
 }
 
-void mqtt_sn_send_disconnect(int sock, uint16_t duration)
+void mqtt_sn_send_disconnect(mqtt_sn_client_t *client, uint16_t duration)
 {
     disconnect_packet_t packet;
     memset(&packet, 0, sizeof(packet));
@@ -545,12 +1529,12 @@ void mqtt_sn_send_disconnect(int sock, uint16_t duration)
         mqtt_sn_log_debug("Sending DISCONNECT packet with Duration %d...", duration);
     }
 
-    mqtt_sn_send_packet(sock, &packet);
+    mqtt_sn_send_packet(client, &packet);
 }
 
-void mqtt_sn_receive_disconnect(int sock)
+void mqtt_sn_receive_disconnect(mqtt_sn_client_t *client)
 {
-    disconnect_packet_t *packet = mqtt_sn_wait_for(MQTT_SN_TYPE_DISCONNECT, sock);
+    disconnect_packet_t *packet = mqtt_sn_wait_for(client, MQTT_SN_TYPE_DISCONNECT);
 
     if (packet == NULL) {
         mqtt_sn_log_err("Failed to disconnect from MQTT-SN gateway.");
@@ -564,11 +1548,12 @@ void mqtt_sn_receive_disconnect(int sock)
 }
 
 
-void mqtt_sn_receive_connack(int sock)
+void mqtt_sn_receive_connack(mqtt_sn_client_t *client)
 {
-    connack_packet_t *packet = mqtt_sn_receive_packet(sock);
+    connack_packet_t *packet = mqtt_sn_receive_packet(client);
 
     if (packet == NULL) {
+        mqtt_sn_forget_gateway(client);
         mqtt_sn_log_err("Failed to connect to MQTT-SN gateway.");
         exit(EXIT_FAILURE);
     }
@@ -582,517 +1567,2358 @@ void mqtt_sn_receive_connack(int sock)
     mqtt_sn_log_debug("CONNACK return code: 0x%2.2x", packet->return_code);
 
     if (packet->return_code) {
+        mqtt_sn_forget_gateway(client);
         mqtt_sn_log_err("CONNECT error: %s", mqtt_sn_return_code_string(packet->return_code));
         exit(packet->return_code);
     }
 }
 
-static int mqtt_sn_process_register(int sock, const register_packet_t *packet)
+static int mqtt_sn_process_register(mqtt_sn_client_t *client, const register_packet_t *packet)
 {
     int message_id = ntohs(packet->message_id);
     int topic_id = ntohs(packet->topic_id);
     const char* topic_name = packet->topic_name;
 
     // Add it to the topic map
-    mqtt_sn_register_topic(topic_id, topic_name);
+    mqtt_sn_register_topic(client, topic_id, topic_name);
 
     // Respond to gateway with REGACK
-    mqtt_sn_send_regack(sock, topic_id, message_id);
+    mqtt_sn_send_regack(client, topic_id, message_id);
 
     return 0;
 }
 
-void mqtt_sn_register_topic(int topic_id, const char* topic_name)
+static uint32_t mqtt_sn_hash_topic_id(uint16_t topic_id)
 {
-    topic_map_t **ptr = &topic_map;
+    uint32_t hash = topic_id * 0x9E3779B1;
+    return hash ^ (hash >> 16);
+}
 
-    // Check topic ID is valid
-    if (topic_id == 0x0000 || topic_id == 0xFFFF) {
-        mqtt_sn_log_err("Attempted to register invalid topic id: 0x%4.4x", topic_id);
-        return;
-    }
+// FNV-1a hash of a topic name
+static uint32_t mqtt_sn_hash_topic_name(const char* topic_name)
+{
+    uint32_t hash = 0x811C9DC5;
 
-    // Check topic name is valid
-    if (topic_name == NULL || strlen(topic_name) <= 0) {
-        mqtt_sn_log_err("Attempted to register invalid topic name.");
-        return;
+    while (*topic_name) {
+        hash ^= (uint8_t)*topic_name++;
+        hash *= 0x01000193;
     }
 
-    mqtt_sn_log_debug("Registering topic 0x%4.4x: %s", topic_id, topic_name);
-
-    // Look for the topic id
-    while (*ptr) {
-        if ((*ptr)->topic_id == topic_id) {
-            break;
-        } else {
-            ptr = &((*ptr)->next);
-        }
-    }
+    return hash;
+}
 
-    // Allocate memory for a new entry, if we reached the end of the list
-    if (*ptr == NULL) {
-        *ptr = (topic_map_t *)malloc(sizeof(topic_map_t));
-        if (!*ptr) {
-            mqtt_sn_log_err("Failed to allocate memory for new topic map entry.");
+static const char* mqtt_sn_arena_strdup(topic_registry_t *registry, const char* str)
+{
+    size_t len = strlen(str) + 1;
+    topic_arena_block_t *block = registry->arena;
+    char *copy;
+
+    // Start a new block, if there isn't enough space left in the current one
+    if (block == NULL || block->size - block->used < len) {
+        size_t size = len > MQTT_SN_TOPIC_ARENA_BLOCK_SIZE ? len : MQTT_SN_TOPIC_ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(topic_arena_block_t) + size);
+        if (!block) {
+            mqtt_sn_log_err("Failed to allocate memory for topic names.");
             exit(EXIT_FAILURE);
         }
-        (*ptr)->next = NULL;
+        block->next = registry->arena;
+        block->used = 0;
+        block->size = size;
+        registry->arena = block;
     }
 
-    // Copy in the name to the entry
-    strncpy((*ptr)->topic_name, topic_name, MQTT_SN_MAX_TOPIC_LENGTH);
-    (*ptr)->topic_id = topic_id;
+    copy = &block->data[block->used];
+    memcpy(copy, str, len);
+    block->used += len;
+
+    return copy;
 }
 
-const char* mqtt_sn_lookup_topic(int topic_id)
+static topic_entry_t* mqtt_sn_find_topic_slot(topic_registry_t *registry, uint16_t topic_id)
 {
-    topic_map_t **ptr = &topic_map;
+    uint32_t mask = registry->capacity - 1;
+    uint32_t i = mqtt_sn_hash_topic_id(topic_id) & mask;
 
-    while (*ptr) {
-        if ((*ptr)->topic_id == topic_id) {
-            return (*ptr)->topic_name;
-        }
-        ptr = &((*ptr)->next);
+    // Linear probing until the topic or an empty slot is found
+    while (registry->entries[i].topic_id != 0 && registry->entries[i].topic_id != topic_id) {
+        i = (i + 1) & mask;
     }
 
-    mqtt_sn_log_warn("Failed to lookup topic id: 0x%4.4x", topic_id);
-    return NULL;
+    return &registry->entries[i];
 }
 
-uint16_t mqtt_sn_receive_regack(int sock)
+static void mqtt_sn_index_topic_name(topic_registry_t *registry, const topic_entry_t *entry)
 {
-    regack_packet_t *packet = mqtt_sn_wait_for(MQTT_SN_TYPE_REGACK, sock);
-    uint16_t received_message_id, received_topic_id;
+    uint32_t mask = registry->capacity - 1;
+    uint32_t i = entry->name_hash & mask;
 
-    if (packet == NULL) {
-        mqtt_sn_log_err("Failed to connect to register topic.");
-        exit(EXIT_FAILURE);
+    while (registry->name_index[i] != 0) {
+        i = (i + 1) & mask;
     }
 
-    // Check Regack return code
-    mqtt_sn_log_debug("REGACK return code: 0x%2.2x", packet->return_code);
+    registry->name_index[i] = (entry - registry->entries) + 1;
+    registry->name_slots_used++;
+}
 
-    if (packet->return_code) {
-        mqtt_sn_log_err("REGISTER failed: %s", mqtt_sn_return_code_string(packet->return_code));
-        exit(packet->return_code);
+// Re-hash every topic into tables of a new size, dropping stale name index slots
+static void mqtt_sn_resize_topic_registry(topic_registry_t *registry, uint32_t capacity)
+{
+    topic_entry_t *old_entries = registry->entries;
+    uint32_t old_capacity = registry->capacity;
+    uint32_t i;
+
+    registry->entries = calloc(capacity, sizeof(topic_entry_t));
+    free(registry->name_index);
+    registry->name_index = calloc(capacity, sizeof(uint32_t));
+    if (!registry->entries || !registry->name_index) {
+        mqtt_sn_log_err("Failed to allocate memory for topic registry.");
+        exit(EXIT_FAILURE);
     }
-
-    // Check that the Message ID matches
-    received_message_id = ntohs(packet->message_id);
-    if (received_message_id != next_message_id-1) {
-        mqtt_sn_log_warn("Message id in Regack does not equal message id sent");
+    registry->capacity = capacity;
+    registry->name_slots_used = 0;
+
+    for (i = 0; i < old_capacity; i++) {
+        if (old_entries[i].topic_id != 0) {
+            topic_entry_t *entry = mqtt_sn_find_topic_slot(registry, old_entries[i].topic_id);
+            *entry = old_entries[i];
+            mqtt_sn_index_topic_name(registry, entry);
+        }
     }
 
-    // Return the topic ID returned by the gateway
-    received_topic_id = ntohs(packet->topic_id);
-    mqtt_sn_log_debug("REGACK topic id: 0x%4.4x", received_topic_id);
-
-    return received_topic_id;
+    free(old_entries);
 }
 
-void mqtt_sn_dump_packet(char* packet)
+static void mqtt_sn_cache_topic(session_cache_t *cache, uint16_t topic_id, const char* topic_name)
 {
-    printf("%s: len=%d", mqtt_sn_type_string(packet[1]), packet[0]);
+    session_cache_topic_t *topic = NULL;
+    int i;
 
-    switch(packet[1]) {
-        case MQTT_SN_TYPE_CONNECT: {
-            connect_packet_t* cpkt = (connect_packet_t*)packet;
-            printf(" protocol_id=%d", cpkt->protocol_id);
-            printf(" duration=%d", ntohs(cpkt->duration));
-            printf(" client_id=%s", cpkt->client_id);
+    if (strlen(topic_name) > MQTT_SN_MAX_TOPIC_LENGTH) {
+        return;
+    }
+
+    for (i = 0; i < cache->topic_count; i++) {
+        if (cache->topics[i].topic_id == topic_id) {
+            topic = &cache->topics[i];
             break;
         }
-        case MQTT_SN_TYPE_CONNACK: {
+    }
+
+    if (topic == NULL) {
+        if (cache->topic_count >= MQTT_SN_SESSION_CACHE_TOPICS) {
+            mqtt_sn_log_debug("Session cache is full, not storing topic 0x%4.4x", topic_id);
+            return;
+        }
+        topic = &cache->topics[cache->topic_count];
+    }
+
+    // Write the entry before counting it, so a reader never sees a half-written name
+    strcpy(topic->topic_name, topic_name);
+    topic->topic_id = topic_id;
+    if (topic == &cache->topics[cache->topic_count]) {
+        cache->topic_count++;
+    }
+}
+
+void mqtt_sn_register_topic(mqtt_sn_client_t *client, int topic_id, const char* topic_name)
+{
+    topic_registry_t *registry = &client->topics;
+    topic_entry_t *entry;
+
+    // Check topic ID is valid
+    if (topic_id == 0x0000 || topic_id == 0xFFFF) {
+        mqtt_sn_log_err("Attempted to register invalid topic id: 0x%4.4x", topic_id);
+        return;
+    }
+
+    // Check topic name is valid
+    if (topic_name == NULL || strlen(topic_name) <= 0) {
+        mqtt_sn_log_err("Attempted to register invalid topic name.");
+        return;
+    }
+
+    mqtt_sn_log_debug("Registering topic 0x%4.4x: %s", topic_id, topic_name);
+
+    // Keep both tables at most half full
+    if (registry->capacity == 0) {
+        mqtt_sn_resize_topic_registry(registry, MQTT_SN_TOPIC_REGISTRY_MIN_SIZE);
+    } else if ((registry->count + 1) * 2 > registry->capacity) {
+        mqtt_sn_resize_topic_registry(registry, registry->capacity * 2);
+    } else if ((registry->name_slots_used + 1) * 2 > registry->capacity) {
+        mqtt_sn_resize_topic_registry(registry, registry->capacity);
+    }
+
+    entry = mqtt_sn_find_topic_slot(registry, topic_id);
+    if (entry->topic_id == topic_id && strcmp(entry->topic_name, topic_name) == 0) {
+        // Already registered
+        return;
+    } else if (entry->topic_id == 0) {
+        entry->topic_id = topic_id;
+        registry->count++;
+    }
+
+    // Any name index slot for a previous name is left stale, until the next resize
+    entry->topic_name = mqtt_sn_arena_strdup(registry, topic_name);
+    entry->name_hash = mqtt_sn_hash_topic_name(topic_name);
+    mqtt_sn_index_topic_name(registry, entry);
+
+    if (client->session_cache) {
+        mqtt_sn_cache_topic(client->session_cache, topic_id, topic_name);
+    }
+}
+
+// Look up the name of a topic id, without a warning if it is not known
+static const char* mqtt_sn_find_topic_name(mqtt_sn_client_t *client, int topic_id)
+{
+    topic_registry_t *registry = &client->topics;
+
+    if (registry->count > 0) {
+        topic_entry_t *entry = mqtt_sn_find_topic_slot(registry, topic_id);
+        if (entry->topic_id == topic_id) {
+            return entry->topic_name;
+        }
+    }
+
+    return NULL;
+}
+
+const char* mqtt_sn_lookup_topic(mqtt_sn_client_t *client, int topic_id)
+{
+    const char *topic_name = mqtt_sn_find_topic_name(client, topic_id);
+
+    if (topic_name == NULL) {
+        mqtt_sn_log_warn("Failed to lookup topic id: 0x%4.4x", topic_id);
+    }
+    return topic_name;
+}
+
+uint16_t mqtt_sn_lookup_topic_id(mqtt_sn_client_t *client, const char* topic_name)
+{
+    topic_registry_t *registry = &client->topics;
+    uint32_t hash = mqtt_sn_hash_topic_name(topic_name);
+    uint32_t mask = registry->capacity - 1;
+    uint32_t i = hash & mask;
+
+    if (registry->count == 0) {
+        return 0;
+    }
+
+    while (registry->name_index[i] != 0) {
+        const topic_entry_t *entry = &registry->entries[registry->name_index[i] - 1];
+        if (entry->name_hash == hash && strcmp(entry->topic_name, topic_name) == 0) {
+            return entry->topic_id;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return 0;
+}
+
+uint16_t mqtt_sn_receive_regack(mqtt_sn_client_t *client)
+{
+    regack_packet_t *packet = mqtt_sn_wait_for_reply(client, MQTT_SN_TYPE_REGACK);
+    uint16_t received_message_id, received_topic_id;
+
+    if (packet == NULL) {
+        mqtt_sn_log_err("Failed to connect to register topic.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Check Regack return code
+    mqtt_sn_log_debug("REGACK return code: 0x%2.2x", packet->return_code);
+
+    if (packet->return_code) {
+        mqtt_sn_log_err("REGISTER failed: %s", mqtt_sn_return_code_string(packet->return_code));
+        exit(packet->return_code);
+    }
+
+    // Check that the Message ID matches
+    received_message_id = ntohs(packet->message_id);
+    if (received_message_id != client->next_message_id-1) {
+        mqtt_sn_log_warn("Message id in Regack does not equal message id sent");
+    }
+
+    // Return the topic ID returned by the gateway
+    received_topic_id = ntohs(packet->topic_id);
+    mqtt_sn_log_debug("REGACK topic id: 0x%4.4x", received_topic_id);
+
+    return received_topic_id;
+}
+
+void mqtt_sn_dump_packet(mqtt_sn_client_t *client, char* packet)
+{
+    fprintf(client->output, "%s: len=%d", mqtt_sn_type_string(packet[1]), (int)mqtt_sn_packet_length(packet));
+
+    switch(packet[1]) {
+        case MQTT_SN_TYPE_CONNECT: {
+            connect_packet_t* cpkt = (connect_packet_t*)packet;
+            fprintf(client->output, " protocol_id=%d", cpkt->protocol_id);
+            fprintf(client->output, " duration=%d", ntohs(cpkt->duration));
+            fprintf(client->output, " client_id=%s", cpkt->client_id);
+            break;
+        }
+        case MQTT_SN_TYPE_CONNACK: {
             connack_packet_t* capkt = (connack_packet_t*)packet;
-            printf(" return_code=%d (%s)", capkt->return_code, mqtt_sn_return_code_string(capkt->return_code));
+            fprintf(client->output, " return_code=%d (%s)", capkt->return_code, mqtt_sn_return_code_string(capkt->return_code));
             break;
         }
         case MQTT_SN_TYPE_REGISTER: {
             register_packet_t* rpkt = (register_packet_t*)packet;
-            printf(" topic_id=0x%4.4x", ntohs(rpkt->topic_id));
-            printf(" message_id=0x%4.4x", ntohs(rpkt->message_id));
-            printf(" topic_name=%s", rpkt->topic_name);
+            fprintf(client->output, " topic_id=0x%4.4x", ntohs(rpkt->topic_id));
+            fprintf(client->output, " message_id=0x%4.4x", ntohs(rpkt->message_id));
+            fprintf(client->output, " topic_name=%s", rpkt->topic_name);
             break;
         }
         case MQTT_SN_TYPE_REGACK: {
             regack_packet_t* rapkt = (regack_packet_t*)packet;
-            printf(" topic_id=0x%4.4x", ntohs(rapkt->topic_id));
-            printf(" message_id=0x%4.4x", ntohs(rapkt->message_id));
-            printf(" return_code=%d (%s)", rapkt->return_code, mqtt_sn_return_code_string(rapkt->return_code));
+            fprintf(client->output, " topic_id=0x%4.4x", ntohs(rapkt->topic_id));
+            fprintf(client->output, " message_id=0x%4.4x", ntohs(rapkt->message_id));
+            fprintf(client->output, " return_code=%d (%s)", rapkt->return_code, mqtt_sn_return_code_string(rapkt->return_code));
             break;
         }
         case MQTT_SN_TYPE_PUBLISH: {
             publish_packet_t* ppkt = (publish_packet_t*)packet;
-            printf(" topic_id=0x%4.4x", ntohs(ppkt->topic_id));
-            printf(" message_id=0x%4.4x", ntohs(ppkt->message_id));
-            printf(" data=%s", ppkt->data);
+            fprintf(client->output, " topic_id=0x%4.4x", ntohs(ppkt->topic_id));
+            fprintf(client->output, " message_id=0x%4.4x", ntohs(ppkt->message_id));
+            fprintf(client->output, " data=%s", ppkt->data);
             break;
         }
         case MQTT_SN_TYPE_SUBSCRIBE: {
             subscribe_packet_t* spkt = (subscribe_packet_t*)packet;
-            printf(" message_id=0x%4.4x", ntohs(spkt->message_id));
+            fprintf(client->output, " message_id=0x%4.4x", ntohs(spkt->message_id));
             break;
         }
         case MQTT_SN_TYPE_SUBACK: {
             suback_packet_t* sapkt = (suback_packet_t*)packet;
-            printf(" topic_id=0x%4.4x", ntohs(sapkt->topic_id));
-            printf(" message_id=0x%4.4x", ntohs(sapkt->message_id));
-            printf(" return_code=%d (%s)", sapkt->return_code, mqtt_sn_return_code_string(sapkt->return_code));
+            fprintf(client->output, " topic_id=0x%4.4x", ntohs(sapkt->topic_id));
+            fprintf(client->output, " message_id=0x%4.4x", ntohs(sapkt->message_id));
+            fprintf(client->output, " return_code=%d (%s)", sapkt->return_code, mqtt_sn_return_code_string(sapkt->return_code));
             break;
         }
         case MQTT_SN_TYPE_DISCONNECT: {
             disconnect_packet_t* dpkt = (disconnect_packet_t*)packet;
-            printf(" duration=%d", ntohs(dpkt->duration));
+            fprintf(client->output, " duration=%d", ntohs(dpkt->duration));
+            break;
+        }
+    }
+
+    fprintf(client->output, "\n");
+    fflush(client->output);
+}
+
+// The time that the packet being processed was received: the kernel
+// timestamp if they are enabled, so that no system call is needed
+static void mqtt_sn_receive_time(mqtt_sn_client_t *client, struct timeval *tv)
+{
+    if (client->receive_timestamps && client->receive_next > 0) {
+        *tv = client->receive_ring[client->receive_next - 1].timestamp;
+    } else {
+        gettimeofday(tv, NULL);
+    }
+}
+
+// Only format the date and time when the second changes
+static const char* mqtt_sn_output_time(mqtt_sn_client_t *client, time_t seconds)
+{
+    if (client->output_second != seconds) {
+        struct tm tm;
+        if (client->output_format == MQTT_SN_OUTPUT_TEXT) {
+            strftime(client->output_time, sizeof(client->output_time), "%F %T", localtime_r(&seconds, &tm));
+        } else {
+            strftime(client->output_time, sizeof(client->output_time), "%Y-%m-%dT%H:%M:%S", gmtime_r(&seconds, &tm));
+        }
+        client->output_second = seconds;
+    }
+
+    return client->output_time;
+}
+
+static uint8_t mqtt_sn_is_utf8(const uint8_t *data, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        int extra, j;
+
+        if (data[i] < 0x80) {
+            extra = 0;
+        } else if ((data[i] & 0xE0) == 0xC0 && data[i] >= 0xC2) {
+            extra = 1;
+        } else if ((data[i] & 0xF0) == 0xE0) {
+            extra = 2;
+        } else if ((data[i] & 0xF8) == 0xF0 && data[i] <= 0xF4) {
+            extra = 3;
+        } else {
+            return FALSE;
+        }
+
+        if (i + extra >= len) {
+            return FALSE;
+        }
+        for (j = 1; j <= extra; j++) {
+            if ((data[i + j] & 0xC0) != 0x80) {
+                return FALSE;
+            }
+        }
+
+        // Reject overlong encodings, surrogates and code points above U+10FFFF
+        if ((data[i] == 0xE0 && data[i + 1] < 0xA0) || (data[i] == 0xED && data[i + 1] >= 0xA0) ||
+                (data[i] == 0xF0 && data[i + 1] < 0x90) || (data[i] == 0xF4 && data[i + 1] >= 0x90)) {
+            return FALSE;
+        }
+        i += extra + 1;
+    }
+
+    return TRUE;
+}
+
+static void mqtt_sn_write_json_string(FILE *out, const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    fputc('"', out);
+    for (i = 0; i < len; i++) {
+        switch (data[i]) {
+            case '"':  fputs("\\\"", out); break;
+            case '\\': fputs("\\\\", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            case '\t': fputs("\\t", out); break;
+            default:
+                if (data[i] < 0x20) {
+                    fprintf(out, "\\u%4.4x", data[i]);
+                } else {
+                    fputc(data[i], out);
+                }
+                break;
+        }
+    }
+    fputc('"', out);
+}
+
+static void mqtt_sn_write_base64(FILE *out, const uint8_t *data, size_t len)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+
+    fputc('"', out);
+    for (i = 0; i < len; i += 3) {
+        uint32_t n = data[i] << 16;
+        if (i + 1 < len)
+            n |= data[i + 1] << 8;
+        if (i + 2 < len)
+            n |= data[i + 2];
+
+        fputc(alphabet[(n >> 18) & 0x3F], out);
+        fputc(alphabet[(n >> 12) & 0x3F], out);
+        fputc(i + 1 < len ? alphabet[(n >> 6) & 0x3F] : '=', out);
+        fputc(i + 2 < len ? alphabet[n & 0x3F] : '=', out);
+    }
+    fputc('"', out);
+}
+
+// Quote the field if it contains a separator, quote or line break
+static void mqtt_sn_write_csv_field(FILE *out, const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (data[i] == ',' || data[i] == '"' || data[i] == '\r' || data[i] == '\n') {
+            break;
+        }
+    }
+
+    if (i == len) {
+        fwrite(data, 1, len, out);
+        return;
+    }
+
+    fputc('"', out);
+    for (i = 0; i < len; i++) {
+        if (data[i] == '"') {
+            fputc('"', out);
+        }
+        fputc(data[i], out);
+    }
+    fputc('"', out);
+}
+
+static void mqtt_sn_write_uint(FILE *out, uint64_t value, int bytes)
+{
+    while (bytes-- > 0) {
+        fputc((value >> (bytes * 8)) & 0xFF, out);
+    }
+}
+
+static size_t mqtt_sn_publish_payload_length(const publish_packet_t* packet)
+{
+    return mqtt_sn_packet_length(packet) - (packet->length == 0x01 ? 9 : 7);
+}
+
+void mqtt_sn_print_publish_packet(mqtt_sn_client_t *client, publish_packet_t* packet)
+{
+    mqtt_sn_print_message(client, packet, packet->data, mqtt_sn_publish_payload_length(packet));
+}
+
+// Output a message, using the topic and flags from the PUBLISH packet it was received in
+void mqtt_sn_print_message(mqtt_sn_client_t *client, const publish_packet_t* packet, const void* data, size_t payload_len)
+{
+    FILE *out = client->output;
+    const uint8_t *payload = data;
+    int topic_type = packet->flags & 0x3;
+    int topic_id = ntohs(packet->topic_id);
+    const char *topic_name = NULL;
+    size_t topic_name_len = 0;
+    int qos = (packet->flags & MQTT_SN_FLAG_QOS_MASK) >> 5;
+    struct timeval tv;
+
+    // Plain text output only shows the topic when verbose, so the name is not needed
+    switch (topic_type) {
+        case MQTT_SN_TOPIC_TYPE_NORMAL:
+            if (client->verbose || client->output_format != MQTT_SN_OUTPUT_TEXT) {
+                topic_name = mqtt_sn_find_topic_name(client, topic_id);
+                topic_name_len = topic_name ? strlen(topic_name) : 0;
+            }
+            break;
+        case MQTT_SN_TOPIC_TYPE_SHORT:
+            topic_name = (const char*)&packet->topic_id;
+            topic_name_len = 2;
+            break;
+    }
+
+    if (qos == 3) {
+        qos = -1;
+    }
+
+    switch (client->output_format) {
+        case MQTT_SN_OUTPUT_JSON:
+            mqtt_sn_receive_time(client, &tv);
+            fprintf(out, "{\"time\":\"%s.%6.6ldZ\",\"topic\":", mqtt_sn_output_time(client, tv.tv_sec), (long)tv.tv_usec);
+            if (topic_name) {
+                mqtt_sn_write_json_string(out, (const uint8_t*)topic_name, topic_name_len);
+            } else {
+                fputs("null", out);
+            }
+            fprintf(out, ",\"topic_id\":%d,\"topic_type\":\"%s\",\"message_id\":%d,\"qos\":%d,\"retain\":%s,",
+                    topic_id,
+                    topic_type == MQTT_SN_TOPIC_TYPE_NORMAL ? "normal" :
+                    topic_type == MQTT_SN_TOPIC_TYPE_PREDEFINED ? "predefined" : "short",
+                    ntohs(packet->message_id), qos,
+                    (packet->flags & MQTT_SN_FLAG_RETAIN) ? "true" : "false");
+            if (mqtt_sn_is_utf8(payload, payload_len)) {
+                fputs("\"payload\":", out);
+                mqtt_sn_write_json_string(out, payload, payload_len);
+            } else {
+                fputs("\"payload_base64\":", out);
+                mqtt_sn_write_base64(out, payload, payload_len);
+            }
+            fputs("}\n", out);
+            break;
+
+        case MQTT_SN_OUTPUT_CSV:
+            if (!client->output_started) {
+                fputs("time,topic,topic_id,message_id,qos,retain,payload\n", out);
+                client->output_started = TRUE;
+            }
+            mqtt_sn_receive_time(client, &tv);
+            fprintf(out, "%s.%6.6ldZ,", mqtt_sn_output_time(client, tv.tv_sec), (long)tv.tv_usec);
+            if (topic_name) {
+                mqtt_sn_write_csv_field(out, (const uint8_t*)topic_name, topic_name_len);
+            }
+            fprintf(out, ",%d,%d,%d,%d,", topic_id, ntohs(packet->message_id), qos,
+                    (packet->flags & MQTT_SN_FLAG_RETAIN) ? 1 : 0);
+            mqtt_sn_write_csv_field(out, payload, payload_len);
+            fputc('\n', out);
+            break;
+
+        case MQTT_SN_OUTPUT_BINARY:
+            // Length of the rest of the record, receive time in microseconds,
+            // flags, topic id, message id, topic name and then the payload
+            mqtt_sn_receive_time(client, &tv);
+            mqtt_sn_write_uint(out, 8 + 1 + 2 + 2 + 1 + topic_name_len + payload_len, 4);
+            mqtt_sn_write_uint(out, ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec, 8);
+            mqtt_sn_write_uint(out, packet->flags, 1);
+            mqtt_sn_write_uint(out, topic_id, 2);
+            mqtt_sn_write_uint(out, ntohs(packet->message_id), 2);
+            mqtt_sn_write_uint(out, topic_name_len, 1);
+            fwrite(topic_name, 1, topic_name_len, out);
+            fwrite(payload, 1, payload_len, out);
+            break;
+
+        default:
+            if (client->verbose) {
+                if (topic_type == MQTT_SN_TOPIC_TYPE_NORMAL && topic_name == NULL) {
+                    mqtt_sn_log_warn("Failed to lookup topic id: 0x%4.4x", topic_id);
+                    break;
+                }
+                if (client->verbose == 2) {
+                    mqtt_sn_receive_time(client, &tv);
+                    fputs(mqtt_sn_output_time(client, tv.tv_sec), out);
+                    fputc(' ', out);
+                }
+                if (topic_name) {
+                    fwrite(topic_name, 1, topic_name_len, out);
+                } else {
+                    fprintf(out, "%4.4x", topic_id);
+                }
+                fputs(": ", out);
+            }
+            fwrite(payload, 1, payload_len, out);
+            fputc('\n', out);
+            break;
+    }
+
+    if (client->output_flush_interval == 0) {
+        fflush(out);
+    } else {
+        uint64_t now = mqtt_sn_monotonic_ms();
+        if (client->output_pending_since == 0) {
+            client->output_pending_since = now;
+        } else if (now - client->output_pending_since >= client->output_flush_interval) {
+            mqtt_sn_flush_output(client);
+        }
+    }
+}
+
+static void mqtt_sn_free_reassembly(mqtt_sn_client_t *client, reassembly_t *entry)
+{
+    if (!entry->complete) {
+        client->reassembly_used -= entry->total_length;
+    }
+    free(entry->data);
+    free(entry->received_bitmap);
+    memset(entry, 0, sizeof(reassembly_t));
+}
+
+// Give up on messages that have not received a chunk for a while
+static void mqtt_sn_expire_reassembly(mqtt_sn_client_t *client)
+{
+    uint64_t now = mqtt_sn_monotonic_ms();
+    uint8_t incomplete = FALSE;
+    int i;
+
+    for (i = 0; i < MQTT_SN_MAX_REASSEMBLY; i++) {
+        reassembly_t *entry = &client->reassembly[i];
+
+        if (entry->in_use && now - entry->last_received >= MQTT_SN_REASSEMBLY_TIMEOUT) {
+            if (!entry->complete) {
+                mqtt_sn_log_warn("Timed out reassembling message (transfer id 0x%4.4x, received %u of %u bytes)",
+                                 entry->transfer_id, entry->received, entry->total_length);
+                client->reassembly_failed = TRUE;
+            }
+            mqtt_sn_free_reassembly(client, entry);
+        } else if (entry->in_use && !entry->complete) {
+            incomplete = TRUE;
+        }
+    }
+
+    // Stop waiting for the rest of a message that is never going to arrive
+    if (!incomplete) {
+        client->partial_message = FALSE;
+    }
+}
+
+// Add a chunk to the message it belongs to, and output the message once it is complete.
+// Returns FALSE if the packet is not a chunk.
+static uint8_t mqtt_sn_process_chunk(mqtt_sn_client_t *client, const publish_packet_t *packet)
+{
+    const chunk_header_t *header = (const chunk_header_t*)packet->data;
+    size_t payload_len = mqtt_sn_publish_payload_length(packet);
+    uint16_t topic_id = ntohs(packet->topic_id);
+    uint8_t topic_type = packet->flags & 0x3;
+    reassembly_t *entry = NULL;
+    reassembly_t *spare = NULL;
+    uint16_t transfer_id;
+    uint32_t offset, total_length, len, i;
+
+    if (payload_len < sizeof(chunk_header_t) || memcmp(header->magic, MQTT_SN_CHUNK_MAGIC, sizeof(header->magic)) != 0) {
+        return FALSE;
+    }
+
+    transfer_id = ntohs(header->transfer_id);
+    offset = ntohl(header->offset);
+    total_length = ntohl(header->total_length);
+    len = payload_len - sizeof(chunk_header_t);
+
+    if (offset > total_length || len > total_length - offset) {
+        mqtt_sn_log_warn("Ignoring chunk outside of message (transfer id 0x%4.4x)", transfer_id);
+        client->reassembly_failed = TRUE;
+        return TRUE;
+    }
+
+    mqtt_sn_expire_reassembly(client);
+
+    // Find the message, or a free entry to start it in, re-using a completed one if needed
+    for (i = 0; i < MQTT_SN_MAX_REASSEMBLY; i++) {
+        reassembly_t *e = &client->reassembly[i];
+        if (e->in_use && e->transfer_id == transfer_id && e->topic_id == topic_id && e->topic_type == topic_type) {
+            entry = e;
             break;
+        } else if (!e->in_use && (spare == NULL || spare->in_use)) {
+            spare = e;
+        } else if (e->complete && spare == NULL) {
+            spare = e;
+        }
+    }
+
+    if (entry == NULL) {
+        if (spare == NULL || total_length > client->reassembly_limit - client->reassembly_used) {
+            mqtt_sn_log_warn("Not enough space to reassemble message (transfer id 0x%4.4x, %u bytes)", transfer_id, total_length);
+            client->reassembly_failed = TRUE;
+            return TRUE;
+        }
+
+        entry = spare;
+        if (entry->in_use) {
+            mqtt_sn_free_reassembly(client, entry);
+        }
+        entry->data = malloc(total_length + 1);
+        entry->received_bitmap = calloc(total_length / 8 + 1, 1);
+        if (entry->data == NULL || entry->received_bitmap == NULL) {
+            mqtt_sn_log_err("Failed to allocate memory for reassembly");
+            exit(EXIT_FAILURE);
+        }
+        entry->topic_id = topic_id;
+        entry->topic_type = topic_type;
+        entry->transfer_id = transfer_id;
+        entry->total_length = total_length;
+        entry->in_use = TRUE;
+        client->reassembly_used += total_length;
+    }
+
+    entry->last_received = mqtt_sn_monotonic_ms();
+    if (entry->complete) {
+        mqtt_sn_log_debug("Ignoring chunk of a message that is already complete (transfer id 0x%4.4x)", transfer_id);
+        client->reassembly_failed = TRUE;
+        return TRUE;
+    }
+
+    // Only count the bytes that have not been received before, in case a chunk was resent
+    memcpy(entry->data + offset, (const uint8_t*)packet->data + sizeof(chunk_header_t), len);
+    for (i = offset; i < offset + len; i++) {
+        if (!(entry->received_bitmap[i / 8] & (1 << (i % 8)))) {
+            entry->received_bitmap[i / 8] |= (1 << (i % 8));
+            entry->received++;
         }
     }
 
-    printf("\n");
-    fflush(stdout);
+    if (entry->received == entry->total_length) {
+        mqtt_sn_log_debug("Reassembled message of %u bytes (transfer id 0x%4.4x)", entry->total_length, transfer_id);
+        mqtt_sn_print_message(client, packet, entry->data, entry->total_length);
+
+        // Keep the entry, without the data, to ignore any chunks that are resent
+        client->reassembly_used -= entry->total_length;
+        free(entry->data);
+        free(entry->received_bitmap);
+        entry->data = entry->received_bitmap = NULL;
+        entry->complete = TRUE;
+        client->partial_message = FALSE;
+        client->reassembly_failed = FALSE;
+    } else {
+        client->partial_message = TRUE;
+    }
+
+    return TRUE;
+}
+
+uint16_t mqtt_sn_receive_suback(mqtt_sn_client_t *client)
+{
+    suback_packet_t *packet = mqtt_sn_wait_for_reply(client, MQTT_SN_TYPE_SUBACK);
+    uint16_t received_message_id, received_topic_id;
+
+    if (packet == NULL) {
+        mqtt_sn_log_err("Failed to subscribe to topic.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Check Suback return code
+    mqtt_sn_log_debug("SUBACK return code: 0x%2.2x", packet->return_code);
+
+    if (packet->return_code) {
+        mqtt_sn_log_err("SUBSCRIBE error: %s", mqtt_sn_return_code_string(packet->return_code));
+        exit(packet->return_code);
+    }
+
+    // Check that the Message ID matches
+    received_message_id = ntohs(packet->message_id);
+    if (received_message_id != client->next_message_id-1) {
+        mqtt_sn_log_warn("Message id in SUBACK does not equal message id sent");
+        mqtt_sn_log_debug("  Expecting: %d", client->next_message_id-1);
+        mqtt_sn_log_debug("  Actual: %d", received_message_id);
+    }
+
+    // Return the topic ID returned by the gateway
+    received_topic_id = ntohs(packet->topic_id);
+    mqtt_sn_log_debug("SUBACK topic id: 0x%4.4x", received_topic_id);
+
+    return received_topic_id;
+}
+
+// Send a REGISTER or SUBSCRIBE for each topic, keeping up to window requests
+// waiting for a reply at a time, and matching the replies by message id
+static void mqtt_sn_send_topic_requests(mqtt_sn_client_t *client, uint8_t type, topic_request_t *requests, uint32_t count, uint8_t qos, uint16_t window)
+{
+    uint8_t reply_type = (type == MQTT_SN_TYPE_REGISTER) ? MQTT_SN_TYPE_REGACK : MQTT_SN_TYPE_SUBACK;
+    uint16_t first_message_id = client->next_message_id;
+    uint16_t outstanding = 0;
+    uint32_t next = 0, done = 0;
+    pending_request_t *pending;
+
+    if (window < 1) {
+        window = 1;
+    } else if (window > MQTT_SN_MAX_INFLIGHT) {
+        window = MQTT_SN_MAX_INFLIGHT;
+    }
+
+    pending = calloc(window, sizeof(pending_request_t));
+    if (pending == NULL) {
+        mqtt_sn_log_err("Failed to allocate memory for pending requests");
+        exit(EXIT_FAILURE);
+    }
+
+    while (done < count) {
+        pending_request_t *slot;
+        uint64_t now, wake;
+        uint8_t *packet;
+        uint16_t message_id, topic_id;
+        uint8_t return_code;
+        int i;
+
+        // Fill the window
+        while (next < count && outstanding < window) {
+            slot = &pending[client->next_message_id % window];
+            if (slot->in_use) {
+                break;
+            }
+
+            if (type == MQTT_SN_TYPE_REGISTER) {
+                mqtt_sn_send_register(client, requests[next].topic_name);
+            } else if (requests[next].topic_name) {
+                mqtt_sn_send_subscribe_topic_name(client, requests[next].topic_name, qos);
+            } else {
+                mqtt_sn_send_subscribe_topic_id(client, requests[next].topic_id, qos);
+            }
+
+            memcpy(slot->packet, client->request, client->request[0]);
+            slot->index = next++;
+            slot->message_id = mqtt_sn_packet_message_id(slot->packet);
+            slot->in_use = TRUE;
+            slot->attempts = 0;
+            slot->rto = client->rto;
+            slot->first_sent = slot->last_sent = client->request_sent;
+            outstanding++;
+        }
+
+        // Resend the requests whose retransmission timeout has expired
+        now = mqtt_sn_monotonic_ms();
+        wake = now + client->timeout;
+        for (i = 0; i < window; i++) {
+            uint64_t resend_at, deadline;
+
+            slot = &pending[i];
+            if (!slot->in_use) {
+                continue;
+            }
+
+            deadline = slot->first_sent + client->timeout;
+            if (now >= deadline) {
+                if (type == MQTT_SN_TYPE_REGISTER) {
+                    mqtt_sn_log_err("Failed to connect to register topic.");
+                } else {
+                    mqtt_sn_log_err("Failed to subscribe to topic.");
+                }
+                exit(EXIT_FAILURE);
+            }
+
+            resend_at = slot->last_sent + slot->rto;
+            if (slot->attempts < client->max_retries && now >= resend_at) {
+                mqtt_sn_resend(client, slot->packet, slot->attempts++);
+                slot->rto = mqtt_sn_backoff(slot->rto);
+                slot->last_sent = now;
+                resend_at = now + slot->rto;
+            }
+
+            if (slot->attempts < client->max_retries && resend_at < deadline) {
+                deadline = resend_at;
+            }
+            if (deadline < wake) {
+                wake = deadline;
+            }
+        }
+
+        packet = mqtt_sn_wait_for_timeout(client, reply_type, wake > now ? wake - now : 0);
+        if (packet == NULL) {
+            continue;
+        }
+
+        message_id = mqtt_sn_packet_message_id(packet);
+        slot = &pending[message_id % window];
+        if (!slot->in_use || slot->message_id != message_id) {
+            // A reply to a request that was resent, and has already been answered
+            if ((uint16_t)(message_id - first_message_id) < next || outstanding != 1) {
+                mqtt_sn_log_debug("Ignoring %s for message id 0x%4.4x", mqtt_sn_type_string(reply_type), message_id);
+                continue;
+            }
+
+            // With only one request outstanding, the reply must be for it
+            slot = pending;
+            while (!slot->in_use) {
+                slot++;
+            }
+            mqtt_sn_log_warn("Message id in %s does not equal message id sent", mqtt_sn_type_string(reply_type));
+            mqtt_sn_log_debug("  Expecting: %d", slot->message_id);
+            mqtt_sn_log_debug("  Actual: %d", message_id);
+        }
+
+        if (reply_type == MQTT_SN_TYPE_REGACK) {
+            return_code = ((regack_packet_t*)packet)->return_code;
+            topic_id = ntohs(((regack_packet_t*)packet)->topic_id);
+        } else {
+            return_code = ((suback_packet_t*)packet)->return_code;
+            topic_id = ntohs(((suback_packet_t*)packet)->topic_id);
+        }
+        mqtt_sn_log_debug("%s return code: 0x%2.2x", mqtt_sn_type_string(reply_type), return_code);
+
+        // Try again later if the gateway is busy
+        if (return_code == MQTT_SN_REJECTED_CONGESTION && slot->attempts < client->max_retries) {
+            mqtt_sn_rate_feedback(client, TRUE);
+            slot->rto = mqtt_sn_backoff(slot->rto);
+            slot->last_sent = mqtt_sn_monotonic_ms();
+            continue;
+        }
+
+        if (return_code) {
+            if (type == MQTT_SN_TYPE_REGISTER) {
+                mqtt_sn_log_err("REGISTER failed: %s", mqtt_sn_return_code_string(return_code));
+            } else {
+                mqtt_sn_log_err("SUBSCRIBE error: %s", mqtt_sn_return_code_string(return_code));
+            }
+            exit(return_code);
+        }
+
+        if (slot->attempts == 0) {
+            mqtt_sn_update_rtt(client, mqtt_sn_monotonic_ms() - slot->first_sent);
+        }
+
+        mqtt_sn_log_debug("%s topic id: 0x%4.4x", mqtt_sn_type_string(reply_type), topic_id);
+        if (requests[slot->index].topic_name) {
+            requests[slot->index].topic_id = topic_id;
+            if (topic_id && strlen(requests[slot->index].topic_name) > 2) {
+                mqtt_sn_register_topic(client, topic_id, requests[slot->index].topic_name);
+            }
+        }
+
+        slot->in_use = FALSE;
+        outstanding--;
+        done++;
+    }
+
+    free(pending);
+}
+
+void mqtt_sn_register_topics(mqtt_sn_client_t *client, topic_request_t *requests, uint32_t count, uint16_t window)
+{
+    mqtt_sn_send_topic_requests(client, MQTT_SN_TYPE_REGISTER, requests, count, 0, window);
+}
+
+void mqtt_sn_subscribe_topics(mqtt_sn_client_t *client, topic_request_t *requests, uint32_t count, uint8_t qos, uint16_t window)
+{
+    mqtt_sn_send_topic_requests(client, MQTT_SN_TYPE_SUBSCRIBE, requests, count, qos, window);
+}
+
+static void mqtt_sn_socket_handler(void *data)
+{
+    mqtt_sn_client_t *client = data;
+    client->readable = TRUE;
+}
+
+static void mqtt_sn_keep_alive_handler(void *data)
+{
+    mqtt_sn_client_t *client = data;
+    uint64_t interval = (uint64_t)client->keep_alive * 1000;
+    uint64_t now = mqtt_sn_monotonic_ms();
+
+    if (interval == 0) {
+        return;
+    }
+
+    // Time to send a ping?
+    if (now - client->last_transmit >= interval) {
+        mqtt_sn_send_pingreq(client);
+        mqtt_sn_flush_batch(client);
+    }
+
+    if (client->last_transmit + interval > now) {
+        mqtt_sn_timer_start(client->loop, &client->keep_alive_timer, client->last_transmit + interval - now);
+    } else {
+        mqtt_sn_timer_start(client->loop, &client->keep_alive_timer, interval);
+    }
+}
+
+// The event loop is created the first time that the client waits for a packet
+static mqtt_sn_event_loop_t* mqtt_sn_client_loop(mqtt_sn_client_t *client)
+{
+    if (client->loop == NULL) {
+        client->loop = malloc(sizeof(mqtt_sn_event_loop_t));
+        if (!client->loop) {
+            mqtt_sn_log_err("Failed to allocate memory for event loop");
+            exit(EXIT_FAILURE);
+        }
+        mqtt_sn_event_loop_init(client->loop);
+        mqtt_sn_event_watch(client->loop, client->sock, mqtt_sn_socket_handler, client);
+        mqtt_sn_timer_init(&client->keep_alive_timer, mqtt_sn_keep_alive_handler, client);
+    }
+
+    if (client->keep_alive > 0 && client->keep_alive_timer.heap_index == 0) {
+        mqtt_sn_keep_alive_handler(client);
+    }
+
+    return client->loop;
+}
+
+// Wait for up to timeout_ms for a packet to arrive, sending keep alive pings while waiting
+// Returns 1 if there is a packet to read, 0 on timeout and -1 if interrupted
+static int mqtt_sn_wait_readable(mqtt_sn_client_t *client, uint64_t timeout_ms)
+{
+    uint64_t deadline = mqtt_sn_monotonic_ms() + timeout_ms;
+    mqtt_sn_event_loop_t *loop;
+
+    // Packets already read from the socket can be processed straight away
+    if (mqtt_sn_pending_packets(client) > 0) {
+        return 1;
+    }
+
+    loop = mqtt_sn_client_loop(client);
+    client->readable = FALSE;
+    while (!client->readable) {
+        uint64_t now, wake;
+
+        mqtt_sn_flush_batch(client);
+
+        now = mqtt_sn_monotonic_ms();
+        if (client->output_pending_since && now - client->output_pending_since >= client->output_flush_interval) {
+            mqtt_sn_flush_output(client);
+        }
+        if (now >= deadline) {
+            return 0;
+        }
+
+        // Wake up in time to write out buffered messages
+        wake = deadline;
+        if (client->output_pending_since && client->output_pending_since + client->output_flush_interval < wake) {
+            wake = client->output_pending_since + client->output_flush_interval;
+        }
+
+        if (mqtt_sn_event_loop_run_once(loop, wake - now) < 0) {
+            if (errno != EINTR) {
+                // Something is wrong.
+                perror("event loop");
+                exit(EXIT_FAILURE);
+            }
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+// Wait until a time from mqtt_sn_monotonic_us(), handling packets from the gateway and sending
+// keep alive pings meanwhile. The event loop only has millisecond resolution, so the last
+// part of the wait is a sleep. Returns FALSE if interrupted by a signal.
+uint8_t mqtt_sn_wait_until(mqtt_sn_client_t *client, uint64_t deadline_us)
+{
+    while (TRUE) {
+        uint64_t now = mqtt_sn_monotonic_us();
+
+        if (now >= deadline_us) {
+            return TRUE;
+        }
+
+        if (deadline_us - now > 2000) {
+            int ret = mqtt_sn_wait_readable(client, (deadline_us - now) / 1000 - 1);
+            if (ret < 0) {
+                return FALSE;
+            } else if (ret > 0) {
+                mqtt_sn_wait_for_timeout(client, MQTT_SN_TYPE_PUBACK, 0);
+            }
+        } else {
+#ifdef __linux__
+            struct timespec ts;
+            ts.tv_sec = deadline_us / 1000000;
+            ts.tv_nsec = (deadline_us % 1000000) * 1000;
+            if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+                return FALSE;
+            }
+#else
+            struct timespec ts;
+            ts.tv_sec = (deadline_us - now) / 1000000;
+            ts.tv_nsec = ((deadline_us - now) % 1000000) * 1000;
+            if (nanosleep(&ts, NULL) < 0 && errno == EINTR) {
+                return FALSE;
+            }
+#endif
+        }
+    }
+}
+
+int mqtt_sn_select(mqtt_sn_client_t *client)
+{
+    return mqtt_sn_wait_readable(client, client->timeout);
+}
+
+static void* mqtt_sn_wait_for_timeout(mqtt_sn_client_t *client, uint8_t type, uint64_t timeout)
+{
+    uint64_t started_waiting = mqtt_sn_monotonic_ms();
+
+    while(TRUE) {
+        uint64_t now = mqtt_sn_monotonic_ms();
+        uint64_t remaining = (now - started_waiting) < timeout ? timeout - (now - started_waiting) : 0;
+        int ret;
+
+        ret = mqtt_sn_wait_readable(client, remaining);
+        if (ret < 0) {
+            break;
+        } else if (ret > 0) {
+            char* packet = mqtt_sn_receive_packet(client);
+            if (packet) {
+                switch(packet[1]) {
+                    case MQTT_SN_TYPE_PUBLISH:
+                        client->partial_message = FALSE;
+                        client->reassembly_failed = FALSE;
+                        if (client->reassembly_limit == 0 || !mqtt_sn_process_chunk(client, (publish_packet_t *)packet)) {
+                            mqtt_sn_print_publish_packet(client, (publish_packet_t *)packet);
+                        }
+                        break;
+
+                    case MQTT_SN_TYPE_REGISTER:
+                        mqtt_sn_process_register(client, (register_packet_t*)packet);
+                        break;
+
+                    case MQTT_SN_TYPE_PINGRESP:
+                        // do nothing
+                        break;
+
+                    case MQTT_SN_TYPE_ADVERTISE:
+                        mqtt_sn_refresh_gateway(client, (uint8_t*)packet);
+                        break;
+
+                    case MQTT_SN_TYPE_PUBACK:
+                        if (mqtt_sn_process_puback(client, (puback_packet_t*)packet) == FALSE && type != MQTT_SN_TYPE_PUBACK) {
+                            mqtt_sn_log_warn(
+                                "Was expecting %s packet but received: %s",
+                                mqtt_sn_type_string(type),
+                                mqtt_sn_type_string(packet[1])
+                            );
+                        }
+                        break;
+
+                    case MQTT_SN_TYPE_DISCONNECT:
+                        if (type != MQTT_SN_TYPE_DISCONNECT) {
+                            mqtt_sn_log_warn("Received DISCONNECT from gateway.");
+                            exit(EXIT_FAILURE);
+                        }
+                        break;
+
+                    default:
+                        if (packet[1] != type) {
+                            mqtt_sn_log_warn(
+                                "Was expecting %s packet but received: %s",
+                                mqtt_sn_type_string(type),
+                                mqtt_sn_type_string(packet[1])
+                            );
+                        }
+                        break;
+                }
+
+                // Did we find what we were looking for?
+                if (packet[1] == type) {
+                    return packet;
+                }
+            }
+        }
+
+        now = mqtt_sn_monotonic_ms();
+
+        // Check for receive timeout
+        if (client->keep_alive > 0 && (now - client->last_receive) >= (client->keep_alive * 1500)) {
+            mqtt_sn_log_err("Keep alive error: timed out while waiting for a %s from gateway.", mqtt_sn_type_string(type));
+            exit(EXIT_FAILURE);
+        }
+
+        if (client->reassembly_limit) {
+            mqtt_sn_expire_reassembly(client);
+        }
+
+        // Check if we have timed out waiting for the packet we are looking for
+        if ((now - started_waiting) >= timeout) {
+            mqtt_sn_log_debug("Timed out while waiting for a %s from gateway.", mqtt_sn_type_string(type));
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+void* mqtt_sn_wait_for(mqtt_sn_client_t *client, uint8_t type)
+{
+    return mqtt_sn_wait_for_timeout(client, type, client->timeout);
+}
+
+const char* mqtt_sn_type_string(uint8_t type)
+{
+    switch(type) {
+        case MQTT_SN_TYPE_ADVERTISE:
+            return "ADVERTISE";
+        case MQTT_SN_TYPE_SEARCHGW:
+            return "SEARCHGW";
+        case MQTT_SN_TYPE_GWINFO:
+            return "GWINFO";
+        case MQTT_SN_TYPE_CONNECT:
+            return "CONNECT";
+        case MQTT_SN_TYPE_CONNACK:
+            return "CONNACK";
+        case MQTT_SN_TYPE_WILLTOPICREQ:
+            return "WILLTOPICREQ";
+        case MQTT_SN_TYPE_WILLTOPIC:
+            return "WILLTOPIC";
+        case MQTT_SN_TYPE_WILLMSGREQ:
+            return "WILLMSGREQ";
+        case MQTT_SN_TYPE_WILLMSG:
+            return "WILLMSG";
+        case MQTT_SN_TYPE_REGISTER:
+            return "REGISTER";
+        case MQTT_SN_TYPE_REGACK:
+            return "REGACK";
+        case MQTT_SN_TYPE_PUBLISH:
+            return "PUBLISH";
+        case MQTT_SN_TYPE_PUBACK:
+            return "PUBACK";
+        case MQTT_SN_TYPE_PUBCOMP:
+            return "PUBCOMP";
+        case MQTT_SN_TYPE_PUBREC:
+            return "PUBREC";
+        case MQTT_SN_TYPE_PUBREL:
+            return "PUBREL";
+        case MQTT_SN_TYPE_SUBSCRIBE:
+            return "SUBSCRIBE";
+        case MQTT_SN_TYPE_SUBACK:
+            return "SUBACK";
+        case MQTT_SN_TYPE_UNSUBSCRIBE:
+            return "UNSUBSCRIBE";
+        case MQTT_SN_TYPE_UNSUBACK:
+            return "UNSUBACK";
+        case MQTT_SN_TYPE_PINGREQ:
+            return "PINGREQ";
+        case MQTT_SN_TYPE_PINGRESP:
+            return "PINGRESP";
+        case MQTT_SN_TYPE_DISCONNECT:
+            return "DISCONNECT";
+        case MQTT_SN_TYPE_WILLTOPICUPD:
+            return "WILLTOPICUPD";
+        case MQTT_SN_TYPE_WILLTOPICRESP:
+            return "WILLTOPICRESP";
+        case MQTT_SN_TYPE_WILLMSGUPD:
+            return "WILLMSGUPD";
+        case MQTT_SN_TYPE_WILLMSGRESP:
+            return "WILLMSGRESP";
+        case MQTT_SN_TYPE_FRWDENCAP:
+            return "FRWDENCAP";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+// TRUE if the type is one that mqtt_sn_type_string() knows the name of
+uint8_t mqtt_sn_valid_type(uint8_t type)
+{
+    switch(type) {
+        case MQTT_SN_TYPE_ADVERTISE:
+        case MQTT_SN_TYPE_SEARCHGW:
+        case MQTT_SN_TYPE_GWINFO:
+        case MQTT_SN_TYPE_CONNECT:
+        case MQTT_SN_TYPE_CONNACK:
+        case MQTT_SN_TYPE_WILLTOPICREQ:
+        case MQTT_SN_TYPE_WILLTOPIC:
+        case MQTT_SN_TYPE_WILLMSGREQ:
+        case MQTT_SN_TYPE_WILLMSG:
+        case MQTT_SN_TYPE_REGISTER:
+        case MQTT_SN_TYPE_REGACK:
+        case MQTT_SN_TYPE_PUBLISH:
+        case MQTT_SN_TYPE_PUBACK:
+        case MQTT_SN_TYPE_PUBCOMP:
+        case MQTT_SN_TYPE_PUBREC:
+        case MQTT_SN_TYPE_PUBREL:
+        case MQTT_SN_TYPE_SUBSCRIBE:
+        case MQTT_SN_TYPE_SUBACK:
+        case MQTT_SN_TYPE_UNSUBSCRIBE:
+        case MQTT_SN_TYPE_UNSUBACK:
+        case MQTT_SN_TYPE_PINGREQ:
+        case MQTT_SN_TYPE_PINGRESP:
+        case MQTT_SN_TYPE_DISCONNECT:
+        case MQTT_SN_TYPE_WILLTOPICUPD:
+        case MQTT_SN_TYPE_WILLTOPICRESP:
+        case MQTT_SN_TYPE_WILLMSGUPD:
+        case MQTT_SN_TYPE_WILLMSGRESP:
+        case MQTT_SN_TYPE_FRWDENCAP:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+const char* mqtt_sn_return_code_string(uint8_t return_code)
+{
+    switch(return_code) {
+        case MQTT_SN_ACCEPTED:
+            return "Accepted";
+        case MQTT_SN_REJECTED_CONGESTION:
+            return "Rejected: congestion";
+        case MQTT_SN_REJECTED_INVALID:
+            return "Rejected: invalid topic ID";
+        case MQTT_SN_REJECTED_NOT_SUPPORTED:
+            return "Rejected: not supported";
+        default:
+            return "Rejected: unknown reason";
+    }
+}
+
+// Map a cache file of the given size into memory, returning it locked
+static void* mqtt_sn_map_cache_file(const char* path, const char* name, size_t size, int *fd_out)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        mqtt_sn_log_err("Failed to open %s '%s': %s", name, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        mqtt_sn_log_err("Failed to lock %s '%s': %s", name, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (st.st_size != size && ftruncate(fd, size) < 0) {
+        mqtt_sn_log_err("Failed to resize %s '%s': %s", name, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        mqtt_sn_log_err("Failed to map %s '%s': %s", name, path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    mqtt_sn_log_debug("Opened %s: %s", name, path);
+    *fd_out = fd;
+    return map;
+}
+
+void mqtt_sn_open_session_cache(mqtt_sn_client_t *client, const char* path)
+{
+    // Only one process at a time can use a session, so the lock is kept until cleanup
+    client->session_cache = mqtt_sn_map_cache_file(path, "session cache", sizeof(session_cache_t), &client->session_cache_fd);
+}
+
+// Restore the topics and message id from the cache, if it was written for the same
+// gateway and client id, and the gateway has been asked to keep the session
+static void mqtt_sn_load_session_cache(mqtt_sn_client_t *client, const char* client_id, uint8_t clean_session)
+{
+    session_cache_t *cache = client->session_cache;
+    char key[sizeof(cache->key)];
+    char host[64] = "";
+    char port[8] = "";
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int i;
+
+    if (getpeername(client->sock, (struct sockaddr*)&addr, &addr_len) == 0) {
+        getnameinfo((struct sockaddr*)&addr, addr_len, host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+    }
+    snprintf(key, sizeof(key), "[%s]:%s %s", host, port, client_id);
+
+    if (clean_session || memcmp(cache->magic, MQTT_SN_SESSION_CACHE_MAGIC, sizeof(cache->magic)) != 0 ||
+            strncmp(cache->key, key, sizeof(cache->key)) != 0) {
+        mqtt_sn_log_debug("Starting new session cache for %s", key);
+        memset(cache, 0, sizeof(session_cache_t));
+        memcpy(cache->magic, MQTT_SN_SESSION_CACHE_MAGIC, sizeof(cache->magic));
+        strcpy(cache->key, key);
+        return;
+    }
+
+    mqtt_sn_log_debug("Loading %d topics from session cache for %s", cache->topic_count, key);
+
+    if (cache->next_message_id) {
+        client->next_message_id = cache->next_message_id;
+    }
+
+    // Detach the cache while loading, so that the topics are not written back to it
+    client->session_cache = NULL;
+    for (i = 0; i < cache->topic_count && i < MQTT_SN_SESSION_CACHE_TOPICS; i++) {
+        cache->topics[i].topic_name[MQTT_SN_MAX_TOPIC_LENGTH] = '\0';
+        mqtt_sn_register_topic(client, cache->topics[i].topic_id, cache->topics[i].topic_name);
+    }
+    client->session_cache = cache;
+}
+
+// Called when the gateway no longer knows a cached topic id, so that the next run registers again
+static void mqtt_sn_clear_session_cache(mqtt_sn_client_t *client)
+{
+    if (client->session_cache && client->session_cache->topic_count) {
+        mqtt_sn_log_debug("Clearing topics in session cache");
+        client->session_cache->topic_count = 0;
+    }
+}
+
+void mqtt_sn_open_gateway_cache(mqtt_sn_client_t *client, const char* path)
+{
+    gateway_cache_t *cache = mqtt_sn_map_cache_file(path, "gateway cache", sizeof(gateway_cache_t), &client->gateway_cache_fd);
+
+    if (memcmp(cache->magic, MQTT_SN_GATEWAY_CACHE_MAGIC, sizeof(cache->magic)) != 0 ||
+            cache->count > MQTT_SN_MAX_GATEWAYS) {
+        memset(cache, 0, sizeof(gateway_cache_t));
+        memcpy(cache->magic, MQTT_SN_GATEWAY_CACHE_MAGIC, sizeof(cache->magic));
+    }
+
+    // Many clients can share the gateways, so it is only locked while being changed
+    flock(client->gateway_cache_fd, LOCK_UN);
+    client->gateways = cache;
+}
+
+static void mqtt_sn_lock_gateways(mqtt_sn_client_t *client, int operation)
+{
+    if (client->gateway_cache_fd >= 0) {
+        flock(client->gateway_cache_fd, operation);
+    }
+}
+
+static void mqtt_sn_remove_gateway(gateway_cache_t *cache, int index)
+{
+    cache->count--;
+    memmove(&cache->gateways[index], &cache->gateways[index + 1], (cache->count - index) * sizeof(gateway_info_t));
+}
+
+static int mqtt_sn_find_gateway(gateway_cache_t *cache, const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+    int i;
+
+    for (i = 0; i < cache->count; i++) {
+        if (cache->gateways[i].addr_len == addr_len && memcmp(&cache->gateways[i].addr, addr, addr_len) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Find the gateway at an address, adding it if it is new
+static gateway_info_t* mqtt_sn_add_gateway(gateway_cache_t *cache, const struct sockaddr_storage *addr, socklen_t addr_len, uint8_t gateway_id)
+{
+    gateway_info_t *gateway;
+    int index = mqtt_sn_find_gateway(cache, addr, addr_len);
+
+    if (index >= 0) {
+        gateway = &cache->gateways[index];
+    } else if (cache->count < MQTT_SN_MAX_GATEWAYS) {
+        gateway = &cache->gateways[cache->count++];
+        memset(gateway, 0, sizeof(gateway_info_t));
+        memcpy(&gateway->addr, addr, addr_len);
+        gateway->addr_len = addr_len;
+        gateway->rtt = UINT32_MAX;
+        gateway->expires = time(NULL) + MQTT_SN_DEFAULT_GATEWAY_LIFETIME;
+    } else {
+        mqtt_sn_log_debug("Ignoring gateway %d, as %d gateways are already known", gateway_id, MQTT_SN_MAX_GATEWAYS);
+        return NULL;
+    }
+
+    gateway->gateway_id = gateway_id;
+    return gateway;
+}
+
+static void mqtt_sn_expire_gateways(gateway_cache_t *cache)
+{
+    time_t now = time(NULL);
+    int i = 0;
+
+    while (i < cache->count) {
+        if (cache->gateways[i].expires <= now) {
+            mqtt_sn_log_debug("Gateway %d has expired", cache->gateways[i].gateway_id);
+            mqtt_sn_remove_gateway(cache, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+// A gateway that advertises is kept for as long as it says it will be before the next ADVERTISE
+static void mqtt_sn_process_advertise(mqtt_sn_client_t *client, const uint8_t *packet, const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+    gateway_info_t *gateway;
+    uint16_t duration = (packet[3] << 8) | packet[4];
+
+    mqtt_sn_log_debug("Received ADVERTISE from gateway %d, duration %d seconds", packet[2], duration);
+
+    mqtt_sn_lock_gateways(client, LOCK_EX);
+    gateway = mqtt_sn_add_gateway(client->gateways, addr, addr_len, packet[2]);
+    if (gateway) {
+        gateway->duration = duration;
+        gateway->expires = time(NULL) + duration;
+    }
+    mqtt_sn_lock_gateways(client, LOCK_UN);
+}
+
+// Called with ADVERTISE packets received from the connected gateway
+static void mqtt_sn_refresh_gateway(mqtt_sn_client_t *client, const uint8_t *packet)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if (client->gateways && packet[0] == 5 && getpeername(client->sock, (struct sockaddr*)&addr, &addr_len) == 0) {
+        mqtt_sn_process_advertise(client, packet, &addr, addr_len);
+    }
+}
+
+// Called when the connected gateway refuses the connection, so that the next run tries another
+static void mqtt_sn_forget_gateway(mqtt_sn_client_t *client)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int index;
+
+    if (client->gateways == NULL || getpeername(client->sock, (struct sockaddr*)&addr, &addr_len) < 0) {
+        return;
+    }
+
+    mqtt_sn_lock_gateways(client, LOCK_EX);
+    index = mqtt_sn_find_gateway(client->gateways, &addr, addr_len);
+    if (index >= 0) {
+        mqtt_sn_log_debug("Forgetting gateway %d", client->gateways->gateways[index].gateway_id);
+        mqtt_sn_remove_gateway(client->gateways, index);
+    }
+    mqtt_sn_lock_gateways(client, LOCK_UN);
+}
+
+// Send SEARCHGW to an address, which can be broadcast or multicast, and collect the
+// GWINFO and ADVERTISE packets received in reply for wait_ms milliseconds.
+// The time taken for each gateway to reply is measured, to choose the nearest one.
+static void mqtt_sn_search_gateways(mqtt_sn_client_t *client, const char* address, const char* port, uint32_t wait_ms)
+{
+    uint8_t searchgw[3] = { 3, MQTT_SN_TYPE_SEARCHGW, MQTT_SN_SEARCHGW_RADIUS };
+    uint8_t buf[MQTT_SN_MAX_PACKET_LENGTH];
+    struct addrinfo hints;
+    struct addrinfo *result;
+    uint64_t sent, deadline;
+    int fd, ret, on = 1, hops = MQTT_SN_SEARCHGW_RADIUS;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    ret = getaddrinfo(address, port, &hints, &result);
+    if (ret != 0) {
+        mqtt_sn_log_err("getaddrinfo: %s", gai_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
+    fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd < 0) {
+        mqtt_sn_log_err("Failed to create socket: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // The radius limits how far a multicast SEARCHGW travels
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+    if (result->ai_family == AF_INET6) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+    } else {
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops));
+    }
+
+    mqtt_sn_log_debug("Sending SEARCHGW packet...");
+    sent = mqtt_sn_monotonic_us();
+    if (sendto(fd, searchgw, sizeof(searchgw), 0, result->ai_addr, result->ai_addrlen) < 0) {
+        mqtt_sn_log_err("Failed to send SEARCHGW packet: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(result);
+
+    deadline = sent + (uint64_t)wait_ms * 1000;
+    while (TRUE) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        uint64_t now = mqtt_sn_monotonic_us();
+        gateway_info_t *gateway;
+        ssize_t len;
+
+        if (now >= deadline) {
+            break;
+        }
+
+        ret = poll(&pfd, 1, (deadline - now + 999) / 1000);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            break;
+        }
+
+        len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&addr, &addr_len);
+        now = mqtt_sn_monotonic_us();
+        if (len < 3 || buf[0] != len) {
+            mqtt_sn_log_debug("Ignoring invalid packet while searching for gateways");
+            continue;
+        }
+
+        if (buf[1] == MQTT_SN_TYPE_GWINFO) {
+            // Replies sent by other clients on behalf of a gateway would not measure the gateway
+            if (len > 3) {
+                mqtt_sn_log_debug("Ignoring GWINFO for gateway %d sent by a client", buf[2]);
+                continue;
+            }
+            mqtt_sn_log_debug("Received GWINFO from gateway %d in %.1f ms", buf[2], (now - sent) / 1000.0);
+            mqtt_sn_lock_gateways(client, LOCK_EX);
+            gateway = mqtt_sn_add_gateway(client->gateways, &addr, addr_len, buf[2]);
+            if (gateway) {
+                gateway->rtt = now - sent;
+            }
+            mqtt_sn_lock_gateways(client, LOCK_UN);
+        } else if (buf[1] == MQTT_SN_TYPE_ADVERTISE && len == 5) {
+            mqtt_sn_process_advertise(client, buf, &addr, addr_len);
+        } else {
+            mqtt_sn_log_debug("Ignoring %s packet while searching for gateways", mqtt_sn_type_string(buf[1]));
+        }
+    }
+
+    close(fd);
+}
+
+// The gateway that replied fastest, or the first one that advertised if none replied
+static int mqtt_sn_select_gateway(gateway_cache_t *cache)
+{
+    int best = -1;
+    int i;
+
+    for (i = 0; i < cache->count; i++) {
+        if (best < 0 || cache->gateways[i].rtt < cache->gateways[best].rtt) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+// Connect to the best known gateway, searching for gateways if none are known
+int mqtt_sn_discover_gateway(mqtt_sn_client_t *client, const char* address, const char* port, uint16_t source_port, uint32_t wait_ms)
+{
+    char host[NI_MAXHOST] = "";
+    char service[NI_MAXSERV] = "";
+    gateway_info_t gateway;
+    int index;
+
+    if (client->gateways == NULL) {
+        client->gateways = calloc(1, sizeof(gateway_cache_t));
+        if (client->gateways == NULL) {
+            mqtt_sn_log_err("Failed to allocate memory for gateways");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    mqtt_sn_lock_gateways(client, LOCK_EX);
+    mqtt_sn_expire_gateways(client->gateways);
+    mqtt_sn_lock_gateways(client, LOCK_UN);
+
+    if (client->gateways->count == 0) {
+        mqtt_sn_search_gateways(client, address, port, wait_ms);
+    } else {
+        mqtt_sn_log_debug("Using %d cached gateways", client->gateways->count);
+    }
+
+    mqtt_sn_lock_gateways(client, LOCK_SH);
+    index = mqtt_sn_select_gateway(client->gateways);
+    if (index >= 0) {
+        gateway = client->gateways->gateways[index];
+    }
+    mqtt_sn_lock_gateways(client, LOCK_UN);
+
+    if (index < 0) {
+        mqtt_sn_log_err("No MQTT-SN gateways found.");
+        exit(EXIT_FAILURE);
+    }
+
+    getnameinfo((struct sockaddr*)&gateway.addr, gateway.addr_len, host, sizeof(host), service, sizeof(service),
+                NI_NUMERICHOST | NI_NUMERICSERV);
+    mqtt_sn_log_debug("Selected gateway %d at %s port %s", gateway.gateway_id, host, service);
+
+    return mqtt_sn_create_socket(client, host, service, source_port);
+}
+
+void mqtt_sn_cleanup(mqtt_sn_client_t *client)
+{
+    topic_arena_block_t *block = client->topics.arena;
+    int i;
+
+    // Free the blocks of topic names, then the hash tables
+    while (block) {
+        topic_arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(client->topics.entries);
+    free(client->topics.name_index);
+    memset(&client->topics, 0, sizeof(client->topics));
+
+    if (client->session_cache) {
+        client->session_cache->next_message_id = client->next_message_id;
+        munmap(client->session_cache, sizeof(session_cache_t));
+        close(client->session_cache_fd);
+        client->session_cache = NULL;
+    }
+
+    if (client->gateway_cache_fd >= 0) {
+        munmap(client->gateways, sizeof(gateway_cache_t));
+        close(client->gateway_cache_fd);
+        client->gateway_cache_fd = -1;
+    } else {
+        free(client->gateways);
+    }
+    client->gateways = NULL;
+
+    for (i = 0; i < MQTT_SN_MAX_INFLIGHT; i++) {
+        free(client->inflight[i].buffer);
+    }
+    memset(client->inflight, 0, sizeof(client->inflight));
+    client->inflight_count = 0;
+
+    free(client->request_buffer);
+    client->request_buffer = client->request = NULL;
+    client->request_buffer_size = 0;
+
+    free(client->packet_buffer);
+    client->packet_buffer = NULL;
+    client->packet_buffer_size = 0;
+
+    for (i = 0; i < MQTT_SN_MAX_REASSEMBLY; i++) {
+        mqtt_sn_free_reassembly(client, &client->reassembly[i]);
+    }
+
+    free(client->batch);
+    client->batch = NULL;
+    client->batch_count = 0;
+
+    free(client->receive_ring);
+    free(client->receive_buffer);
+    client->receive_ring = NULL;
+    client->receive_buffer = NULL;
+    client->receive_count = 0;
+    client->receive_next = 0;
+
+    if (client->loop) {
+        mqtt_sn_event_loop_cleanup(client->loop);
+        free(client->loop);
+        client->loop = NULL;
+    }
+}
+
+
+uint8_t mqtt_sn_enable_frwdencap(mqtt_sn_client_t *client)
+{
+    return client->forwarder_encapsulation = TRUE;
+}
+
+
+uint8_t mqtt_sn_disable_frwdencap(mqtt_sn_client_t *client)
+{
+    return client->forwarder_encapsulation = FALSE;
+}
+
+
+void mqtt_sn_set_frwdencap_parameters(mqtt_sn_client_t *client, const uint8_t *wlnid, uint8_t wlnid_len)
+{
+    client->wireless_node_id = wlnid;
+    client->wireless_node_id_len = wlnid_len;
+}
+
+
+size_t mqtt_sn_build_frwdencap_header(frwdencap_header_t *header, const uint8_t *wireless_node_id, uint8_t wireless_node_id_len)
+{
+    // Check that it isn't too long
+    if (wireless_node_id_len > MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH) {
+        mqtt_sn_log_err("Wireless node id is longer than %d", MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH);
+        exit(EXIT_FAILURE);
+    }
+
+    header->type = MQTT_SN_TYPE_FRWDENCAP;
+    header->ctrl = 0;
+
+    // Generate a Wireless Node ID if none given
+    if (wireless_node_id == NULL || wireless_node_id_len == 0) {
+        // A null character is automatically appended after the content written.
+        snprintf((char*)header->wireless_node_id, sizeof(header->wireless_node_id)-1, "%X", getpid());
+        wireless_node_id_len = strlen((char*)header->wireless_node_id);
+    } else {
+        memcpy(header->wireless_node_id, wireless_node_id, wireless_node_id_len);
+    }
+
+    header->length = wireless_node_id_len + 3;
+
+    if (debug > 2) {
+        char wlnd[MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH * 2 + 1];
+        char* buf_ptr = wlnd;
+        int i;
+        for (i = 0; i < wireless_node_id_len; i++) {
+            buf_ptr += sprintf(buf_ptr, "%02X", header->wireless_node_id[i]);
+        }
+        *buf_ptr = '\0';
+
+        mqtt_sn_log_debug("Node id: 0x%s, N. id len: %d, Header len: %d",
+                          wlnd, wireless_node_id_len, header->length);
+    }
+
+    return header->length;
+}
+
+
+void mqtt_sn_event_loop_init(mqtt_sn_event_loop_t *loop)
+{
+    memset(loop, 0, sizeof(mqtt_sn_event_loop_t));
+
+#ifdef __linux__
+    {
+        struct epoll_event event;
+
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd < 0) {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+
+        // A single timerfd is armed for whichever timer expires first
+        loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (loop->timerfd < 0) {
+            perror("timerfd_create");
+            exit(EXIT_FAILURE);
+        }
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = loop->timerfd;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &event) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+}
+
+void mqtt_sn_event_loop_cleanup(mqtt_sn_event_loop_t *loop)
+{
+    uint32_t i;
+
+    for (i = 0; i < loop->timer_count; i++) {
+        loop->timers[i]->heap_index = 0;
+    }
+
+#ifdef __linux__
+    close(loop->timerfd);
+    close(loop->epfd);
+#else
+    free(loop->pollfds);
+#endif
+
+    free(loop->watches);
+    free(loop->timers);
+    memset(loop, 0, sizeof(mqtt_sn_event_loop_t));
+}
+
+void mqtt_sn_event_watch(mqtt_sn_event_loop_t *loop, int fd, mqtt_sn_event_handler_t handler, void *data)
+{
+    uint8_t existing;
+
+    if (fd < 0) {
+        mqtt_sn_log_err("Can not watch an invalid file descriptor");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fd >= loop->watches_size) {
+        int size = loop->watches_size ? loop->watches_size : 16;
+        while (size <= fd) {
+            size *= 2;
+        }
+        loop->watches = realloc(loop->watches, size * sizeof(mqtt_sn_event_watch_t));
+        if (!loop->watches) {
+            mqtt_sn_log_err("Failed to allocate memory for event loop");
+            exit(EXIT_FAILURE);
+        }
+        memset(&loop->watches[loop->watches_size], 0, (size - loop->watches_size) * sizeof(mqtt_sn_event_watch_t));
+        loop->watches_size = size;
+    }
+
+    existing = (loop->watches[fd].handler != NULL);
+    loop->watches[fd].handler = handler;
+    loop->watches[fd].data = data;
+    if (existing) {
+        return;
+    }
+    loop->watch_count++;
+
+#ifdef __linux__
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+#else
+    loop->pollfds_dirty = TRUE;
+#endif
+}
+
+// Must be called before the file descriptor is closed
+void mqtt_sn_event_unwatch(mqtt_sn_event_loop_t *loop, int fd)
+{
+    if (fd < 0 || fd >= loop->watches_size || loop->watches[fd].handler == NULL) {
+        return;
+    }
+
+    loop->watches[fd].handler = NULL;
+    loop->watches[fd].write_handler = NULL;
+    loop->watches[fd].data = NULL;
+    loop->watch_count--;
+
+#ifdef __linux__
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    loop->pollfds_dirty = TRUE;
+#endif
 }
 
-void mqtt_sn_print_publish_packet(publish_packet_t* packet)
+// Also call a handler, with the same data, whenever a watched file descriptor can be
+// written to. Pass NULL to stop, which should be done as soon as there is nothing to write.
+void mqtt_sn_event_watch_write(mqtt_sn_event_loop_t *loop, int fd, mqtt_sn_event_handler_t handler)
 {
-    if (verbose) {
-        int topic_type = packet->flags & 0x3;
-        int topic_id = ntohs(packet->topic_id);
-        if (verbose == 2) {
-            time_t rcv_time;
-            char tm_buffer [40];
-            time(&rcv_time) ;
-            strftime(tm_buffer, 40, "%F %T ", localtime(&rcv_time));
-            fputs(tm_buffer, stdout);
-        }
-        switch (topic_type) {
-            case MQTT_SN_TOPIC_TYPE_NORMAL: {
-                const char *topic_name = mqtt_sn_lookup_topic(topic_id);
-                if (topic_name) {
-                    printf("%s: %s\n", topic_name, packet->data);
-                }
-                break;
-            };
-            case MQTT_SN_TOPIC_TYPE_PREDEFINED: {
-                printf("%4.4x: %s\n", topic_id, packet->data);
-                break;
-            };
-            case MQTT_SN_TOPIC_TYPE_SHORT: {
-                const char *str = (const char*)&packet->topic_id;
-                printf("%c%c: %s\n", str[0], str[1], packet->data);
-                break;
-            };
+    if (fd < 0 || fd >= loop->watches_size || loop->watches[fd].handler == NULL) {
+        mqtt_sn_log_err("Can not watch an unwatched file descriptor for writing");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((loop->watches[fd].write_handler == NULL) == (handler == NULL)) {
+        loop->watches[fd].write_handler = handler;
+        return;
+    }
+    loop->watches[fd].write_handler = handler;
+
+#ifdef __linux__
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = handler ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &event) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
         }
-    } else {
-        printf("%s\n", packet->data);
     }
-    fflush(stdout);
+#else
+    loop->pollfds_dirty = TRUE;
+#endif
 }
 
-uint16_t mqtt_sn_receive_suback(int sock)
+static void mqtt_sn_timer_swap(mqtt_sn_event_loop_t *loop, uint32_t a, uint32_t b)
 {
-    suback_packet_t *packet = mqtt_sn_wait_for(MQTT_SN_TYPE_SUBACK, sock);
-    uint16_t received_message_id, received_topic_id;
+    mqtt_sn_timer_t *timer = loop->timers[a - 1];
+    loop->timers[a - 1] = loop->timers[b - 1];
+    loop->timers[b - 1] = timer;
+    loop->timers[a - 1]->heap_index = a;
+    loop->timers[b - 1]->heap_index = b;
+}
 
-    if (packet == NULL) {
-        mqtt_sn_log_err("Failed to subscribe to topic.");
-        exit(EXIT_FAILURE);
+static void mqtt_sn_timer_sift(mqtt_sn_event_loop_t *loop, uint32_t i)
+{
+    // Move towards the root while earlier than the parent
+    while (i > 1 && loop->timers[i - 1]->deadline < loop->timers[i / 2 - 1]->deadline) {
+        mqtt_sn_timer_swap(loop, i, i / 2);
+        i /= 2;
     }
 
-    // Check Suback return code
-    mqtt_sn_log_debug("SUBACK return code: 0x%2.2x", packet->return_code);
+    // Move towards the leaves while later than either child
+    while (TRUE) {
+        uint32_t earliest = i;
+        uint32_t left = i * 2;
+        uint32_t right = left + 1;
 
-    if (packet->return_code) {
-        mqtt_sn_log_err("SUBSCRIBE error: %s", mqtt_sn_return_code_string(packet->return_code));
-        exit(packet->return_code);
+        if (left <= loop->timer_count && loop->timers[left - 1]->deadline < loop->timers[earliest - 1]->deadline) {
+            earliest = left;
+        }
+        if (right <= loop->timer_count && loop->timers[right - 1]->deadline < loop->timers[earliest - 1]->deadline) {
+            earliest = right;
+        }
+        if (earliest == i) {
+            break;
+        }
+        mqtt_sn_timer_swap(loop, i, earliest);
+        i = earliest;
     }
+}
 
-    // Check that the Message ID matches
-    received_message_id = ntohs(packet->message_id);
-    if (received_message_id != next_message_id-1) {
-        mqtt_sn_log_warn("Message id in SUBACK does not equal message id sent");
-        mqtt_sn_log_debug("  Expecting: %d", next_message_id-1);
-        mqtt_sn_log_debug("  Actual: %d", received_message_id);
-    }
+void mqtt_sn_timer_init(mqtt_sn_timer_t *timer, mqtt_sn_event_handler_t handler, void *data)
+{
+    memset(timer, 0, sizeof(mqtt_sn_timer_t));
+    timer->handler = handler;
+    timer->data = data;
+}
 
-    // Return the topic ID returned by the gateway
-    received_topic_id = ntohs(packet->topic_id);
-    mqtt_sn_log_debug("SUBACK topic id: 0x%4.4x", received_topic_id);
+// Starts the timer, or moves its deadline if it is already running
+void mqtt_sn_timer_start(mqtt_sn_event_loop_t *loop, mqtt_sn_timer_t *timer, uint32_t delay_ms)
+{
+    timer->deadline = mqtt_sn_monotonic_ms() + delay_ms;
+    timer->started_iteration = loop->iteration;
+
+    if (timer->heap_index == 0) {
+        if (loop->timer_count == loop->timer_size) {
+            loop->timer_size = loop->timer_size ? loop->timer_size * 2 : 16;
+            loop->timers = realloc(loop->timers, loop->timer_size * sizeof(mqtt_sn_timer_t*));
+            if (!loop->timers) {
+                mqtt_sn_log_err("Failed to allocate memory for timers");
+                exit(EXIT_FAILURE);
+            }
+        }
+        loop->timers[loop->timer_count++] = timer;
+        timer->heap_index = loop->timer_count;
+    }
 
-    return received_topic_id;
+    mqtt_sn_timer_sift(loop, timer->heap_index);
 }
 
-int mqtt_sn_select(int sock)
+void mqtt_sn_timer_stop(mqtt_sn_event_loop_t *loop, mqtt_sn_timer_t *timer)
 {
-    struct timeval tv;
-    fd_set rfd;
-    int ret;
-
-    FD_ZERO(&rfd);
-    FD_SET(sock, &rfd);
+    uint32_t i = timer->heap_index;
 
-    tv.tv_sec = timeout;
-    tv.tv_usec = 0;
+    if (i == 0) {
+        return;
+    }
 
-    ret = select(sock + 1, &rfd, NULL, NULL, &tv);
-    if (ret < 0 && errno != EINTR) {
-        // Something is wrong.
-        perror("select");
-        exit(EXIT_FAILURE);
+    if (i != loop->timer_count) {
+        mqtt_sn_timer_swap(loop, i, loop->timer_count);
     }
+    loop->timer_count--;
+    timer->heap_index = 0;
 
-    return ret;
+    if (i <= loop->timer_count) {
+        mqtt_sn_timer_sift(loop, i);
+    }
 }
 
-void* mqtt_sn_wait_for(uint8_t type, int sock)
+// Waits for up to timeout_ms (or forever if negative) and then calls the
+// handlers of readable file descriptors and expired timers.
+// Returns the number of handlers called, or -1 with errno set on failure.
+int mqtt_sn_event_loop_run_once(mqtt_sn_event_loop_t *loop, int timeout_ms)
 {
-    time_t started_waiting = time(NULL);
-
-    while(TRUE) {
-        time_t now = time(NULL);
-        int ret;
+    uint64_t now = mqtt_sn_monotonic_ms();
+    int dispatched = 0;
+    int ready, i;
+
+    loop->iteration++;
+
+#ifdef __linux__
+    {
+        struct epoll_event events[MQTT_SN_MAX_EVENTS];
+
+        if (loop->timer_count > 0 && loop->timers[0]->deadline != loop->timerfd_deadline) {
+            uint64_t deadline = loop->timers[0]->deadline;
+            struct itimerspec its;
+
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = deadline / 1000;
+            its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+            if (timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+                perror("timerfd_settime");
+                exit(EXIT_FAILURE);
+            }
+            loop->timerfd_deadline = deadline;
+        }
 
-        // Time to send a ping?
-        if (keep_alive > 0 && (now - last_transmit) >= keep_alive) {
-            mqtt_sn_send_pingreq(sock);
+        ready = epoll_wait(loop->epfd, events, MQTT_SN_MAX_EVENTS, timeout_ms);
+        if (ready < 0) {
+            return -1;
         }
 
-        ret = mqtt_sn_select(sock);
-        if (ret < 0) {
-            break;
-        } else if (ret > 0) {
-            char* packet = mqtt_sn_receive_packet(sock);
-            if (packet) {
-                switch(packet[1]) {
-                    case MQTT_SN_TYPE_PUBLISH:
-                        mqtt_sn_print_publish_packet((publish_packet_t *)packet);
-                        break;
+        for (i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
 
-                    case MQTT_SN_TYPE_REGISTER:
-                        mqtt_sn_process_register(sock, (register_packet_t*)packet);
-                        break;
+            if (fd == loop->timerfd) {
+                uint64_t expirations;
+                if (read(loop->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    perror("read timerfd");
+                }
+                loop->timerfd_deadline = 0;
+            } else {
+                // Handlers may remove watches, so look each one up again
+                if ((events[i].events & ~EPOLLOUT) && fd < loop->watches_size && loop->watches[fd].handler) {
+                    loop->watches[fd].handler(loop->watches[fd].data);
+                    dispatched++;
+                }
+                if ((events[i].events & EPOLLOUT) && fd < loop->watches_size && loop->watches[fd].write_handler) {
+                    loop->watches[fd].write_handler(loop->watches[fd].data);
+                    dispatched++;
+                }
+            }
+        }
+    }
+#else
+    {
+        int nfds = loop->watch_count;
+
+        if (loop->pollfds_dirty) {
+            int fd, n = 0;
+
+            if (loop->pollfds_size < nfds) {
+                loop->pollfds = realloc(loop->pollfds, nfds * sizeof(struct pollfd));
+                if (!loop->pollfds) {
+                    mqtt_sn_log_err("Failed to allocate memory for event loop");
+                    exit(EXIT_FAILURE);
+                }
+                loop->pollfds_size = nfds;
+            }
+            for (fd = 0; fd < loop->watches_size; fd++) {
+                if (loop->watches[fd].handler) {
+                    loop->pollfds[n].fd = fd;
+                    loop->pollfds[n].events = loop->watches[fd].write_handler ? POLLIN | POLLOUT : POLLIN;
+                    n++;
+                }
+            }
+            loop->pollfds_dirty = FALSE;
+        }
 
-                    case MQTT_SN_TYPE_PINGRESP:
-                        // do nothing
-                        break;
+        // Don't sleep past the next timer
+        if (loop->timer_count > 0) {
+            uint64_t deadline = loop->timers[0]->deadline;
+            uint64_t until = deadline > now ? deadline - now : 0;
+            if (until > INT32_MAX) {
+                until = INT32_MAX;
+            }
+            if (timeout_ms < 0 || until < timeout_ms) {
+                timeout_ms = until;
+            }
+        }
 
-                    case MQTT_SN_TYPE_DISCONNECT:
-                        if (type != MQTT_SN_TYPE_DISCONNECT) {
-                            mqtt_sn_log_warn("Received DISCONNECT from gateway.");
-                            exit(EXIT_FAILURE);
-                        }
-                        break;
+        ready = poll(loop->pollfds, nfds, timeout_ms);
+        if (ready < 0) {
+            return -1;
+        }
 
-                    default:
-                        if (packet[1] != type) {
-                            mqtt_sn_log_warn(
-                                "Was expecting %s packet but received: %s",
-                                mqtt_sn_type_string(type),
-                                mqtt_sn_type_string(packet[1])
-                            );
-                        }
-                        break;
-                }
+        for (i = 0; i < nfds && ready > 0; i++) {
+            int fd = loop->pollfds[i].fd;
 
-                // Did we find what we were looking for?
-                if (packet[1] == type) {
-                    return packet;
-                }
+            if (loop->pollfds[i].revents == 0) {
+                continue;
             }
-        }
+            ready--;
 
-        // Check for receive timeout
-        if (keep_alive > 0 && (now - last_receive) >= (keep_alive * 1.5)) {
-            mqtt_sn_log_err("Keep alive error: timed out while waiting for a %s from gateway.", mqtt_sn_type_string(type));
-            exit(EXIT_FAILURE);
+            if (loop->pollfds[i].revents & POLLNVAL) {
+                continue;
+            }
+
+            // Handlers may remove watches, so look each one up again
+            if ((loop->pollfds[i].revents & ~POLLOUT) && fd < loop->watches_size && loop->watches[fd].handler) {
+                loop->watches[fd].handler(loop->watches[fd].data);
+                dispatched++;
+            }
+            if ((loop->pollfds[i].revents & POLLOUT) && fd < loop->watches_size && loop->watches[fd].write_handler) {
+                loop->watches[fd].write_handler(loop->watches[fd].data);
+                dispatched++;
+            }
         }
+    }
+#endif
 
-        // Check if we have timed out waiting for the packet we are looking for
-        if ((now - started_waiting) >= timeout) {
-            mqtt_sn_log_debug("Timed out while waiting for a %s from gateway.", mqtt_sn_type_string(type));
+    // Timers started by a handler during this call run on the next call
+    now = mqtt_sn_monotonic_ms();
+    while (loop->timer_count > 0) {
+        mqtt_sn_timer_t *timer = loop->timers[0];
+        if (timer->deadline > now || timer->started_iteration == loop->iteration) {
             break;
         }
+        mqtt_sn_timer_stop(loop, timer);
+        timer->handler(timer->data);
+        dispatched++;
     }
 
-    return NULL;
+    return dispatched;
 }
 
-const char* mqtt_sn_type_string(uint8_t type)
+
+// Each thread formats its log messages into its own ring buffer, which a
+// background thread writes to stderr. Only the writing thread moves the
+// tail and only the owning thread moves the head, so no locks are needed.
+typedef struct mqtt_sn_log_ring {
+    char data[MQTT_SN_LOG_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    volatile uint8_t busy;
+    time_t cached_second;
+    char cached_prefix[24];
+    struct mqtt_sn_log_ring *next;
+} mqtt_sn_log_ring_t;
+
+static mqtt_sn_log_ring_t *log_rings = NULL;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_writer_once = PTHREAD_ONCE_INIT;
+static __thread mqtt_sn_log_ring_t *log_ring = NULL;
+
+// Write everything waiting in the ring buffers to stderr
+static void mqtt_sn_log_drain()
 {
-    switch(type) {
-        case MQTT_SN_TYPE_ADVERTISE:
-            return "ADVERTISE";
-        case MQTT_SN_TYPE_SEARCHGW:
-            return "SEARCHGW";
-        case MQTT_SN_TYPE_GWINFO:
-            return "GWINFO";
-        case MQTT_SN_TYPE_CONNECT:
-            return "CONNECT";
-        case MQTT_SN_TYPE_CONNACK:
-            return "CONNACK";
-        case MQTT_SN_TYPE_WILLTOPICREQ:
-            return "WILLTOPICREQ";
-        case MQTT_SN_TYPE_WILLTOPIC:
-            return "WILLTOPIC";
-        case MQTT_SN_TYPE_WILLMSGREQ:
-            return "WILLMSGREQ";
-        case MQTT_SN_TYPE_WILLMSG:
-            return "WILLMSG";
-        case MQTT_SN_TYPE_REGISTER:
-            return "REGISTER";
-        case MQTT_SN_TYPE_REGACK:
-            return "REGACK";
-        case MQTT_SN_TYPE_PUBLISH:
-            return "PUBLISH";
-        case MQTT_SN_TYPE_PUBACK:
-            return "PUBACK";
-        case MQTT_SN_TYPE_PUBCOMP:
-            return "PUBCOMP";
-        case MQTT_SN_TYPE_PUBREC:
-            return "PUBREC";
-        case MQTT_SN_TYPE_PUBREL:
-            return "PUBREL";
-        case MQTT_SN_TYPE_SUBSCRIBE:
-            return "SUBSCRIBE";
-        case MQTT_SN_TYPE_SUBACK:
-            return "SUBACK";
-        case MQTT_SN_TYPE_UNSUBSCRIBE:
-            return "UNSUBSCRIBE";
-        case MQTT_SN_TYPE_UNSUBACK:
-            return "UNSUBACK";
-        case MQTT_SN_TYPE_PINGREQ:
-            return "PINGREQ";
-        case MQTT_SN_TYPE_PINGRESP:
-            return "PINGRESP";
-        case MQTT_SN_TYPE_DISCONNECT:
-            return "DISCONNECT";
-        case MQTT_SN_TYPE_WILLTOPICUPD:
-            return "WILLTOPICUPD";
-        case MQTT_SN_TYPE_WILLTOPICRESP:
-            return "WILLTOPICRESP";
-        case MQTT_SN_TYPE_WILLMSGUPD:
-            return "WILLMSGUPD";
-        case MQTT_SN_TYPE_WILLMSGRESP:
-            return "WILLMSGRESP";
-        case MQTT_SN_TYPE_FRWDENCAP:
-            return "FRWDENCAP";
-        default:
-            return "UNKNOWN";
+    mqtt_sn_log_ring_t *ring;
+
+    pthread_mutex_lock(&log_drain_lock);
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = ring->tail;
+
+        while (tail != head) {
+            uint32_t offset = tail % MQTT_SN_LOG_RING_SIZE;
+            uint32_t len = head - tail;
+            struct iovec iov[2];
+            int iovcnt = 1;
+            ssize_t written;
+
+            iov[0].iov_base = &ring->data[offset];
+            iov[0].iov_len = len;
+            if (offset + len > MQTT_SN_LOG_RING_SIZE) {
+                iov[0].iov_len = MQTT_SN_LOG_RING_SIZE - offset;
+                iov[1].iov_base = ring->data;
+                iov[1].iov_len = len - iov[0].iov_len;
+                iovcnt = 2;
+            }
+
+            written = writev(STDERR_FILENO, iov, iovcnt);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            } else if (written <= 0) {
+                // Nowhere to write to, so throw the messages away
+                written = len;
+            }
+            tail += written;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&log_drain_lock);
 }
 
-const char* mqtt_sn_return_code_string(uint8_t return_code)
+static void* mqtt_sn_log_writer(void *data)
 {
-    switch(return_code) {
-        case MQTT_SN_ACCEPTED:
-            return "Accepted";
-        case MQTT_SN_REJECTED_CONGESTION:
-            return "Rejected: congestion";
-        case MQTT_SN_REJECTED_INVALID:
-            return "Rejected: invalid topic ID";
-        case MQTT_SN_REJECTED_NOT_SUPPORTED:
-            return "Rejected: not supported";
-        default:
-            return "Rejected: unknown reason";
+    while (TRUE) {
+        struct timespec ts = { 0, MQTT_SN_LOG_FLUSH_INTERVAL * 1000000L };
+        nanosleep(&ts, NULL);
+        mqtt_sn_log_drain();
     }
+
+    return NULL;
 }
 
-void mqtt_sn_cleanup()
+static void mqtt_sn_log_start_writer()
 {
-    topic_map_t *ptr = topic_map;
-    topic_map_t *ptr2 = NULL;
-
-    // Walk through the topic map, deleting each entry
-    while (ptr) {
-        ptr2 = ptr;
-        ptr = ptr->next;
-        free(ptr2);
+    pthread_t thread;
+    sigset_t all, previous;
+
+    // Make sure that signals are delivered to the program's own threads
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    if (pthread_create(&thread, NULL, mqtt_sn_log_writer, NULL) == 0) {
+        pthread_detach(thread);
     }
-    topic_map = NULL;
-}
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
 
-
-uint8_t mqtt_sn_enable_frwdencap()
-{
-    return forwarder_encapsulation = TRUE;
+    atexit(mqtt_sn_log_drain);
 }
 
-
-uint8_t mqtt_sn_disable_frwdencap()
+static mqtt_sn_log_ring_t* mqtt_sn_log_thread_ring()
 {
-    return forwarder_encapsulation = FALSE;
-}
+    if (log_ring == NULL) {
+        mqtt_sn_log_ring_t *ring = calloc(1, sizeof(mqtt_sn_log_ring_t));
+        if (!ring) {
+            return NULL;
+        }
 
+        pthread_mutex_lock(&log_rings_lock);
+        ring->next = log_rings;
+        __atomic_store_n(&log_rings, ring, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&log_rings_lock);
 
-void mqtt_sn_set_frwdencap_parameters(const uint8_t *wlnid, uint8_t wlnid_len)
-{
-    wireless_node_id = wlnid;
-    wireless_node_id_len = wlnid_len;
-}
+        pthread_once(&log_writer_once, mqtt_sn_log_start_writer);
+        log_ring = ring;
+    }
 
+    return log_ring;
+}
 
-frwdencap_packet_t* mqtt_sn_create_frwdencap_packet(const void *data, size_t *len, const uint8_t *wireless_node_id, uint8_t wireless_node_id_len)
+static void mqtt_sn_log_msg(const char* level, const char* format, va_list arglist)
 {
-    frwdencap_packet_t* packet = NULL;
-
-    // Check that it isn't too long
-    if (wireless_node_id_len > MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH) {
-        mqtt_sn_log_err("Wireless node id is longer than %d", MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH);
-        exit(EXIT_FAILURE);
+    mqtt_sn_log_ring_t *ring = mqtt_sn_log_thread_ring();
+    char line[MQTT_SN_LOG_MAX_LINE];
+    time_t now = time(NULL);
+    int len = 0;
+
+    // Only format the date and time when the second changes
+    if (ring == NULL || ring->cached_second != now) {
+        struct tm tm;
+        char *prefix = ring ? ring->cached_prefix : line;
+        strftime(prefix, 24, "%F %T ", localtime_r(&now, &tm));
+        if (ring) {
+            ring->cached_second = now;
+        }
     }
-
-    // Allocates a block of memory for an array of num elements, each of them size bytes long,
-    // and initializes all its bits to zero.
-    packet = malloc(sizeof(frwdencap_packet_t));
-    packet->type = MQTT_SN_TYPE_FRWDENCAP;
-    packet->ctrl = 0;
-
-    // Generate a Wireless Node ID if none given
-    if (wireless_node_id == NULL || wireless_node_id_len == 0) {
-        // A null character is automatically appended after the content written.
-        snprintf((char*)packet->wireless_node_id, sizeof(packet->wireless_node_id)-1, "%X", getpid());
-        wireless_node_id_len = strlen((char*)packet->wireless_node_id);
+    if (ring) {
+        len = strlen(ring->cached_prefix);
+        memcpy(line, ring->cached_prefix, len);
     } else {
-        memcpy(packet->wireless_node_id, wireless_node_id, wireless_node_id_len);
+        len = strlen(line);
     }
 
-    packet->length = wireless_node_id_len + 3;
-
-    // Copy mqtt-sn packet into forwarder encapsulation packet
-    memcpy(&(packet->wireless_node_id[wireless_node_id_len]), data, ((uint8_t*)data)[0]);
-
-    // Set new packet length to send
-    *len = packet->length + ((uint8_t*)data)[0];
-
-    if (debug > 2) {
-        char wlnd[65];
-        char* buf_ptr = wlnd;
-        int i;
-        for (i = 0; i < wireless_node_id_len; i++) {
-            buf_ptr += sprintf(buf_ptr, "%02X", packet->wireless_node_id[i]);
-        }
-        *(++buf_ptr) = '\0';
-
-        mqtt_sn_log_debug("Node id: 0x%s, N. id len: %d, Wrapped packet len: %d, Total len: %lu",
-                          wlnd, wireless_node_id_len, ((uint8_t*)data)[0], (long unsigned int)*len);
+    len += snprintf(line + len, sizeof(line) - len, "%s", level);
+    len += vsnprintf(line + len, sizeof(line) - len, format, arglist);
+    if (len > (int)sizeof(line) - 1) {
+        len = sizeof(line) - 1;
     }
+    line[len++] = '\n';
 
-    return packet;
-}
+    if (ring == NULL || ring->busy) {
+        // Called from a signal handler while this thread was already logging
+        if (write(STDERR_FILENO, line, len) < 0) {
+            return;
+        }
+    } else {
+        uint32_t head = ring->head;
+        uint32_t offset = head % MQTT_SN_LOG_RING_SIZE;
 
+        ring->busy = TRUE;
 
-static void mqtt_sn_log_msg(const char* level, const char* format, va_list arglist)
-{
-    time_t mqtt_sn_log_time;
-    char tm_buffer[40];
+        // When the ring is full, write it out straight away
+        if (MQTT_SN_LOG_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < (uint32_t)len) {
+            mqtt_sn_log_drain();
+        }
 
-    time(&mqtt_sn_log_time);
-    strftime(tm_buffer, sizeof(tm_buffer), "%F %T ", localtime(&mqtt_sn_log_time));
+        if (offset + len > MQTT_SN_LOG_RING_SIZE) {
+            memcpy(&ring->data[offset], line, MQTT_SN_LOG_RING_SIZE - offset);
+            memcpy(ring->data, line + (MQTT_SN_LOG_RING_SIZE - offset), len - (MQTT_SN_LOG_RING_SIZE - offset));
+        } else {
+            memcpy(&ring->data[offset], line, len);
+        }
+        __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
 
-    fputs(tm_buffer, stderr);
-    fputs(level, stderr);
-    vfprintf(stderr, format, arglist);
-    fputs("\n", stderr);
+        ring->busy = FALSE;
+    }
 }
 
+#ifndef NDEBUG
 void mqtt_sn_log_debug(const char * format, ...)
 {
     if (debug) {
@@ -1102,13 +3928,17 @@ void mqtt_sn_log_debug(const char * format, ...)
         va_end(arglist);
     }
 }
+#endif
 
+// Warnings and errors are written out straight away, so that they are not
+// delayed or reordered with anything else that is written to stderr
 void mqtt_sn_log_warn(const char * format, ...)
 {
     va_list arglist;
     va_start(arglist, format);
     mqtt_sn_log_msg("WARN  ", format, arglist);
     va_end(arglist);
+    mqtt_sn_log_flush();
 }
 
 void mqtt_sn_log_err(const char * format, ...)
@@ -1117,4 +3947,20 @@ void mqtt_sn_log_err(const char * format, ...)
     va_start(arglist, format);
     mqtt_sn_log_msg("ERROR ", format, arglist);
     va_end(arglist);
+    mqtt_sn_log_flush();
+}
+
+void mqtt_sn_log_flush()
+{
+    if (log_ring && log_ring->busy) {
+        return;
+    }
+
+    if (log_ring) {
+        log_ring->busy = TRUE;
+    }
+    mqtt_sn_log_drain();
+    if (log_ring) {
+        log_ring->busy = FALSE;
+    }
 }
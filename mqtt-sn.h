@@ -22,6 +22,16 @@
   WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifndef __linux__
+#include <poll.h>
+#endif
 
 #ifndef MQTT_SN_H
 #define MQTT_SN_H
@@ -35,14 +45,45 @@
 #endif
 
 #define MQTT_SN_DEFAULT_PORT       "1883"
-#define MQTT_SN_DEFAULT_TIMEOUT    (10)
+#define MQTT_SN_DEFAULT_TIMEOUT    (10000)
 #define MQTT_SN_DEFAULT_KEEP_ALIVE (10)
-
+#define MQTT_SN_DEFAULT_BATCH_LATENCY (50)
+#define MQTT_SN_DEFAULT_RETRIES    (3)
+
+// Bounds on the retransmission timeout, in milliseconds
+#define MQTT_SN_INITIAL_RTO        (1000)
+#define MQTT_SN_MIN_RTO            (50)
+#define MQTT_SN_MAX_RTO            (60000)
+
+// With an adaptive rate, PUBLISH packets are paced at no less than MQTT_SN_MIN_RATE per second.
+// The rate halves when the gateway is congested, and otherwise grows by 1/MQTT_SN_RATE_INCREASE
+// of the maximum rate each second.
+#define MQTT_SN_MIN_RATE           (1.0)
+#define MQTT_SN_RATE_INCREASE      (20)
+
+// Packets longer than MQTT_SN_MAX_PACKET_LENGTH have a three byte length header: 0x01 and
+// then the length as 16 bits. In memory, the first three bytes are rotated, so that the
+// length is in the two bytes before the packet and the packet starts with 0x01 in place
+// of its length. This keeps the type and other fields at the same offsets as in a short packet.
 #define MQTT_SN_MAX_PACKET_LENGTH  (255)
 #define MQTT_SN_MAX_PAYLOAD_LENGTH (MQTT_SN_MAX_PACKET_LENGTH-7)
+#define MQTT_SN_MAX_LONG_PACKET_LENGTH  (MQTT_SN_MAX_DATAGRAM_LENGTH)
+#define MQTT_SN_MAX_LONG_PAYLOAD_LENGTH (MQTT_SN_MAX_LONG_PACKET_LENGTH-9)
+#define MQTT_SN_PACKET_HEADROOM    (2)
 #define MQTT_SN_MAX_TOPIC_LENGTH   (MQTT_SN_MAX_PACKET_LENGTH-6)
 #define MQTT_SN_MAX_CLIENT_ID_LENGTH  (23)
 #define MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH  (252)
+#define MQTT_SN_MAX_INFLIGHT       (256)
+#define MQTT_SN_MAX_BATCH          (256)
+#define MQTT_SN_MAX_RECEIVE_BATCH  (32)
+#define MQTT_SN_MAX_EVENTS         (64)
+#define MQTT_SN_TOPIC_REGISTRY_MIN_SIZE (64)
+#define MQTT_SN_TOPIC_ARENA_BLOCK_SIZE (4096)
+// Largest UDP payload over IPv4
+#define MQTT_SN_MAX_DATAGRAM_LENGTH (65507)
+#define MQTT_SN_LOG_RING_SIZE      (65536)
+#define MQTT_SN_LOG_MAX_LINE       (2048)
+#define MQTT_SN_LOG_FLUSH_INTERVAL (50)
 
 #define MQTT_SN_TYPE_ADVERTISE     (0x00)
 #define MQTT_SN_TYPE_SEARCHGW      (0x01)
@@ -95,6 +136,13 @@
 
 #define MQTT_SN_PROTOCOL_ID  (0x01)
 
+// Formats for writing received messages to the output stream
+#define MQTT_SN_OUTPUT_TEXT    (0)
+#define MQTT_SN_OUTPUT_JSON    (1)
+#define MQTT_SN_OUTPUT_CSV     (2)
+#define MQTT_SN_OUTPUT_BINARY  (3)
+#define MQTT_SN_OUTPUT_BUFFER_SIZE (65536)
+
 typedef struct {
     uint8_t length;
     uint8_t type;
@@ -178,64 +226,386 @@ typedef struct __attribute__((packed)) {
     uint8_t type;
     uint8_t ctrl;
     uint8_t wireless_node_id[MQTT_SN_MAX_WIRELESS_NODE_ID_LENGTH];
-    char data[MQTT_SN_MAX_PACKET_LENGTH];
 }
-frwdencap_packet_t;
+frwdencap_header_t;
 
-typedef struct topic_map {
+typedef struct {
+    uint16_t message_id;
     uint16_t topic_id;
-    char topic_name[MQTT_SN_MAX_TOPIC_LENGTH];
-    struct topic_map *next;
-} topic_map_t;
+    uint8_t in_use;
+    uint8_t attempts;
+    uint32_t rto;
+    uint64_t first_sent;
+    uint64_t last_sent;
+    // Copy of the packet, in case it needs to be resent
+    uint8_t *buffer;
+    size_t buffer_size;
+} inflight_publish_t;
+
+// A topic to REGISTER or SUBSCRIBE to, as part of a pipelined batch.
+// A NULL topic name subscribes to the pre-defined topic id.
+typedef struct {
+    const char *topic_name;
+    uint16_t topic_id;
+} topic_request_t;
+
+// REGISTER or SUBSCRIBE packet waiting for a reply, indexed by message id
+typedef struct {
+    uint32_t index;
+    uint16_t message_id;
+    uint8_t in_use;
+    uint8_t attempts;
+    uint32_t rto;
+    uint64_t first_sent;
+    uint64_t last_sent;
+    uint8_t packet[MQTT_SN_MAX_PACKET_LENGTH];
+} pending_request_t;
+
+typedef struct {
+    uint16_t topic_id;
+    uint32_t name_hash;
+    const char *topic_name;
+} topic_entry_t;
+
+typedef struct topic_arena_block {
+    struct topic_arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+} topic_arena_block_t;
+
+typedef struct {
+    // Open addressing hash table keyed by topic id (0x0000 marks an empty slot)
+    topic_entry_t *entries;
+    // Open addressing hash table keyed by topic name, holding entry index + 1
+    uint32_t *name_index;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t name_slots_used;
+    // Topic names are copied into a chain of blocks, and never individually freed
+    topic_arena_block_t *arena;
+} topic_registry_t;
+
+// Topic ids and the next message id are kept in a memory-mapped file between runs,
+// so that a client that does not clean its session can skip registering its topics again
+#define MQTT_SN_SESSION_CACHE_MAGIC  "MQSNSES1"
+#define MQTT_SN_SESSION_CACHE_TOPICS (256)
+
+typedef struct {
+    uint16_t topic_id;
+    char topic_name[MQTT_SN_MAX_TOPIC_LENGTH + 1];
+} session_cache_topic_t;
+
+typedef struct {
+    char magic[8];
+    // Gateway address and port, and client id, that the session belongs to
+    char key[128];
+    uint16_t next_message_id;
+    uint16_t topic_count;
+    session_cache_topic_t topics[MQTT_SN_SESSION_CACHE_TOPICS];
+} session_cache_t;
+
+// Messages too big for a single packet can be split into chunks, each starting with this
+// header, with all numbers in network byte order. The subscriber puts them back together.
+#define MQTT_SN_CHUNK_MAGIC        "CK"
+#define MQTT_SN_CHUNK_WINDOW       (16)
+#define MQTT_SN_MAX_REASSEMBLY     (8)
+#define MQTT_SN_REASSEMBLY_TIMEOUT (30000)
+#define MQTT_SN_DEFAULT_REASSEMBLY_LIMIT (1048576)
+
+typedef struct __attribute__((packed)) {
+    char magic[2];
+    uint16_t transfer_id;
+    uint32_t offset;
+    uint32_t total_length;
+}
+chunk_header_t;
+
+// A message being put back together from its chunks
+typedef struct {
+    uint16_t topic_id;
+    uint8_t topic_type;
+    uint16_t transfer_id;
+    uint8_t in_use;
+    // Completed messages are remembered until they time out, to ignore resent chunks
+    uint8_t complete;
+    uint32_t total_length;
+    uint32_t received;
+    uint8_t *data;
+    uint8_t *received_bitmap;
+    uint64_t last_received;
+} reassembly_t;
+
+// Gateways found by sending SEARCHGW, which can be kept in a file shared between runs.
+// A gateway is forgotten once the time between its ADVERTISE packets has passed, or after
+// MQTT_SN_DEFAULT_GATEWAY_LIFETIME seconds if it has not advertised, or if it refuses a CONNECT.
+#define MQTT_SN_GATEWAY_CACHE_MAGIC      "MQSNGW01"
+#define MQTT_SN_MAX_GATEWAYS             (16)
+#define MQTT_SN_DEFAULT_GATEWAY_LIFETIME (900)
+#define MQTT_SN_DEFAULT_DISCOVERY_WAIT   (1000)
+#define MQTT_SN_SEARCHGW_RADIUS          (1)
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint8_t gateway_id;
+    uint16_t duration;          // Seconds between ADVERTISE packets, or 0 if none were received
+    uint32_t rtt;               // Microseconds from SEARCHGW to GWINFO, or UINT32_MAX if not measured
+    time_t expires;
+} gateway_info_t;
+
+typedef struct {
+    char magic[8];
+    uint16_t count;
+    gateway_info_t gateways[MQTT_SN_MAX_GATEWAYS];
+} gateway_cache_t;
+
+typedef struct {
+    uint8_t data[MQTT_SN_MAX_PACKET_LENGTH];
+    size_t length;
+} queued_packet_t;
+
+typedef struct {
+    uint8_t *data;
+    ssize_t length;
+    struct sockaddr_storage addr;
+    struct timeval timestamp;
+} received_datagram_t;
+
+typedef void (*mqtt_sn_event_handler_t)(void *data);
+
+// A file descriptor being watched by an event loop, and optionally
+// also for when it can be written to
+typedef struct {
+    mqtt_sn_event_handler_t handler;
+    mqtt_sn_event_handler_t write_handler;
+    void *data;
+} mqtt_sn_event_watch_t;
+
+// A one-shot timer with millisecond resolution
+typedef struct {
+    uint64_t deadline;
+    uint32_t heap_index;        // Position in the event loop's heap, or 0 when not running
+    uint32_t started_iteration;
+    mqtt_sn_event_handler_t handler;
+    void *data;
+} mqtt_sn_timer_t;
+
+// Waits for file descriptors to become readable and for timers to expire.
+// Uses epoll and a timerfd on Linux, and poll() elsewhere.
+typedef struct {
+    // Watches indexed by file descriptor
+    mqtt_sn_event_watch_t *watches;
+    int watches_size;
+    int watch_count;
+
+    // Binary min-heap of running timers, ordered by deadline
+    mqtt_sn_timer_t **timers;
+    uint32_t timer_count;
+    uint32_t timer_size;
+    uint32_t iteration;
+
+#ifdef __linux__
+    int epfd;
+    int timerfd;
+    uint64_t timerfd_deadline;
+#else
+    struct pollfd *pollfds;
+    int pollfds_size;
+    uint8_t pollfds_dirty;
+#endif
+} mqtt_sn_event_loop_t;
+
+// All of the state for a single client session
+// Initialise with mqtt_sn_client_init() and release with mqtt_sn_cleanup()
+typedef struct {
+    int sock;
+    FILE *output;
+    uint8_t verbose;
+
+    // Received messages are written to output in this format, and flushed
+    // at most output_flush_interval ms after the oldest unflushed message
+    uint8_t output_format;
+    uint8_t output_started;
+    uint16_t output_flush_interval;
+    uint64_t output_pending_since;
+    time_t output_second;
+    char output_time[32];
+    uint32_t timeout;           // Milliseconds to wait for a reply from the gateway
+    uint16_t next_message_id;
+    uint64_t last_transmit;
+    uint64_t last_receive;
+    time_t keep_alive;
+    uint8_t forwarder_encapsulation;
+    const uint8_t *wireless_node_id;
+    uint8_t wireless_node_id_len;
+
+    // QoS 1 PUBLISH packets waiting for a PUBACK, indexed by message id
+    inflight_publish_t inflight[MQTT_SN_MAX_INFLIGHT];
+    uint16_t inflight_count;
+    uint16_t max_inflight;
+
+    // Unacknowledged requests are resent with the DUP flag set, after a
+    // timeout estimated from the round trip time like TCP (RFC 6298)
+    uint8_t *request;
+    uint8_t *request_buffer;
+    size_t request_buffer_size;
+    uint64_t request_sent;
+    uint16_t resent_message_id;
+    uint8_t max_retries;
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+
+    // Packets queued to be sent together with a single system call
+    queued_packet_t *batch;
+    uint16_t batch_size;
+    uint16_t batch_latency;
+    uint16_t batch_count;
+    uint64_t batch_started;
+
+    // Ring of datagrams read from the socket by a single system call
+    received_datagram_t *receive_ring;
+    uint8_t *receive_buffer;
+    uint16_t receive_depth;
+    uint16_t receive_max_length;
+    uint16_t receive_count;
+    uint16_t receive_next;
+    uint8_t receive_timestamps;
+
+    // Token bucket pacing PUBLISH packets, in messages per second
+    double rate;
+    double max_rate;
+    double tokens;
+    uint16_t burst;
+    uint8_t adaptive_rate;
+    uint64_t tokens_updated;
+
+    // Space to build packets too long for the packet structures
+    uint8_t *packet_buffer;
+    size_t packet_buffer_size;
+
+    // Chunks of messages being reassembled, with a limit on the memory used for them
+    reassembly_t reassembly[MQTT_SN_MAX_REASSEMBLY];
+    uint32_t reassembly_limit;
+    uint32_t reassembly_used;
+    uint8_t partial_message;    // The last chunk joined a message that is still incomplete
+    uint8_t reassembly_failed;  // A chunk was rejected, or a message timed out incomplete
+
+    topic_registry_t topics;
+    session_cache_t *session_cache;
+    int session_cache_fd;
+
+    // Gateways found by discovery, mapped from a cache file when gateway_cache_fd is not -1
+    gateway_cache_t *gateways;
+    int gateway_cache_fd;
+
+    // Event loop used while waiting for packets from the gateway
+    mqtt_sn_event_loop_t *loop;
+    mqtt_sn_timer_t keep_alive_timer;
+    uint8_t readable;
+} mqtt_sn_client_t;
 
 
 // Library functions
-int mqtt_sn_create_socket(const char* host, const char* port, uint16_t source_port);
-void mqtt_sn_send_connect(int sock, const char* client_id, uint16_t keepalive, uint8_t clean_session);
-void mqtt_sn_send_register(int sock, const char* topic_name);
-void mqtt_sn_send_publish(int sock, uint16_t topic_id, uint8_t topic_type, const void* data, uint16_t data_len, int8_t qos, uint8_t retain);
-void mqtt_sn_send_puback(int sock, publish_packet_t* publish, uint8_t return_code);
-void mqtt_sn_send_subscribe_topic_name(int sock, const char* topic_name, uint8_t qos);
-void mqtt_sn_send_subscribe_topic_id(int sock, uint16_t topic_id, uint8_t qos);
-void mqtt_sn_send_pingreq(int sock);
-void mqtt_sn_send_disconnect(int sock, uint16_t duration);
-void mqtt_sn_receive_disconnect(int sock);
-void mqtt_sn_receive_connack(int sock);
-uint16_t mqtt_sn_receive_regack(int sock);
-uint16_t mqtt_sn_receive_suback(int sock);
-void mqtt_sn_dump_packet(char* packet);
-void mqtt_sn_print_publish_packet(publish_packet_t* packet);
-int mqtt_sn_select(int sock);
-void* mqtt_sn_wait_for(uint8_t type, int sock);
-void mqtt_sn_register_topic(int topic_id, const char* topic_name);
-const char* mqtt_sn_lookup_topic(int topic_id);
-void mqtt_sn_cleanup();
+void mqtt_sn_client_init(mqtt_sn_client_t *client);
+int mqtt_sn_create_socket(mqtt_sn_client_t *client, const char* host, const char* port, uint16_t source_port);
+void mqtt_sn_send_connect(mqtt_sn_client_t *client, const char* client_id, uint16_t keepalive, uint8_t clean_session);
+void mqtt_sn_send_register(mqtt_sn_client_t *client, const char* topic_name);
+void mqtt_sn_send_publish(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t topic_type, const void* data, uint16_t data_len, int8_t qos, uint8_t retain);
+void mqtt_sn_send_publish_chunks(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t topic_type, const void* data, size_t data_len, uint16_t chunk_size, int8_t qos);
+uint16_t mqtt_sn_send_publish_nowait(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t topic_type, const void* data, uint16_t data_len, int8_t qos, uint8_t retain);
+void mqtt_sn_send_puback(mqtt_sn_client_t *client, publish_packet_t* publish, uint8_t return_code);
+void mqtt_sn_wait_for_pubacks(mqtt_sn_client_t *client);
+void mqtt_sn_send_subscribe_topic_name(mqtt_sn_client_t *client, const char* topic_name, uint8_t qos);
+void mqtt_sn_send_subscribe_topic_id(mqtt_sn_client_t *client, uint16_t topic_id, uint8_t qos);
+void mqtt_sn_send_pingreq(mqtt_sn_client_t *client);
+void mqtt_sn_send_disconnect(mqtt_sn_client_t *client, uint16_t duration);
+void mqtt_sn_receive_disconnect(mqtt_sn_client_t *client);
+void mqtt_sn_receive_connack(mqtt_sn_client_t *client);
+uint16_t mqtt_sn_receive_regack(mqtt_sn_client_t *client);
+uint16_t mqtt_sn_receive_suback(mqtt_sn_client_t *client);
+void mqtt_sn_register_topics(mqtt_sn_client_t *client, topic_request_t *requests, uint32_t count, uint16_t window);
+void mqtt_sn_subscribe_topics(mqtt_sn_client_t *client, topic_request_t *requests, uint32_t count, uint8_t qos, uint16_t window);
+void mqtt_sn_dump_packet(mqtt_sn_client_t *client, char* packet);
+void mqtt_sn_print_publish_packet(mqtt_sn_client_t *client, publish_packet_t* packet);
+void mqtt_sn_print_message(mqtt_sn_client_t *client, const publish_packet_t* packet, const void* payload, size_t payload_len);
+int mqtt_sn_select(mqtt_sn_client_t *client);
+void* mqtt_sn_wait_for(mqtt_sn_client_t *client, uint8_t type);
+void mqtt_sn_register_topic(mqtt_sn_client_t *client, int topic_id, const char* topic_name);
+const char* mqtt_sn_lookup_topic(mqtt_sn_client_t *client, int topic_id);
+uint16_t mqtt_sn_lookup_topic_id(mqtt_sn_client_t *client, const char* topic_name);
+void mqtt_sn_open_session_cache(mqtt_sn_client_t *client, const char* path);
+void mqtt_sn_open_gateway_cache(mqtt_sn_client_t *client, const char* path);
+int mqtt_sn_discover_gateway(mqtt_sn_client_t *client, const char* address, const char* port, uint16_t source_port, uint32_t wait_ms);
+void mqtt_sn_cleanup(mqtt_sn_client_t *client);
 
 void mqtt_sn_set_debug(uint8_t value);
-void mqtt_sn_set_verbose(uint8_t value);
-void mqtt_sn_set_timeout(uint8_t value);
+void mqtt_sn_set_verbose(mqtt_sn_client_t *client, uint8_t value);
+void mqtt_sn_set_output_format(mqtt_sn_client_t *client, uint8_t format, uint16_t flush_interval);
+int mqtt_sn_parse_output_format(const char *name);
+void mqtt_sn_flush_output(mqtt_sn_client_t *client);
+void mqtt_sn_set_timeout(mqtt_sn_client_t *client, uint32_t timeout_ms);
+void mqtt_sn_set_max_inflight(mqtt_sn_client_t *client, uint16_t value);
+void mqtt_sn_set_retries(mqtt_sn_client_t *client, uint8_t value);
+void mqtt_sn_set_batch(mqtt_sn_client_t *client, uint16_t size, uint16_t max_latency);
+void mqtt_sn_set_receive_batch(mqtt_sn_client_t *client, uint16_t depth, uint16_t max_length);
+void mqtt_sn_set_reassembly(mqtt_sn_client_t *client, uint32_t limit);
+void mqtt_sn_set_rate(mqtt_sn_client_t *client, double rate, uint16_t burst, uint8_t adaptive);
+uint8_t mqtt_sn_wait_until(mqtt_sn_client_t *client, uint64_t deadline_us);
+void mqtt_sn_flush_batch(mqtt_sn_client_t *client);
+int mqtt_sn_batch_timeout(mqtt_sn_client_t *client);
+void mqtt_sn_enable_timestamps(mqtt_sn_client_t *client);
 const char* mqtt_sn_type_string(uint8_t type);
+uint8_t mqtt_sn_valid_type(uint8_t type);
 const char* mqtt_sn_return_code_string(uint8_t return_code);
 
-uint8_t mqtt_sn_validate_packet(const void *packet, size_t length);
-void mqtt_sn_send_packet(int sock, const void* data);
-void mqtt_sn_send_frwdencap_packet(int sock, const void* data, const uint8_t *wireless_node_id, uint8_t wireless_node_id_len);
-void* mqtt_sn_receive_packet(int sock);
-void* mqtt_sn_receive_frwdencap_packet(int sock, uint8_t **wireless_node_id, uint8_t *wireless_node_id_len);
+uint8_t mqtt_sn_validate_packet(mqtt_sn_client_t *client, const void *packet, size_t length);
+size_t mqtt_sn_packet_length(const void *packet);
+void* mqtt_sn_packet_from_wire(void *buffer);
+int mqtt_sn_packet_iov(const void *packet, uint8_t header[3], struct iovec *iov);
+void mqtt_sn_send_packet(mqtt_sn_client_t *client, const void* data);
+void mqtt_sn_send_frwdencap_packet(mqtt_sn_client_t *client, const void* data, const uint8_t *wireless_node_id, uint8_t wireless_node_id_len);
+void* mqtt_sn_receive_packet(mqtt_sn_client_t *client);
+void* mqtt_sn_receive_frwdencap_packet(mqtt_sn_client_t *client, uint8_t **wireless_node_id, uint8_t *wireless_node_id_len);
+int mqtt_sn_pending_packets(mqtt_sn_client_t *client);
+received_datagram_t* mqtt_sn_receive_datagram(mqtt_sn_client_t *client);
 
 // Functions to turn on and off forwarder encapsulation according to MQTT-SN Protocol Specification v1.2,
 // chapter 5.5 Forwarder Encapsulation.
-uint8_t mqtt_sn_enable_frwdencap();
-uint8_t mqtt_sn_disable_frwdencap();
+uint8_t mqtt_sn_enable_frwdencap(mqtt_sn_client_t *client);
+uint8_t mqtt_sn_disable_frwdencap(mqtt_sn_client_t *client);
 
 // Set wireless node ID and wireless node ID length
-void mqtt_sn_set_frwdencap_parameters(const uint8_t *wlnid, uint8_t wlnid_len);
-
-// Wrap mqtt-sn packet into a forwarder encapsulation packet
-frwdencap_packet_t* mqtt_sn_create_frwdencap_packet(const void *data, size_t *len, const uint8_t *wireless_node_id, uint8_t wireless_node_id_len);
-
-void mqtt_sn_log_debug(const char * format, ...);
-void mqtt_sn_log_warn(const char * format, ...);
-void mqtt_sn_log_err(const char * format, ...);
+void mqtt_sn_set_frwdencap_parameters(mqtt_sn_client_t *client, const uint8_t *wlnid, uint8_t wlnid_len);
+
+// Fill in the forwarder encapsulation header to send in front of a packet
+size_t mqtt_sn_build_frwdencap_header(frwdencap_header_t *header, const uint8_t *wireless_node_id, uint8_t wireless_node_id_len);
+
+// Event loop shared by the library and the tools
+void mqtt_sn_event_loop_init(mqtt_sn_event_loop_t *loop);
+void mqtt_sn_event_loop_cleanup(mqtt_sn_event_loop_t *loop);
+void mqtt_sn_event_watch(mqtt_sn_event_loop_t *loop, int fd, mqtt_sn_event_handler_t handler, void *data);
+void mqtt_sn_event_unwatch(mqtt_sn_event_loop_t *loop, int fd);
+void mqtt_sn_event_watch_write(mqtt_sn_event_loop_t *loop, int fd, mqtt_sn_event_handler_t handler);
+int mqtt_sn_event_loop_run_once(mqtt_sn_event_loop_t *loop, int timeout_ms);
+void mqtt_sn_timer_init(mqtt_sn_timer_t *timer, mqtt_sn_event_handler_t handler, void *data);
+void mqtt_sn_timer_start(mqtt_sn_event_loop_t *loop, mqtt_sn_timer_t *timer, uint32_t delay_ms);
+void mqtt_sn_timer_stop(mqtt_sn_event_loop_t *loop, mqtt_sn_timer_t *timer);
+uint64_t mqtt_sn_monotonic_ms();
+uint64_t mqtt_sn_monotonic_us();
+
+// Debug messages are written to stderr by a background thread, at most
+// MQTT_SN_LOG_FLUSH_INTERVAL ms later. Warnings and errors are written immediately.
+// Compiling with NDEBUG removes debug messages altogether.
+#ifdef NDEBUG
+static inline void __attribute__((format(printf, 1, 2))) mqtt_sn_log_discard(const char * format, ...) {}
+#define mqtt_sn_log_debug(...) do { if (0) mqtt_sn_log_discard(__VA_ARGS__); } while (0)
+#else
+void mqtt_sn_log_debug(const char * format, ...) __attribute__((format(printf, 1, 2)));
+#endif
+void mqtt_sn_log_warn(const char * format, ...) __attribute__((format(printf, 1, 2)));
+void mqtt_sn_log_err(const char * format, ...) __attribute__((format(printf, 1, 2)));
+void mqtt_sn_log_flush();
 
 #endif
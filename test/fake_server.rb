@@ -3,8 +3,10 @@
 # This is a 'fake' MQTT-SN server to help with testing client implementations
 #
 # It behaves in the following ways:
+#   * Responds to SEARCHGW with GWINFO
 #   * Responds to CONNECT with a successful CONACK
 #   * Responds to PUBLISH by keeping a copy of the packet
+#   * Forwards PUBLISH from another client to the last client that subscribed
 #   * Responds to SUBSCRIBE with SUBACK and a PUBLISH to the topic
 #   * Responds to PINGREQ with PINGRESP and keeps a count
 #   * Responds to DISCONNECT with a DISCONNECT packet
@@ -52,6 +54,7 @@ class MQTT::SN::FakeServer
         @port = sockets.first.local_address.ip_port
         logger.info "Started a fake MQTT-SN server on #{@address}:#{@port}"
         Socket.udp_server_loop_on(sockets) do |data, client|
+          @client = client
           response = process_packet(data)
           unless response.nil?
             response = [response] unless response.kind_of?(Enumerable)
@@ -135,11 +138,18 @@ class MQTT::SN::FakeServer
       nil
   end
 
+  def handle_searchgw(packet)
+    MQTT::SN::Packet::Gwinfo.new(:gateway_id => 1)
+  end
+
   def handle_connect(packet)
     MQTT::SN::Packet::Connack.new(:return_code => 0x00)
   end
 
   def handle_publish(packet)
+    if @subscriber and @subscriber.remote_address.inspect != @client.remote_address.inspect
+      @subscriber.reply(packet.to_s)
+    end
     if packet.qos > 0
       MQTT::SN::Packet::Puback.new(
         :id => packet.id,
@@ -154,6 +164,7 @@ class MQTT::SN::FakeServer
   end
 
   def handle_subscribe(packet, publish_data=nil)
+    @subscriber = @client
     case packet.topic_id_type
       when :short
         topic_id = packet.topic_name
@@ -0,0 +1,144 @@
+$:.unshift(File.dirname(__FILE__))
+
+require 'test_helper'
+
+class MqttSnBenchTest < Minitest::Test
+
+  def test_usage
+    @cmd_result = run_cmd('mqtt-sn-bench', '-?')
+    assert_match(/^Usage: mqtt-sn-bench/, @cmd_result[0])
+  end
+
+  def test_invalid_qos
+    @cmd_result = run_cmd('mqtt-sn-bench', ['-q', '0,2'])
+    assert_match(/ERROR Only QoS level 0 or 1 is supported/, @cmd_result[0])
+  end
+
+  def test_bench_full_window_does_not_spin
+    fake_server do |fs|
+      # Slow PUBACKs, so that the window is full most of the time
+      fs.define_singleton_method(:handle_publish) do |packet|
+        sleep(0.05)
+        super(packet)
+      end
+
+      before = Process.times
+      @cmd_result = run_cmd(
+        'mqtt-sn-bench',
+        ['-c', 1,
+         '-n', 8,
+         '-r', 0,
+         '-q', 1,
+         '-p', fs.port,
+         '-h', fs.address]
+      )
+      after = Process.times
+      @cpu = (after.cutime + after.cstime) - (before.cutime + before.cstime)
+    end
+
+    assert_includes(@cmd_result, 'Messages:    8 published, 8 acknowledged, 0 failed')
+    assert_operator(@cpu, :<, 0.15)
+  end
+
+  def test_bench_without_keep_alive
+    fake_server do |fs|
+      @cmd_result = run_cmd(
+        'mqtt-sn-bench',
+        ['-c', 2,
+         '-n', 2,
+         '-r', 0,
+         '-q', 1,
+         '-k', 0,
+         '-p', fs.port,
+         '-h', fs.address]
+      )
+    end
+
+    assert_includes(@cmd_result, 'Sessions:    2 started, 2 connected, 0 failed')
+    assert_includes(@cmd_result, 'Messages:    4 published, 4 acknowledged, 0 failed')
+  end
+
+  def test_bench_puback_timeout
+    fake_server do |fs|
+      # Never acknowledge a publish
+      def fs.handle_publish(packet)
+        nil
+      end
+
+      @start = Time.now
+      @cmd_result = run_cmd(
+        'mqtt-sn-bench',
+        ['-c', 1,
+         '-n', 1,
+         '-q', 1,
+         '--timeout', 200,
+         '-p', fs.port,
+         '-h', fs.address]
+      )
+      @duration = Time.now - @start
+    end
+
+    assert_includes(@cmd_result, 'Messages:    1 published, 0 acknowledged, 1 failed')
+    assert_operator(@duration, :<, 2)
+  end
+
+  def test_bench_drops_long_datagrams
+    fake_server do |fs|
+      # Send something longer than a short packet before the CONNACK
+      fs.define_singleton_method(:handle_connect) do |packet|
+        ["\x00" * 300, super(packet)]
+      end
+
+      @cmd_result = run_cmd(
+        'mqtt-sn-bench',
+        ['-c', 1,
+         '-n', 1,
+         '-r', 0,
+         '-p', fs.port,
+         '-h', fs.address]
+      )
+    end
+
+    assert_includes_match(/WARN  Dropping datagram longer than the 255 byte receive buffer/, @cmd_result)
+    assert_includes(@cmd_result, 'Sessions:    1 started, 1 connected, 0 failed')
+  end
+
+  def test_bench_qos_mix
+    @fs = fake_server do |fs|
+      @cmd_result = run_cmd(
+        'mqtt-sn-bench',
+        ['-c', 3,
+         '-n', 4,
+         '-r', 0,
+         '-q', '0,1',
+         '-T', 2,
+         '-i', 'test-bench-',
+         '-p', fs.port,
+         '-h', fs.address]
+      )
+    end
+
+    assert_includes(@cmd_result, 'Sessions:    3 started, 3 connected, 0 failed')
+    assert_includes(@cmd_result, 'Messages:    12 published, 6 acknowledged, 0 failed')
+    assert_includes(@cmd_result, 'Failures:    connect=0 register=0 puback=0 disconnect=0')
+    assert_includes_match(/^CONNACK\s+3\s+[\d\.]+/, @cmd_result)
+    assert_includes_match(/^REGACK\s+6\s+[\d\.]+/, @cmd_result)
+    assert_includes_match(/^PUBACK\s+6\s+[\d\.]+/, @cmd_result)
+
+    connects = @fs.packets_received.select {|p| p.class == MQTT::SN::Packet::Connect}
+    assert_equal(['test-bench-1', 'test-bench-2', 'test-bench-3'], connects.map {|p| p.client_id}.sort)
+
+    registers = @fs.packets_received.select {|p| p.class == MQTT::SN::Packet::Register}
+    assert_equal(['bench/0', 'bench/0', 'bench/0', 'bench/1', 'bench/1', 'bench/1'], registers.map {|p| p.topic_name}.sort)
+
+    publishes = @fs.packets_received.select {|p| p.class == MQTT::SN::Packet::Publish}
+    assert_equal(12, publishes.length)
+    assert_equal(6, publishes.count {|p| p.qos == 0})
+    assert_equal(6, publishes.count {|p| p.qos == 1})
+    assert_equal('abcdefghijklmnop', publishes.first.data)
+
+    disconnects = @fs.packets_received.select {|p| p.class == MQTT::SN::Packet::Disconnect}
+    assert_equal(3, disconnects.length)
+  end
+
+end
@@ -1,6 +1,7 @@
 $:.unshift(File.dirname(__FILE__))
 
 require 'test_helper'
+require 'tmpdir'
 
 class MqttSnDumpTest < Minitest::Test
 
@@ -42,6 +43,26 @@ class MqttSnDumpTest < Minitest::Test
     assert_equal(["Message for TT"], @cmd_result)
   end
 
+  def test_receive_qos_n1_normal_topic_id
+    @port = random_port
+    @cmd_result = run_cmd(
+      'mqtt-sn-dump',
+      ['-p', @port]
+    ) do |cmd|
+      publish_packet(@port,
+        MQTT::SN::Packet::Publish.new(
+          :topic_id => 1,
+          :topic_id_type => :normal,
+          :data => "Message for topic 1",
+          :qos => -1
+        )
+      )
+      wait_for_output_then_kill(cmd)
+    end
+
+    assert_equal(["Message for topic 1"], @cmd_result)
+  end
+
   def test_receive_qos_n1_debug
     @port = random_port
     @cmd_result = run_cmd(
@@ -83,6 +104,60 @@ class MqttSnDumpTest < Minitest::Test
     assert_equal(["PUBLISH: len=21 topic_id=0x5454 message_id=0x0000 data=Message for TT"], @cmd_result)
   end
 
+  def test_receive_qos_n1_burst
+    @port = random_port
+    @cmd_result = run_cmd(
+      'mqtt-sn-dump',
+      ['-p', @port]
+    ) do |cmd|
+      sleep 0.2
+      socket = UDPSocket.new
+      socket.connect('localhost', @port)
+      (1..50).each do |i|
+        socket << MQTT::SN::Packet::Publish.new(
+          :topic_id => 'TT',
+          :topic_id_type => :short,
+          :data => "Message #{i}",
+          :qos => -1
+        ).to_s
+      end
+      socket.close
+      wait_for_output_then_kill(cmd)
+    end
+
+    assert_equal((1..50).map {|i| "Message #{i}"}, @cmd_result)
+  end
+
+  def test_receive_qos_n1_threads
+    @port = random_port
+    @cmd_result = run_cmd(
+      'mqtt-sn-dump',
+      ['-j', 4, '-p', @port]
+    ) do |cmd|
+      sleep 0.2
+      hosts = ['127.0.0.1']
+      hosts << '::1' if have_ipv6?
+      hosts.each do |host|
+        (1..20).each do |i|
+          # Use a new source port for each packet, to spread them between threads
+          socket = UDPSocket.new(host.include?(':') ? Socket::AF_INET6 : Socket::AF_INET)
+          socket.send(MQTT::SN::Packet::Publish.new(
+            :topic_id => 'TT',
+            :topic_id_type => :short,
+            :data => "#{host} #{i}",
+            :qos => -1
+          ).to_s, 0, host, @port)
+          socket.close
+        end
+      end
+      wait_for_output_then_kill(cmd)
+    end
+
+    expected = ['127.0.0.1']
+    expected << '::1' if have_ipv6?
+    assert_equal(expected.product((1..20).to_a).map {|h, i| "#{h} #{i}"}.sort, @cmd_result.sort)
+  end
+
   def test_receive_qos_n1_term
     @port = random_port
     @cmd_result = run_cmd(
@@ -317,4 +392,67 @@ class MqttSnDumpTest < Minitest::Test
     assert_match(/WARN  Packet length header is not valid/, @cmd_result[0])
   end
 
+  def test_stats
+    @port = random_port
+    @cmd_result = run_cmd(
+      'mqtt-sn-dump',
+      ['--stats', 10, '-p', @port]
+    ) do |cmd|
+      publish_qos_n1_packet(@port)
+      publish_qos_n1_packet(@port)
+      publish_packet(@port, "\x00\x00\x00\x00")
+      wait_for_output_then_kill(cmd)
+    end
+
+    assert_includes_match(/WARN  Packet length header is not valid/, @cmd_result)
+    assert_includes_match(/^[\d\-]+ [\d\:]+ packets=3 bytes=46 rate=[\d\.]+\/s invalid=1$/, @cmd_result)
+    assert_includes(@cmd_result, 'type PUBLISH packets=2 bytes=42')
+    assert_includes(@cmd_result, 'source 127.0.0.1 packets=3 bytes=46')
+    assert_includes(@cmd_result, 'topic TT packets=2 bytes=42')
+    assert_includes(@cmd_result, 'size 4-7=1 16-31=2')
+  end
+
+  def test_capture_file
+    @port = random_port
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'capture.pcapng')
+      @cmd_result = run_cmd(
+        'mqtt-sn-dump',
+        ['-w', path, '-p', @port]
+      ) do |cmd|
+        publish_qos_n1_packet(@port)
+        wait_for_output_then_kill(cmd)
+      end
+      @capture = File.binread(path)
+    end
+
+    assert_empty(@cmd_result)
+
+    # Section Header, Interface Description and one Enhanced Packet Block
+    blocks = []
+    offset = 0
+    while offset < @capture.length
+      type, length = @capture.unpack("@#{offset}VV")
+      blocks << [type, @capture[offset, length]]
+      offset += length
+    end
+    assert_equal([0x0A0D0D0A, 1, 6], blocks.map(&:first))
+    assert_equal(101, blocks[1][1].unpack('@8v').first)
+
+    packet = blocks[2][1]
+    captured_length = packet.unpack('@20V').first
+    assert_equal(28 + 21, captured_length)
+    assert_in_delta(Time.now.to_f, packet.unpack('@12VV').inject {|high, low| (high << 32) + low} / 1e6, 10)
+
+    ip = packet[28, captured_length]
+    assert_equal([127, 0, 0, 1], ip.unpack('@12C4'))
+    assert_equal(@port, ip.unpack('@22n').first)
+    assert_equal(MQTT::SN::Packet::Publish.new(
+      :topic_id => 'TT',
+      :topic_id_type => :short,
+      :data => "Message for TT",
+      :qos => -1
+    ).to_s.bytes, ip[28..-1].bytes)
+  end
+
 end
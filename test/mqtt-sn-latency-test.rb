@@ -0,0 +1,53 @@
+$:.unshift(File.dirname(__FILE__))
+
+require 'test_helper'
+
+class MqttSnLatencyTest < Minitest::Test
+
+  def test_usage
+    @cmd_result = run_cmd('mqtt-sn-latency', '-?')
+    assert_match(/^Usage: mqtt-sn-latency/, @cmd_result[0])
+  end
+
+  def test_invalid_qos
+    @cmd_result = run_cmd('mqtt-sn-latency', ['-q', '2'])
+    assert_match(/ERROR Only QoS level 0 or 1 is supported/, @cmd_result[0])
+  end
+
+  def test_payload_too_small
+    @cmd_result = run_cmd('mqtt-sn-latency', ['-s', '8'])
+    assert_match(/ERROR Payload size must be between 12 and \d+ bytes/, @cmd_result[0])
+  end
+
+  def test_latency_qos1
+    @fs = fake_server do |fs|
+      @cmd_result = run_cmd(
+        'mqtt-sn-latency',
+        ['-c', 20,
+         '-r', 200,
+         '-q', 1,
+         '-s', 20,
+         '-i', 'test-latency',
+         '-p', fs.port,
+         '-h', fs.address]
+      )
+    end
+
+    # The fake server sends an extra message to the topic when subscribing
+    assert_includes(@cmd_result, 'Messages:    20 sent, 20 received, 0 lost (0.00%), 0 duplicates, 0 reordered, 1 unexpected')
+    assert_includes_match(/^PUBLISH\s+20(\s+[\d\.]+){7}$/, @cmd_result)
+
+    connects = @fs.packets_received.select {|p| p.class == MQTT::SN::Packet::Connect}
+    assert_equal(['test-latency-pub', 'test-latency-sub'], connects.map {|p| p.client_id}.sort)
+
+    publishes = @fs.packets_received.select {|p| p.class == MQTT::SN::Packet::Publish}
+    assert_equal(20, publishes.length)
+    assert_equal((0...20).to_a, publishes.map {|p| p.data.unpack('N').first})
+    assert_equal(20, publishes.first.data.length)
+    assert(publishes.all? {|p| p.qos == 1})
+
+    pubacks = @fs.packets_received.select {|p| p.class == MQTT::SN::Packet::Puback}
+    assert_equal(21, pubacks.length)
+  end
+
+end
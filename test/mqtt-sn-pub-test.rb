@@ -1,6 +1,7 @@
 $:.unshift(File.dirname(__FILE__))
 
 require 'test_helper'
+require 'tmpdir'
 
 class MqttSnPubTest < Minitest::Test
 
@@ -151,6 +152,32 @@ class MqttSnPubTest < Minitest::Test
     assert_equal(0, @packet.id)
   end
 
+  def test_publish_qos_n1_frwdencap
+    socket = UDPSocket.new
+    socket.bind('127.0.0.1', 0)
+    @cmd_result = run_cmd(
+      'mqtt-sn-pub',
+      ['--fe',
+      '--wlnid', 'node-1',
+      '-q', -1,
+      '-T', 10,
+      '-m', 'test_publish_qos_n1_frwdencap',
+      '-p', socket.addr[1],
+      '-h', '127.0.0.1']
+    )
+
+    data = socket.recvfrom(600).first
+    socket.close
+
+    assert_empty(@cmd_result)
+    assert_equal([9, 0xFE, 0x00, "node-1"], data.unpack("CCCa6"))
+    @packet = MQTT::SN::Packet.parse(data[9..-1])
+    assert_equal(MQTT::SN::Packet::Publish, @packet.class)
+    assert_equal(10, @packet.topic_id)
+    assert_equal('test_publish_qos_n1_frwdencap', @packet.data)
+    assert_equal(-1, @packet.qos)
+  end
+
   def test_publish_debug
     fake_server do |fs|
       @packet = fs.wait_for_packet(MQTT::SN::Packet::Publish) do
@@ -240,7 +267,7 @@ class MqttSnPubTest < Minitest::Test
     assert_equal(0, @packet.qos)
   end
 
-  def test_publish_from_file_too_big
+  def test_publish_from_big_file
     fake_server do |fs|
       @packet = fs.wait_for_packet(MQTT::SN::Packet::Publish) do
         @cmd_result = run_cmd(
@@ -253,14 +280,65 @@ class MqttSnPubTest < Minitest::Test
       end
     end
 
-    assert_match(/WARN  Input file is longer than the maximum message size/, @cmd_result[0])
+    assert_empty(@cmd_result)
 
     assert_equal(1, @packet.topic_id)
     assert_equal(:normal, @packet.topic_id_type)
-    assert_equal(248, @packet.data.length)
+    assert_equal(File.read('test_big.txt', :mode => 'rb'), @packet.data)
     assert_equal(0, @packet.qos)
   end
 
+  def test_publish_long_packet_qos_1
+    fake_server do |fs|
+      @packet = fs.wait_for_packet(MQTT::SN::Packet::Publish) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-q', 1,
+          '-t', 'topic',
+          '-m', 'x' * 4000,
+          '-p', fs.port,
+          '-h', fs.address]
+        )
+      end
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal('x' * 4000, @packet.data)
+    assert_equal(1, @packet.qos)
+  end
+
+  def test_publish_file_in_chunks
+    fake_server do |fs|
+      @publishes = []
+      publishes = @publishes
+      fs.define_singleton_method(:handle_publish) do |packet|
+        publishes << packet
+        super(packet)
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-q', 1,
+          '--chunk', 500,
+          '-t', 'topic',
+          '-f', 'test_big.txt',
+          '-p', fs.port,
+          '-h', fs.address]
+        )
+      end
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal(3, @publishes.length)
+    headers = @publishes.map { |packet| packet.data.unpack('a2nNN') }
+    assert_equal(['CK'] * 3, headers.map { |header| header[0] })
+    assert_equal(1, headers.map { |header| header[1] }.uniq.length)
+    assert_equal([0, 500, 1000], headers.map { |header| header[2] })
+    assert_equal([1343] * 3, headers.map { |header| header[3] })
+    assert_equal(File.read('test_big.txt', :mode => 'rb'), @publishes.map { |packet| packet.data[12..-1] }.join)
+  end
+
   def test_publish_from_file_hyphen
     fake_server do |fs|
       @packet = fs.wait_for_packet(MQTT::SN::Packet::Publish) do
@@ -322,6 +400,208 @@ class MqttSnPubTest < Minitest::Test
     assert_equal([0, 0, 0], publish_packets.map {|p| p.qos})
   end
 
+  def test_publish_multiline_batched
+    server = fake_server do |fs|
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-t', 'topic',
+          '-l',
+          '--batch', 2,
+          '-p', fs.port,
+          '-h', fs.address],
+          "Message 1\nMessage 2\nMessage 3\n"
+        )
+      end
+    end
+
+    publish_packets = server.packets_received.select do |packet|
+      packet.is_a?(MQTT::SN::Packet::Publish)
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal(['Message 1', 'Message 2', 'Message 3'], publish_packets.map {|p| p.data})
+    assert_kind_of(MQTT::SN::Packet::Disconnect, server.packets_received.last)
+  end
+
+  def test_publish_multiline_batch_latency
+    fake_server do |fs|
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-t', 'topic',
+          '-l',
+          '--batch', 10,
+          '--batch-latency', 50,
+          '-p', fs.port,
+          '-h', fs.address]
+        ) do |io|
+          # Keep STDIN open for much longer than the batch latency
+          io.write("Message 1\nMessage 2\n")
+          io.flush
+          sleep(0.5)
+          @early = fs.packets_received.select {|p| p.is_a?(MQTT::SN::Packet::Publish)}.map {|p| p.data}
+          io.write("Message 3\n")
+        end
+      end
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal(['Message 1', 'Message 2'], @early)
+  end
+
+  def test_publish_multiline_batched_qos_n1
+    server = fake_server do |fs|
+      @cmd_result = run_cmd(
+        'mqtt-sn-pub',
+        ['-q', -1,
+        '-T', 10,
+        '-l',
+        '--batch', 10,
+        '-p', fs.port,
+        '-h', fs.address],
+        "Message 1\nMessage 2\nMessage 3\n"
+      )
+      fs.wait_for_packet(MQTT::SN::Packet::Publish)
+      sleep(0.1)
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal(['Message 1', 'Message 2', 'Message 3'], server.packets_received.map {|p| p.data})
+  end
+
+  def test_publish_discover_gateway
+    server = fake_server do |fs|
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-d',
+          '--discover',
+          '--discover-wait', 200,
+          '-t', 'topic',
+          '-m', 'message',
+          '-p', fs.port,
+          '-h', fs.address]
+        )
+      end
+    end
+
+    assert_includes_match(/Received GWINFO from gateway 1 in [\d\.]+ ms/, @cmd_result)
+    assert_includes_match(/Selected gateway 1 at 127\.0\.0\.1 port #{server.port}/, @cmd_result)
+    assert_equal(
+      [MQTT::SN::Packet::Searchgw, MQTT::SN::Packet::Connect, MQTT::SN::Packet::Register,
+       MQTT::SN::Packet::Publish, MQTT::SN::Packet::Disconnect],
+      server.packets_received.map {|p| p.class}
+    )
+    assert_equal(1, server.packets_received.first.radius)
+  end
+
+  def test_publish_discover_no_gateway
+    fake_server do |fs|
+      def fs.handle_searchgw(packet)
+        nil
+      end
+
+      @cmd_result = run_cmd(
+        'mqtt-sn-pub',
+        ['--discover',
+        '--discover-wait', 100,
+        '-t', 'topic',
+        '-m', 'message',
+        '-p', fs.port,
+        '-h', fs.address]
+      )
+    end
+
+    assert_match(/No MQTT-SN gateways found/, @cmd_result[0])
+  end
+
+  def test_publish_gateway_cache
+    Dir.mktmpdir do |dir|
+      cache = File.join(dir, 'gateways')
+      fake_server do |fs|
+        args = ['--gateway-cache', cache,
+                '--discover-wait', 100,
+                '-t', 'topic',
+                '-m', 'message',
+                '-p', fs.port,
+                '-h', fs.address]
+
+        fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+          run_cmd('mqtt-sn-pub', args)
+        end
+        assert_kind_of(MQTT::SN::Packet::Searchgw, fs.packets_received.first)
+
+        # The second run connects to the cached gateway without searching
+        fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+          run_cmd('mqtt-sn-pub', args)
+        end
+        assert_kind_of(MQTT::SN::Packet::Connect, fs.packets_received.first)
+
+        # A gateway that rejects the connection is forgotten
+        def fs.handle_connect(packet)
+          MQTT::SN::Packet::Connack.new(:return_code => 0x01)
+        end
+        @cmd_result = run_cmd('mqtt-sn-pub', args)
+        assert_match(/CONNECT error: Rejected: congestion/, @cmd_result[0])
+
+        fs.packets_received.clear
+        run_cmd('mqtt-sn-pub', args)
+        assert_kind_of(MQTT::SN::Packet::Searchgw, fs.packets_received.first)
+      end
+    end
+  end
+
+  def test_publish_multiline_from_file
+    long_line = 'x' * 2000
+    Dir.mktmpdir do |dir|
+      filename = File.join(dir, 'lines.txt')
+      File.write(filename, "Message 1\r\n#{long_line}\n\nMessage 3\n")
+      @server = fake_server do |fs|
+        fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+          @cmd_result = run_cmd(
+            'mqtt-sn-pub',
+            ['-t', 'topic',
+            '-f', filename,
+            '-l',
+            '-p', fs.port,
+            '-h', fs.address]
+          )
+        end
+      end
+    end
+
+    publish_packets = @server.packets_received.select do |packet|
+      packet.is_a?(MQTT::SN::Packet::Publish)
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal(['Message 1', long_line, '', 'Message 3'], publish_packets.map {|p| p.data})
+  end
+
+  def test_publish_multiline_long_line_from_stdin
+    long_line = 'y' * 1000
+    server = fake_server do |fs|
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-t', 'topic',
+          '-l',
+          '-p', fs.port,
+          '-h', fs.address],
+          "Message 1\n#{long_line}\n"
+        )
+      end
+    end
+
+    publish_packets = server.packets_received.select do |packet|
+      packet.is_a?(MQTT::SN::Packet::Publish)
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal(['Message 1', long_line], publish_packets.map {|p| p.data})
+  end
+
   def test_publish_multiline_from_stdin_no_newline
     server = fake_server do |fs|
       fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
@@ -507,6 +787,314 @@ class MqttSnPubTest < Minitest::Test
     assert_includes_match(/Timed out while waiting for a PUBACK from gateway/, @cmd_result)
   end
 
+  def test_publish_qos_1_puback_timeout_ms
+    fake_server do |fs|
+      def fs.handle_publish(packet)
+        nil
+      end
+
+      @packet = fs.wait_for_packet(MQTT::SN::Packet::Publish) do
+        started = Time.now
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          '-q' => 1,
+          '-d' => '',
+          '--timeout' => 200,
+          '-t' => 'topic',
+          '-m' => 'test_publish_qos_1',
+          '-p' => fs.port,
+          '-h' => fs.address
+        )
+        @elapsed = Time.now - started
+      end
+    end
+
+    assert_includes_match(/Network timeout is: 200 ms/, @cmd_result)
+    assert_includes_match(/Timed out while waiting for a PUBACK from gateway/, @cmd_result)
+    assert_operator(@elapsed, :<, 1.0)
+  end
+
+  def test_publish_qos_1_resend_with_dup
+    fake_server do |fs|
+      @publishes = []
+      publishes = @publishes
+      fs.define_singleton_method(:handle_publish) do |packet|
+        publishes << packet
+        if publishes.length > 1
+          MQTT::SN::Packet::Puback.new(
+            :id => packet.id,
+            :topic_id => packet.topic_id,
+            :return_code => 0x00
+          )
+        end
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          '-q' => 1,
+          '-d' => '',
+          '-t' => 'topic',
+          '-m' => 'test_publish_qos_1_resend',
+          '-p' => fs.port,
+          '-h' => fs.address
+        )
+      end
+    end
+
+    assert_equal(2, @publishes.length)
+    assert_equal(false, @publishes[0].duplicate)
+    assert_equal(true, @publishes[1].duplicate)
+    assert_equal(@publishes[0].id, @publishes[1].id)
+    assert_equal('test_publish_qos_1_resend', @publishes[1].data)
+    assert_includes_match(/Resending PUBLISH packet/, @cmd_result)
+    assert_includes_match(/Received PUBACK/, @cmd_result)
+    assert(@cmd_result.none? { |line| line =~ /Failed to receive PUBACK/ })
+  end
+
+  def test_publish_qos_1_inflight_resend
+    fake_server do |fs|
+      @publishes = []
+      publishes = @publishes
+      fs.define_singleton_method(:handle_publish) do |packet|
+        publishes << packet
+        if packet.duplicate or packet.id % 2 == 0
+          MQTT::SN::Packet::Puback.new(
+            :id => packet.id,
+            :topic_id => packet.topic_id,
+            :return_code => 0x00
+          )
+        end
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-q', 1,
+          '-d',
+          '--inflight', 4,
+          '-t', 'topic',
+          '-l',
+          '-p', fs.port,
+          '-h', fs.address],
+          "a\nb\nc\nd\n"
+        )
+      end
+    end
+
+    duplicates = @publishes.select { |packet| packet.duplicate }
+    assert_equal(6, @publishes.length)
+    assert_equal(['b', 'd'], duplicates.map { |packet| packet.data }.sort)
+    assert(@cmd_result.none? { |line| line =~ /Failed to receive PUBACK/ })
+  end
+
+  def test_publish_rate
+    fake_server do |fs|
+      @times = []
+      times = @times
+      fs.define_singleton_method(:handle_publish) do |packet|
+        times << Time.now
+        super(packet)
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['--rate', 20,
+          '-t', 'topic',
+          '-l',
+          '-p', fs.port,
+          '-h', fs.address],
+          "1\n2\n3\n4\n5\n6\n"
+        )
+      end
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal(6, @times.length)
+    assert_operator(@times.last - @times.first, :>=, 0.2)
+  end
+
+  def test_publish_interval_count
+    fake_server do |fs|
+      @publishes = []
+      publishes = @publishes
+      fs.define_singleton_method(:handle_publish) do |packet|
+        publishes << [Time.now, packet.data]
+        super(packet)
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['--interval', 100,
+          '--count', 3,
+          '-t', 'topic',
+          '-m', 'tick',
+          '-p', fs.port,
+          '-h', fs.address]
+        )
+      end
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal(['tick'] * 3, @publishes.map { |time, data| data })
+    assert_in_delta(0.2, @publishes.last[0] - @publishes.first[0], 0.05)
+  end
+
+  def test_publish_adaptive_rate_congestion
+    fake_server do |fs|
+      @publishes = []
+      publishes = @publishes
+      fs.define_singleton_method(:handle_publish) do |packet|
+        publishes << packet
+        MQTT::SN::Packet::Puback.new(
+          :id => packet.id,
+          :topic_id => packet.topic_id,
+          :return_code => publishes.length == 1 ? 0x01 : 0x00
+        )
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-q', 1,
+          '-d',
+          '--rate', 50,
+          '--adaptive',
+          '-t', 'topic',
+          '-m', 'message',
+          '-p', fs.port,
+          '-h', fs.address]
+        )
+      end
+    end
+
+    assert_equal(2, @publishes.length)
+    assert_equal(['message', 'message'], @publishes.map { |packet| packet.data })
+    assert_equal(@publishes[0].id, @publishes[1].id)
+    assert_includes_match(/Gateway is congested, reducing rate to 25.0 messages per second/, @cmd_result)
+    assert(@cmd_result.none? { |line| line =~ /PUBLISH failed/ })
+  end
+
+  def test_publish_session_cache
+    Dir.mktmpdir do |dir|
+      cache = File.join(dir, 'session')
+      fake_server do |fs|
+        @registers = []
+        registers = @registers
+        fs.define_singleton_method(:handle_register) do |packet|
+          registers << packet
+          super(packet)
+        end
+
+        @packets = (1..2).map do |i|
+          fs.wait_for_packet(MQTT::SN::Packet::Publish) do
+            @cmd_result = run_cmd(
+              'mqtt-sn-pub',
+              '-c' => '',
+              '-q' => 1,
+              '-i' => 'test_session_cache',
+              '--cache' => cache,
+              '-t' => 'topic',
+              '-m' => "message #{i}",
+              '-p' => fs.port,
+              '-h' => fs.address
+            )
+          end
+        end
+      end
+    end
+
+    assert_equal(1, @registers.length)
+    assert_equal([1, 1], @packets.map { |packet| packet.topic_id })
+    assert_equal(['message 1', 'message 2'], @packets.map { |packet| packet.data })
+    assert_equal(@packets[0].id + 1, @packets[1].id)
+  end
+
+  def test_publish_session_cache_clean_session
+    Dir.mktmpdir do |dir|
+      cache = File.join(dir, 'session')
+      fake_server do |fs|
+        @registers = []
+        registers = @registers
+        fs.define_singleton_method(:handle_register) do |packet|
+          registers << packet
+          super(packet)
+        end
+
+        ['-c', '-d'].each do |flag|
+          fs.wait_for_packet(MQTT::SN::Packet::Publish) do
+            @cmd_result = run_cmd(
+              'mqtt-sn-pub',
+              flag => '',
+              '-i' => 'test_session_cache',
+              '--cache' => cache,
+              '-t' => 'topic',
+              '-m' => 'message',
+              '-p' => fs.port,
+              '-h' => fs.address
+            )
+          end
+        end
+      end
+    end
+
+    assert_equal(2, @registers.length)
+    assert_includes_match(/Starting new session cache/, @cmd_result)
+  end
+
+  def test_publish_qos_1_inflight_window
+    server = fake_server do |fs|
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-q', 1,
+          '--inflight', 3,
+          '-t', 'topic',
+          '-l',
+          '-p', fs.port,
+          '-h', fs.address],
+          "Message 1\nMessage 2\nMessage 3\nMessage 4\nMessage 5\n"
+        )
+      end
+    end
+
+    publish_packets = server.packets_received.select do |packet|
+      packet.is_a?(MQTT::SN::Packet::Publish)
+    end
+
+    assert_empty(@cmd_result)
+    assert_equal(['Message 1', 'Message 2', 'Message 3', 'Message 4', 'Message 5'], publish_packets.map {|p| p.data})
+    assert_equal([2, 3, 4, 5, 6], publish_packets.map {|p| p.id})
+    assert_equal([1, 1, 1, 1, 1], publish_packets.map {|p| p.qos})
+  end
+
+  def test_publish_qos_1_inflight_puback_timeout
+    fake_server do |fs|
+      def fs.handle_publish(packet)
+        nil
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-pub',
+          ['-q', 1,
+          '--inflight', 2,
+          '-k', 2,
+          '-t', 'topic',
+          '-l',
+          '-p', fs.port,
+          '-h', fs.address],
+          "Message 1\nMessage 2\n"
+        )
+      end
+    end
+
+    assert_includes_match(/WARN  Failed to receive PUBACK after PUBLISH \(message id 0x0002\)/, @cmd_result)
+    assert_includes_match(/WARN  Failed to receive PUBACK after PUBLISH \(message id 0x0003\)/, @cmd_result)
+  end
+
   def test_publish_ipv6
     unless have_ipv6?
       skip("IPv6 is not available on this system")
@@ -544,7 +1132,7 @@ class MqttSnPubTest < Minitest::Test
       @cmd_result = run_cmd(
         'mqtt-sn-pub',
         ['-t', 'topic',
-        '-m', 'm' * 255,
+        '-m', 'm' * 65499,
         '-p', fs.port,
         '-h', fs.address]
       )
@@ -1,6 +1,9 @@
 $:.unshift(File.dirname(__FILE__))
 
 require 'test_helper'
+require 'pty'
+require 'io/console'
+require 'socket'
 
 class MqttSnSerialBridgeTest < Minitest::Test
 
@@ -9,4 +12,135 @@ class MqttSnSerialBridgeTest < Minitest::Test
     assert_match(/^Usage: mqtt-sn-serial-bridge/, @cmd_result[0])
   end
 
+  def test_unsupported_device_baud
+    @cmd_result = run_cmd('mqtt-sn-serial-bridge', '/dev/null:1234')
+    assert_match(/^Unsupported baud rate: 1234/, @cmd_result[0])
+  end
+
+  def test_multiple_devices
+    ptys = 2.times.map { PTY.open }
+    ptys.each { |master, slave| master.raw! }
+    udp = UDPSocket.new
+    udp.bind('127.0.0.1', 0)
+
+    devices = [ptys[0][1].path + ':115200:radio-a', ptys[1][1].path]
+    @cmd_result = run_cmd('mqtt-sn-serial-bridge', ['-p', udp.addr[1], devices]) do |cmd|
+      begin
+        # Wait for the serial ports to be opened and flushed
+        sleep(1.5)
+
+        ptys.each_with_index do |(master, slave), i|
+          # Send a PINGREQ from the device
+          master.write("\x02\x16")
+          assert IO.select([udp], nil, nil, 2)
+          data, addr = udp.recvfrom(600)
+          header = data[0, data.getbyte(0)]
+          assert_equal(0xFE, header.getbyte(1))
+          assert_equal(['radio-a', File.basename(slave.path)][i], header[3..-1])
+          assert_equal("\x02\x16", data[header.length..-1])
+
+          # Reply with a PINGRESP, which should only reach the same device
+          udp.send(header + "\x02\x17", 0, addr[3], addr[1])
+          assert IO.select([master], nil, nil, 2)
+          assert_equal("\x02\x17", master.read_nonblock(10))
+          other = ptys[1 - i][0]
+          assert_nil IO.select([other], nil, nil, 0.2)
+        end
+      ensure
+        Process.kill('INT', cmd.pid)
+      end
+    end
+
+    assert_equal([], @cmd_result)
+  end
+
+  def test_slow_device_does_not_block_others
+    ptys = 2.times.map { PTY.open }
+    ptys.each { |master, slave| master.raw! }
+    udp = UDPSocket.new
+    udp.bind('127.0.0.1', 0)
+
+    devices = ptys.map { |master, slave| slave.path }
+    @cmd_result = run_cmd('mqtt-sn-serial-bridge', ['-p', udp.addr[1], devices]) do |cmd|
+      begin
+        # Wait for the serial ports to be opened and flushed
+        sleep(1.5)
+
+        headers = ptys.map do |master, slave|
+          master.write("\x02\x16")
+          assert IO.select([udp], nil, nil, 2)
+          data, @addr = udp.recvfrom(600)
+          data[0, data.getbyte(0)]
+        end
+
+        # Far more long packets for the first device than its port can hold, while nothing reads it
+        body = [0x0C, 0x00, 0x00, 0x01, 0x00, 0x00].pack('C*') + 'x' * 30000
+        packet = [0x01, body.length + 3].pack('Cn') + body
+        8.times do
+          udp.send(headers[0] + packet, 0, @addr[3], @addr[1])
+          sleep(0.01)
+        end
+
+        # The second device still gets its reply straight away
+        udp.send(headers[1] + "\x02\x17", 0, @addr[3], @addr[1])
+        assert IO.select([ptys[1][0]], nil, nil, 1)
+        assert_equal("\x02\x17", ptys[1][0].read_nonblock(10))
+
+        # Then everything queued for the first device arrives
+        received = ''.b
+        while received.length < packet.length * 8 && IO.select([ptys[0][0]], nil, nil, 2)
+          received << ptys[0][0].read_nonblock(65536)
+        end
+        assert_equal(packet * 8, received)
+      ensure
+        Process.kill('INT', cmd.pid)
+      end
+    end
+
+    assert_equal([], @cmd_result)
+  end
+
+  def test_framing_resynchronises
+    master, slave = PTY.open
+    master.raw!
+    udp = UDPSocket.new
+    udp.bind('127.0.0.1', 0)
+
+    @cmd_result = run_cmd('mqtt-sn-serial-bridge', ['-p', udp.addr[1], slave.path]) do |cmd|
+      begin
+        # Wait for the serial port to be opened and flushed
+        sleep(1.5)
+
+        # Garbage, which is skipped once the port goes quiet
+        master.write("\x00\xFF\x03")
+        sleep(0.3)
+
+        # A packet split over two writes
+        master.write("\x02")
+        sleep(0.01)
+        master.write("\x16")
+
+        # Two packets in a single write, around a three byte length packet
+        master.write("\x02\x16\x01\x00\x05\x16\x00\x02\x18")
+
+        # A truncated packet, which times out waiting for the rest
+        master.write("\x05\x16")
+        sleep(0.3)
+        master.write("\x02\x16")
+
+        datagrams = 5.times.map do
+          assert IO.select([udp], nil, nil, 2)
+          udp.recvfrom(600).first
+        end
+        assert_equal(["\x02\x16", "\x02\x16", "\x01\x00\x05\x16\x00", "\x02\x18", "\x02\x16"], datagrams)
+        assert_nil IO.select([udp], nil, nil, 0.2)
+      ensure
+        Process.kill('INT', cmd.pid)
+      end
+    end
+
+    assert_includes_match(/WARN  Skipped 2 bytes from/, @cmd_result)
+    assert_includes_match(/WARN  Timed out waiting for rest of packet from/, @cmd_result)
+  end
+
 end
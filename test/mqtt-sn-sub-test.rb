@@ -1,6 +1,8 @@
 $:.unshift(File.dirname(__FILE__))
 
 require 'test_helper'
+require 'json'
+require 'tmpdir'
 
 class MqttSnSubTest < Minitest::Test
 
@@ -33,6 +35,25 @@ class MqttSnSubTest < Minitest::Test
     assert_equal(true, @packet.clean_session)
   end
 
+  def test_subscribe_discover_gateway
+    server = fake_server do |fs|
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-sub',
+          ['-1',
+          '--discover',
+          '--discover-wait', 100,
+          '-t', 'test',
+          '-p', fs.port,
+          '-h', fs.address]
+        )
+      end
+    end
+
+    assert_equal(["Message for test"], @cmd_result)
+    assert_kind_of(MQTT::SN::Packet::Searchgw, server.packets_received.first)
+  end
+
   def test_custom_client_id
     fake_server do |fs|
       @packet = fs.wait_for_packet(MQTT::SN::Packet::Connect) do
@@ -95,6 +116,30 @@ class MqttSnSubTest < Minitest::Test
     assert_includes_match(/Timed out waiting for packet/, @cmd_result)
   end
 
+  def test_connack_timeout_ms
+    fake_server do |fs|
+      def fs.handle_connect(packet)
+        nil
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Connect) do
+        started = Time.now
+        @cmd_result = run_cmd(
+          'mqtt-sn-sub',
+          ['-1',
+          '--timeout', 150,
+          '-t', 'test',
+          '-p', fs.port,
+          '-h', fs.address]
+        )
+        @elapsed = Time.now - started
+      end
+    end
+
+    assert_includes_match(/ERROR Failed to connect to MQTT-SN gateway/, @cmd_result)
+    assert_operator(@elapsed, :<, 1.0)
+  end
+
   def test_subscribe_one
     fake_server do |fs|
       @packet = fs.wait_for_packet(MQTT::SN::Packet::Subscribe) do
@@ -114,6 +159,81 @@ class MqttSnSubTest < Minitest::Test
     assert_equal(0, @packet.qos)
   end
 
+  def test_subscribe_resend_with_dup
+    fake_server do |fs|
+      @subscribes = []
+      subscribes = @subscribes
+      fs.define_singleton_method(:handle_subscribe) do |packet|
+        subscribes << packet
+        super(packet) if subscribes.length > 1
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-sub',
+          ['-1', '-d',
+          '-t', 'test',
+          '-p', fs.port,
+          '-h', fs.address]
+        )
+      end
+    end
+
+    assert_equal(2, @subscribes.length)
+    assert_equal(false, @subscribes[0].duplicate)
+    assert_equal(true, @subscribes[1].duplicate)
+    assert_equal(@subscribes[0].id, @subscribes[1].id)
+    assert_includes_match(/Resending SUBSCRIBE packet/, @cmd_result)
+    assert_includes_match(/Message for test/, @cmd_result)
+  end
+
+  def test_subscribe_topic_file_pipelined
+    Dir.mktmpdir do |dir|
+      topic_file = File.join(dir, 'topics')
+      File.write(topic_file, (1..10).map { |i| "topic/#{i}\n" }.join)
+
+      fake_server do |fs|
+        @subscribes = []
+        subscribes = @subscribes
+        fs.define_singleton_method(:handle_subscribe) do |packet|
+          subscribes << packet
+          next nil if subscribes.length % 5 != 0
+
+          # Acknowledge each group of five subscriptions together, in reverse order
+          replies = subscribes.last(5).reverse.map do |request|
+            MQTT::SN::Packet::Suback.new(
+              :id => request.id,
+              :topic_id_type => :normal,
+              :topic_id => 100 + request.topic_name.split('/').last.to_i,
+              :return_code => 0
+            )
+          end
+          if subscribes.length == 10
+            replies << MQTT::SN::Packet::Publish.new(
+              :topic_id_type => :normal,
+              :topic_id => 103,
+              :data => 'Message for topic 3'
+            )
+          end
+          replies
+        end
+
+        @cmd_result = run_cmd(
+          'mqtt-sn-sub',
+          ['-1', '-v',
+          '--topic-file', topic_file,
+          '--window', 5,
+          '-p', fs.port,
+          '-h', fs.address]
+        )
+      end
+    end
+
+    assert_equal(["topic/3: Message for topic 3"], @cmd_result)
+    assert_equal((1..10).map { |i| "topic/#{i}" }, @subscribes.map { |packet| packet.topic_name })
+    assert_equal(10, @subscribes.map { |packet| packet.id }.uniq.length)
+  end
+
   def test_subscribe_one_debug
     fake_server do |fs|
       @packet = fs.wait_for_packet(MQTT::SN::Packet::Subscribe) do
@@ -175,6 +295,120 @@ class MqttSnSubTest < Minitest::Test
     assert_equal(0, @packet.qos)
   end
 
+  def test_subscribe_unknown_topic_id
+    fake_server do |fs|
+      def fs.handle_subscribe(packet)
+        replies = super(packet)
+        replies << MQTT::SN::Packet::Publish.new(
+          :topic_id_type => :normal,
+          :topic_id => 5,
+          :data => 'Message for topic 5'
+        )
+      end
+
+      fs.wait_for_packet(MQTT::SN::Packet::Disconnect) do
+        @cmd_result = run_cmd(
+          'mqtt-sn-sub',
+          ['-t', 'test',
+          '-p', fs.port,
+          '-h', fs.address]
+        ) do |cmd|
+          wait_for_output_then_kill(cmd)
+        end
+      end
+    end
+
+    assert_equal(['Message for test', 'Message for topic 5'], @cmd_result)
+  end
+
+  def test_subscribe_one_json
+    fake_server do |fs|
+      def fs.handle_subscribe(packet)
+        super(packet, "caf\u00e9 \"1\"\n")
+      end
+
+      @cmd_result = run_cmd(
+        'mqtt-sn-sub',
+        ['-1', '--format', 'json',
+        '-t', 'test',
+        '-p', fs.port,
+        '-h', fs.address]
+      )
+    end
+
+    assert_equal(1, @cmd_result.count)
+    record = JSON.parse(@cmd_result[0])
+    assert_match(/^\d{4}\-\d{2}\-\d{2}T\d{2}\:\d{2}\:\d{2}\.\d{6}Z$/, record['time'])
+    assert_equal('test', record['topic'])
+    assert_equal(1, record['topic_id'])
+    assert_equal('normal', record['topic_type'])
+    assert_equal(0, record['qos'])
+    assert_equal(false, record['retain'])
+    assert_equal("caf\u00e9 \"1\"\n", record['payload'])
+  end
+
+  def test_subscribe_one_json_binary_payload
+    fake_server do |fs|
+      def fs.handle_subscribe(packet)
+        super(packet, "\x00\x01\xff")
+      end
+
+      @cmd_result = run_cmd(
+        'mqtt-sn-sub',
+        ['-1', '--format', 'json', '--flush', 100,
+        '-T', 10,
+        '-p', fs.port,
+        '-h', fs.address]
+      )
+    end
+
+    record = JSON.parse(@cmd_result[0])
+    assert_nil(record['topic'])
+    assert_equal(10, record['topic_id'])
+    assert_equal('predefined', record['topic_type'])
+    assert_equal('AAH/', record['payload_base64'])
+  end
+
+  def test_subscribe_one_csv
+    fake_server do |fs|
+      def fs.handle_subscribe(packet)
+        super(packet, "a,\"b\"\nc")
+      end
+
+      @cmd_result = run_cmd(
+        'mqtt-sn-sub',
+        ['-1', '--format', 'csv',
+        '-t', 'test',
+        '-p', fs.port,
+        '-h', fs.address]
+      )
+    end
+
+    assert_equal('time,topic,topic_id,message_id,qos,retain,payload', @cmd_result[0])
+    assert_match(/^\d{4}\-\d{2}\-\d{2}T\d{2}\:\d{2}\:\d{2}\.\d{6}Z,test,1,0,0,0,"a,""b""$/, @cmd_result[1])
+    assert_equal('c"', @cmd_result[2])
+  end
+
+  def test_subscribe_one_binary
+    fake_server do |fs|
+      def fs.handle_subscribe(packet)
+        super(packet, "\x00binary\n")
+      end
+
+      cmd = [CMD_DIR + '/mqtt-sn-sub', '-1', '--format', 'binary', '-t', 'test', '-p', fs.port.to_s, '-h', fs.address]
+      @output = IO.popen(cmd, 'rb') { |io| io.read }
+    end
+
+    length, time, flags, topic_id, message_id, topic_length = @output.unpack('NQ>Cnnc')
+    assert_equal(@output.bytesize - 4, length)
+    assert_in_delta(Time.now.to_f, time / 1000000.0, 10)
+    assert_equal(0x00, flags)
+    assert_equal(1, topic_id)
+    assert_equal(0, message_id)
+    assert_equal(4, topic_length)
+    assert_equal("test\x00binary\n".b, @output[18..-1])
+  end
+
   def test_subscribe_one_short
     fake_server do |fs|
       @packet = fs.wait_for_packet(MQTT::SN::Packet::Subscribe) do
@@ -340,6 +574,46 @@ class MqttSnSubTest < Minitest::Test
     assert_equal("topic30: Message for topic30", @cmd_result[29])
   end
 
+  def test_subscribe_hundred_topic_ids
+    topics = (1..100).map { |t| ['-t', "topic#{t}"] }
+
+    fake_server do |fs|
+      def fs.handle_subscribe(packet)
+        number = packet.topic_name.sub('topic', '').to_i
+        response = [
+          MQTT::SN::Packet::Suback.new(
+            :id => packet.id,
+            :topic_id => 0x100 + number,
+            :return_code => 0
+          )
+        ]
+
+        # Once subscribed to every topic, publish to all of them
+        if number == 100
+          (1..100).each do |t|
+            response << MQTT::SN::Packet::Publish.new(
+              :topic_id => 0x100 + t,
+              :data => "Message for topic#{t}"
+            )
+          end
+        end
+        response
+      end
+
+      @cmd_result = run_cmd(
+        'mqtt-sn-sub',
+        ['-v',
+        topics,
+        '-p', fs.port,
+        '-h', fs.address]
+      ) do |cmd|
+        wait_for_output_then_kill(cmd, 'INT', 2)
+      end
+    end
+
+    assert_equal((1..100).map {|t| "topic#{t}: Message for topic#{t}"}, @cmd_result)
+  end
+
   def test_subscribe_invalid_topic_id
     fake_server do |fs|
       def fs.handle_subscribe(packet)
@@ -582,7 +856,7 @@ class MqttSnSubTest < Minitest::Test
     assert_match(/test: Message for test/, @cmd_result[1])
   end
 
-  def test_packet_too_long
+  def test_subscribe_long_packet
     fake_server do |fs|
       def fs.handle_subscribe(packet)
         super(packet, 'x' * 256)
@@ -601,7 +875,92 @@ class MqttSnSubTest < Minitest::Test
     end
 
     assert_includes_match(/[\d\-]+ [\d\:]+ DEBUG Received 265 bytes from/, @cmd_result)
-    assert_includes_match(/[\d\-]+ [\d\:]+ WARN  Packet received is longer than this tool can handle/, @cmd_result)
+    assert_includes(@cmd_result, "test: #{'x' * 256}")
+  end
+
+  def test_subscribe_reassemble_chunks
+    fake_server do |fs|
+      def fs.handle_subscribe(packet)
+        suback, publish = super(packet)
+        message = 'Hello chunked world'
+        chunks = [[10, message[10..-1]], [0, message[0...10]], [10, message[10..-1]]].map do |offset, data|
+          MQTT::SN::Packet::Publish.new(
+            :topic_id_type => publish.topic_id_type,
+            :topic_id => publish.topic_id,
+            :data => ['CK', 0x1234, offset, message.length].pack('a2nNN') + data
+          )
+        end
+        [suback] + chunks
+      end
+
+      @cmd_result = run_cmd(
+        'mqtt-sn-sub',
+        ['-1', '-v',
+        '--reassemble',
+        '-t', 'test',
+        '-p', fs.port,
+        '-h', fs.address]
+      )
+    end
+
+    assert_equal(["test: Hello chunked world"], @cmd_result)
+  end
+
+  def test_subscribe_reassemble_chunks_too_large
+    fake_server do |fs|
+      def fs.handle_subscribe(packet)
+        suback, publish = super(packet)
+        message = 'Hello chunked world'
+        chunk = MQTT::SN::Packet::Publish.new(
+          :topic_id_type => publish.topic_id_type,
+          :topic_id => publish.topic_id,
+          :data => ['CK', 0x1234, 0, message.length].pack('a2nNN') + message[0...10]
+        )
+        [suback, chunk]
+      end
+
+      @cmd_result = run_cmd(
+        'mqtt-sn-sub',
+        ['-1',
+        '--reassemble-limit', 10,
+        '-t', 'test',
+        '-p', fs.port,
+        '-h', fs.address]
+      )
+      @status = $?
+    end
+
+    assert_includes_match(/WARN  Not enough space to reassemble message \(transfer id 0x1234, 19 bytes\)/, @cmd_result)
+    assert_includes_match(/ERROR Failed to reassemble the message/, @cmd_result)
+    assert_equal(1, @status.exitstatus)
+  end
+
+  def test_subscribe_reassemble_chunk_outside_message
+    fake_server do |fs|
+      def fs.handle_subscribe(packet)
+        suback, publish = super(packet)
+        chunk = MQTT::SN::Packet::Publish.new(
+          :topic_id_type => publish.topic_id_type,
+          :topic_id => publish.topic_id,
+          :data => ['CK', 0x1234, 16, 19].pack('a2nNN') + 'Hello chunked'
+        )
+        [suback, chunk]
+      end
+
+      @cmd_result = run_cmd(
+        'mqtt-sn-sub',
+        ['-1',
+        '--reassemble',
+        '-t', 'test',
+        '-p', fs.port,
+        '-h', fs.address]
+      )
+      @status = $?
+    end
+
+    assert_includes_match(/WARN  Ignoring chunk outside of message \(transfer id 0x1234\)/, @cmd_result)
+    assert_includes_match(/ERROR Failed to reassemble the message/, @cmd_result)
+    assert_equal(1, @status.exitstatus)
   end
 
   def test_disconnect_after_recieve